@@ -17,7 +17,16 @@
 #include "objects/triangle.h"
 #include "render/path_trace.h"
 #include "render/spectral_path_trace.h"
+#include "render/time_budget.h"
+#include "render/frame_buffer.h"
+#include "render/denoiser.h"
+#include "render/temporal_reuse.h"
+#include "render/restir.h"
+#include "render/photon_map.h"
+#include "render/bdpt.h"
+#include "render/mlt.h"
 #include "sampling/pdf.h"
+#include "sampling/sampler.h"
 #include "scene/scene.h"
 #include "utils/hittable_list.h"
 #include "utils/output_file.h"
@@ -37,9 +46,25 @@ void execute() {
   int ny = 600;
   std::cout << "PPS(RGB): " << RGB_PPS << std::endl;
   std::cout << "PPS(SPECTRAL): " << SPECTRAL_PPS << std::endl;
-  std::cout << "ray bounce(RGB): " << RGB_MAX_RAY_DEPTH << std::endl;
-  std::cout << "ray bounce(SPECTRAL): " << SPECTRAL_MAX_RAY_DEPTH << std::endl;
+  // BDPTはBDPT_MAX_DEPTHで打ち切る
+  std::cout << "ray bounce(RGB): " << (USE_BDPT_RGB ? BDPT_MAX_DEPTH : RGB_MAX_RAY_DEPTH) << std::endl;
+  std::cout << "ray bounce(SPECTRAL): " << (USE_BDPT_SPECTRAL ? BDPT_MAX_DEPTH : SPECTRAL_MAX_RAY_DEPTH) << std::endl;
   std::cout << "wavelength sample: " << WAVELENGTH_SAMPLE_SIZE << std::endl;
+  std::cout << "temporal reuse: " << (USE_TEMPORAL_REUSE ? "on" : "off") << std::endl;
+  std::cout << "ReSTIR DI(RGB): " << (USE_RESTIR_DI_RGB ? "on" : "off") << std::endl;
+  std::cout << "path guiding: " << (USE_PATH_GUIDING ? "on" : "off") << std::endl;
+  std::cout << "photon mapping: " << (USE_PHOTON_MAPPING ? "on" : "off") << std::endl;
+  std::cout << "BDPT(RGB): " << (USE_BDPT_RGB ? "on" : "off") << std::endl;
+  std::cout << "BDPT(SPECTRAL): " << (USE_BDPT_SPECTRAL ? "on" : "off") << std::endl;
+  std::cout << "PSSMLT: " << (USE_MLT ? "on" : "off") << std::endl;
+  std::cout << "ADRRS: " << (USE_ADRRS ? "on" : "off") << std::endl;
+  std::cout << "sampler: " << SAMPLER_NAMES[SAMPLER_TYPE] << std::endl;
+  std::cout << "radiance cache: " << (USE_RADIANCE_CACHE ? "on" : "off") << std::endl;
+  std::cout << "denoiser: " << (USE_DENOISER ? "on" : "off") << std::endl;
+  std::cout << "fast math: " << (USE_FAST_MATH ? "on" : "off") << std::endl;
+  std::cout << "light BVH: " << (USE_LIGHT_BVH ? "on" : "off") << std::endl;
+  std::cout << "ray packets: " << (USE_RAY_PACKETS ? "on" : "off") << std::endl;
+  std::cout << "BVH build: " << (BVH_BUILDER == 1 ? "LBVH" : "binned SAH") << ", " << bvh_build_threads() << " threads" << std::endl;
   std::cout << "OpenMP threads: " << MAX_THREAD_NUM << " / " << omp_get_max_threads() << std::endl;
   std::cout << "========== Render ==========" << std::endl;
 
@@ -50,16 +75,120 @@ void execute() {
   output.ch = CHANNEL_NUM;
 
   // 描画開始
-  auto rgb_lights = construct_light_sampler();
-  auto spectral_lights = construct_spectral_light_sampler();
   // 波長はフルセットを使用
   auto sample_wavelengths = full_wavelengths();
 
+#if USE_PATH_GUIDING
+  /// ガイドの空間範囲はシーン全体
+  aabb scene_box;
+  construct_scene(1, RGB_END_FRAME).bounding_box(0, 1, scene_box);
+  RGB_PATH_GUIDE.reset(scene_box);
+  construct_spectral_scene(UV_LIGHT_ON_FRAME, MAX_FRAME).bounding_box(0, 1, scene_box);
+  SPECTRAL_PATH_GUIDE.reset(scene_box);
+#endif
+
+#if USE_TEMPORAL_REUSE
+  /// 前フレームの履歴
+  temporal_history history(nx, ny);
+#endif
+  /// 直接光のリザーバー(フレーム間で引き継ぐ)
+#if USE_RESTIR_DI_RGB
+  restir_di<material> rgb_restir(nx, ny);
+#endif
+#if USE_PHOTON_MAPPING
+  /// 蛍光の多いフレーム用のフォトンマッピング
+  photon_mapper photon_map(nx, ny);
+#endif
+#if USE_BDPT_RGB
+  bdpt_integrator<material> rgb_bdpt(nx, ny);
+#endif
+#if USE_BDPT_SPECTRAL
+  bdpt_integrator<spectral_material> spectral_bdpt(nx, ny);
+#endif
+#if USE_MLT
+  /// UVライトの暗いフレーム用のMLT
+  pssmlt_integrator<spectral_material> spectral_mlt(nx, ny);
+#endif
+
+  /// RGBフレームの積分器の選択(spp_mapがnullptrなら全画素spp)
+  auto rgb_pass = [&](frame_buffer &out, int spp, int frame, const hittable_list<material> &world,
+                      shared_ptr<hittable_list<material>> &lights, const std::vector<int> *spp_map) {
+#if USE_BDPT_RGB
+    rgb_bdpt.render(out, spp, world, lights, spp_map);
+#elif USE_RESTIR_DI_RGB
+    rgb_restir.render(out, spp, world, lights, spp_map);
+#else
+    rgb_render(out, spp, world, lights, frame, spp_map);
+#endif
+  };
+  /// スペクトラルフレームの積分器の種類(履歴は同じ積分器のフレーム間でだけ使う)
+  // 1: 既定, 2: フォトンマッピング, 3: MLT
+  auto spectral_frame_class = [](int frame) {
+#if USE_PHOTON_MAPPING
+    if (frame >= PHOTON_MAPPING_START_FRAME) return 2;
+#endif
+#if USE_MLT
+    if (spectral_light_t(frame) <= MLT_LIGHT_THRESHOLD) return 3;
+#endif
+    return 1;
+  };
+  /// スペクトラルフレームの積分器の選択(spp_mapがnullptrなら全画素spp)
+  auto spectral_pass = [&](frame_buffer &out, int spp, int frame, const hittable_list<spectral_material> &world,
+                           shared_ptr<hittable_list<spectral_material>> &lights, const std::vector<int> *spp_map) {
+#if USE_PHOTON_MAPPING || USE_MLT
+    int frame_class = spectral_frame_class(frame);
+#endif
+#if USE_PHOTON_MAPPING
+    if (frame_class == 2) {
+      photon_map.render(out, spp, world, lights, spp_map);
+      return;
+    }
+#endif
+#if USE_MLT
+    if (frame_class == 3) {
+      spectral_mlt.render(out, spp, world, lights, spp_map);
+      return;
+    }
+#endif
+#if USE_BDPT_SPECTRAL
+    spectral_bdpt.render(out, spp, world, lights, spp_map);
+#else
+    spectral_render(out, spp, sample_wavelengths, world, lights, frame, spp_map);
+#endif
+  };
+
+#if USE_TIME_BUDGET
+  /// パイロットパスのサンプルの配り方
+  auto spectral_pilot_kind = [&](int frame) {
+    int frame_class = spectral_frame_class(frame);
+    return frame_class == 2 ? pilot_kind::per_pass : frame_class == 3 ? pilot_kind::whole_image : pilot_kind::per_pixel;
+  };
+  /// 時間予算: 制限時間 - 安全マージン - ここまでの経過時間
+  double setup_sec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - exec_start).count() * 0.001;
+  frame_budget_planner planner(LIMIT_SEC - BUDGET_MARGIN_SEC - setup_sec, MAX_FRAME, RGB_END_FRAME);
+  // フレームクラス毎の初期見積もり(パイロットはフレームと同じ積分器で描く)
+  {
+    auto world = construct_scene(1, RGB_END_FRAME);
+    auto lights = construct_light_sampler(1, RGB_END_FRAME);
+    planner.calibrate(false, pilot_pass(nx, ny, pilot_kind::per_pixel, [&](frame_buffer &out, const std::vector<int> &spp_map) {
+      rgb_pass(out, 0, 1, world, lights, &spp_map);
+    }));
+  }
+  {
+    auto world = construct_spectral_scene(UV_LIGHT_ON_FRAME, MAX_FRAME);
+    auto lights = construct_spectral_light_sampler(UV_LIGHT_ON_FRAME);
+    planner.calibrate(true, pilot_pass(nx, ny, spectral_pilot_kind(UV_LIGHT_ON_FRAME), [&](frame_buffer &out, const std::vector<int> &spp_map) {
+      spectral_pass(out, 0, UV_LIGHT_ON_FRAME, world, lights, &spp_map);
+    }));
+  }
+#endif
+
   for (int frame = 1; frame <= MAX_FRAME; ++frame) {
-#ifndef NDEBUG
     // 時間計測開始
     start = std::chrono::system_clock::now();
-#endif
+    // 描画ループの外の乱数(シーンの構築など)もフレーム毎に決まった列にする
+    seed_random(frame, 0, 0, 0xffffffffU);
+    double render_sec = 0.0;
     /// Malloc
     output.data = (unsigned char *) malloc(sizeof(unsigned char) * output.width * output.height * output.ch);
     if (output.data == NULL) {
@@ -69,19 +198,116 @@ void execute() {
 
     /// 背景色の指定
     memset(output.data, 0xFF, output.width * output.height * output.ch);
+    frame_buffer fb(nx, ny);
 
+    int spp;
     if (frame <= RGB_END_FRAME) {
       /// RGBレンダリング
       auto world = construct_scene(frame, RGB_END_FRAME);
-      rgb_render(output.data, nx, ny, RGB_PPS, world, rgb_lights, frame);
+      // 光源サンプル用の形状はフレームの発光を持つ
+      auto rgb_lights = construct_light_sampler(frame, RGB_END_FRAME);
+#if USE_RADIANCE_CACHE
+      RGB_RADIANCE_CACHE.clear();
+#endif
+      spp = RGB_PPS;
+#if USE_TIME_BUDGET
+      {
+        // 履歴を使う画素のコストと実効サンプル数も見積もりに含める
+        double reuse_cost = 1.0, reuse_gain = 1.0;
+#if USE_TEMPORAL_REUSE
+        history.estimate(0, reuse_cost, reuse_gain);
+#endif
+        auto pilot = pilot_pass(nx, ny, pilot_kind::per_pixel, [&](frame_buffer &out, const std::vector<int> &spp_map) {
+          rgb_pass(out, 0, frame, world, rgb_lights, &spp_map);
+        });
+        spp = planner.plan(frame, pilot, reuse_cost, reuse_gain);
+      }
+#endif
+      auto render_start = std::chrono::system_clock::now();
+      auto render_pass = [&](const std::vector<int> *spp_map) {
+        rgb_pass(fb, spp, frame, world, rgb_lights, spp_map);
+      };
+#if USE_TEMPORAL_REUSE
+      if (rgb_environment()) {
+        // 環境光があると放射輝度が天井の光源の強度に比例しないので履歴を使わない
+        history.invalidate();
+        render_pass(nullptr);
+      } else {
+        history.render(fb, render_gbuffer(nx, ny, world), spp, 0, rgb_light_t(frame, RGB_END_FRAME),
+                       [&](const std::vector<int> &spp_map) { render_pass(&spp_map); });
+      }
+#else
+      render_pass(nullptr);
+#endif
+      render_sec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - render_start).count() * 0.001;
     } else {
       /// スペクトラルレンダリング
       // auto sample_wavelengths = random_sample_wavelengths();
       // auto sample_wavelengths = importance_sample_wavelengths();
       auto world = construct_spectral_scene(frame, MAX_FRAME);
-      spectral_render(output.data, nx, ny, SPECTRAL_PPS, sample_wavelengths, world, spectral_lights, frame);
+      auto spectral_lights = construct_spectral_light_sampler(frame);
+#if USE_RADIANCE_CACHE
+      SPECTRAL_RADIANCE_CACHE.clear();
+#endif
+      spp = SPECTRAL_PPS;
+      // 履歴は同じ積分器のフレーム間でだけ使う
+      int frame_class = spectral_frame_class(frame);
+#if USE_TIME_BUDGET
+      {
+        double reuse_cost = 1.0, reuse_gain = 1.0;
+#if USE_TEMPORAL_REUSE
+        history.estimate(frame_class, reuse_cost, reuse_gain);
+#endif
+        auto pilot = pilot_pass(nx, ny, spectral_pilot_kind(frame), [&](frame_buffer &out, const std::vector<int> &spp_map) {
+          spectral_pass(out, 0, frame, world, spectral_lights, &spp_map);
+        });
+        spp = planner.plan(frame, pilot, reuse_cost, reuse_gain);
+      }
+#endif
+      auto render_start = std::chrono::system_clock::now();
+      auto render_pass = [&](const std::vector<int> *spp_map) {
+        spectral_pass(fb, spp, frame, world, spectral_lights, spp_map);
+      };
+#if USE_TEMPORAL_REUSE
+      if (frame_class == 3) {
+        // MLTは画像全体を連鎖で描き、画素毎のサンプル数を指定できないので履歴を使わない
+        history.invalidate();
+        render_pass(nullptr);
+      } else {
+        history.render(fb, render_gbuffer(nx, ny, world), spp, frame_class, spectral_light_t(frame),
+                       [&](const std::vector<int> &spp_map) { render_pass(&spp_map); });
+      }
+#else
+      render_pass(nullptr);
+#endif
+      render_sec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - render_start).count() * 0.001;
     }
 
+#if USE_PATH_GUIDING
+    /// このフレームの記録でガイドを更新(次のフレームから使う)
+    if (frame <= RGB_END_FRAME) {
+      RGB_PATH_GUIDE.refine();
+    } else {
+      SPECTRAL_PATH_GUIDE.refine();
+    }
+#endif
+#if USE_ADRRS
+    /// このフレームの分散とコストを次のフレームの分岐数に使う
+    {
+      auto &rrs = frame <= RGB_END_FRAME ? RGB_RRS : SPECTRAL_RRS;
+#if ADRRS_DUMP
+      rrs.dump(std::cout, frame);
+#endif
+      rrs.refine();
+    }
+#endif
+
+#if USE_DENOISER
+    /// デノイズ
+    denoise(fb);
+#endif
+    fb.write(output.data);
+
     /// PNG出力
     std::ostringstream sout;
     sout << std::setw(3) << std::setfill('0') << frame;
@@ -92,12 +318,15 @@ void execute() {
     }
 
     freeBitmapData(&output);
-#ifndef NDEBUG
     // 時間計測終了
     end = std::chrono::system_clock::now();
     // 経過時間の算出
     double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    std::cout << "\n[" << sout.str() << "]: " << elapsed * 0.001 << "(sec)" << std::endl;
+#if USE_TIME_BUDGET
+    planner.record(frame, spp, render_sec, elapsed * 0.001);
+#endif
+#ifndef NDEBUG
+    std::cout << "\n[" << sout.str() << "]: " << elapsed * 0.001 << "(sec), spp: " << spp << std::endl;
 #endif
   }
   std::cout << "\n========== Finish ==========" << std::endl;
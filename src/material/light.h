@@ -21,6 +21,12 @@ class diffuse_light : public material {
       return ZERO;
     }
   }
+
+  double emitted_luminance() const override {
+    // テクスチャは中央の値で代表する
+    return luminance(emit->value(0.5, 0.5, ZERO_VEC3));
+  }
+
  public:
   shared_ptr<texture> emit;
 };
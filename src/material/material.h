@@ -6,6 +6,7 @@
 
 #include "../utils/texture.h"
 #include "../utils/onb.h"
+#include "../utils/fast_math.h"
 #include "../utils/hittable.h"
 #include "../sampling/pdf.h"
 
@@ -26,7 +27,7 @@ vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat) {
 double schlick(double cosine, double ref_idx) {
   double r0 = (1 - ref_idx) / (1 + ref_idx);
   r0 = r0 * r0;
-  return r0 + (1 - r0) * pow((1 - cosine), 5);
+  return r0 + (1 - r0) * pow5(1 - cosine);
 }
 
 struct scattered_record {
@@ -49,6 +50,11 @@ class material {
   virtual color emitted(const ray &r_in, const hit_record<material> &rec, double u, double v, const point3 &p) const {
     return ZERO;
   };
+
+  /// 発光の輝度の目安(光源BVHで放射束を見積もる、発光しないマテリアルは0)
+  virtual double emitted_luminance() const {
+    return 0.0;
+  }
 };
 
 /// 拡散反射面
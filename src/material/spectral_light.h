@@ -21,6 +21,12 @@ class spectral_diffuse_light : public spectral_material {
       return zero_spectra;
     }
   }
+
+  double emitted_luminance() const override {
+    // 波長毎の強度の平均
+    return emit.sum() / emit.size();
+  }
+
  public:
   spectral_distribution emit;
 };
@@ -8,6 +8,8 @@
 
 struct spectral_scattered_record {
   bool is_fluor = false;
+  // 鏡面(放射輝度キャッシュを使わない)
+  bool is_specular = false;
   spectral_distribution attenuation;
   spectral_distribution excitation;
   spectral_distribution emission;
@@ -27,6 +29,11 @@ class spectral_material {
   virtual spectral_distribution emitted(const ray &r_in, const hit_record<spectral_material> &rec, double u, double v, const point3 &p) const {
     return zero_spectra;
   };
+
+  /// 発光の強度の目安(光源BVHで放射束を見積もる、発光しないマテリアルは0)
+  virtual double emitted_luminance() const {
+    return 0.0;
+  }
 };
 
 /// 拡散反射面
@@ -1,8 +1,53 @@
 #ifndef FLUORSWITCH_SRC_OBJECTS_AARECT_H_
 #define FLUORSWITCH_SRC_OBJECTS_AARECT_H_
 
+#include <algorithm>
 #include "../utils/util_funcs.h"
 #include "../utils/hittable.h"
+#include "../sampling/spherical_sampling.h"
+
+/// 軸に垂直な長方形とレイの束の交差(activeなレイをまとめてSIMDで判定し、当たったレイにintersectと同じ値を書く)
+/// o, d: 面の軸の成分, oa, da, ob, db: 面上の2軸の成分
+template<typename mat>
+inline void aarect_intersect_packet(const hittable<mat> *rect, double k, double a0, double a1, double b0, double b1,
+                                    const double *o, const double *d,
+                                    const double *oa, const double *da, const double *ob, const double *db,
+                                    ray_packet &packet, hit_record<mat> *recs) {
+  // 束全体の区間で外れることが分かれば、レイ毎の判定をしない
+  aabb box;
+  rect->bounding_box(0, 1, box);
+  const double lo[3] = {box.min().x(), box.min().y(), box.min().z()};
+  const double hi[3] = {box.max().x(), box.max().y(), box.max().z()};
+  if (!packet.may_hit(lo, hi)) {
+    return;
+  }
+  const int chunk = 16;
+  const double t_min = packet.t_min;
+  for (int k0 = 0; k0 < packet.size; k0 += chunk) {
+    const int n = std::min(chunk, packet.size - k0);
+    double t[chunk], a[chunk], b[chunk];
+    int hit[chunk];
+#pragma omp simd
+    for (int i = 0; i < n; ++i) {
+      const int r = k0 + i;
+      t[i] = (k - o[r]) / d[r];
+      a[i] = oa[r] + t[i] * da[r];
+      b[i] = ob[r] + t[i] * db[r];
+      hit[i] = packet.active[r] && !(t[i] < t_min || packet.t_max[r] < t[i])
+          && !(a[i] < a0 || a1 < a[i] || b[i] < b0 || b1 < b[i]) ? 1 : 0;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (!hit[i]) continue;
+      hit_record<mat> &rec = recs[k0 + i];
+      rec.u = a[i];
+      rec.v = b[i];
+      rec.t = t[i];
+      rec.obj_id = rect->id;
+      rec.prim = rect;
+      packet.t_max[k0 + i] = t[i];
+    }
+  }
+}
 
 /// XY面
 template<typename mat>
@@ -13,7 +58,10 @@ class xy_rect : public hittable<mat> {
   xy_rect(double x_0, double x_1, double y_0, double y_1, double z, shared_ptr<mat> m)
       : x0(x_0), x1(x_1), y0(y_0), y1(y_1), k(z), mp(m) {};
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void intersect_packet(ray_packet &packet, hit_record<mat> *recs) const override;
+  void surface(const ray &r, hit_record<mat> &rec) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override;
   bool bounding_box(double time0, double time1, aabb &box) const override {
     box = aabb(point3(x0, y0, k - 0.0001), point3(x1, y1, k + 0.0001));
     return true;
@@ -24,17 +72,89 @@ class xy_rect : public hittable<mat> {
     if (!this->hit(ray(o, v), 0.001, INF, rec)) {
       return 0;
     }
+    return light_pdf(o, rec);
+  }
 
-    auto area = (x1 - x0) * (y1 - y0);
-    auto distance_squared = rec.t * rec.t * v.squared_length();
-    auto cosine = fabs(dot(v, rec.normal) / v.length());
+  vec3 random(const vec3 &o) const override {
+    point3 p;
+    sample_point(o, p);
+    return p - o;
+  }
 
-    return distance_squared / (cosine * area);
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override {
+    pdf_w = sample_point(o, rec.p);
+    light_surface(o, rec);
+    return pdf_w > 0.0 && pdf_w < INF;
   }
 
-  vec3 random(const vec3 &o) const override {
-    auto random_point = point3(random_double(x0, x1), random_double(y0, y1), k);
-    return random_point - o;
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override {
+    const point3 &p = rec.p;
+    if (!on_surface(p)) {
+      return 0;
+    }
+    /// 立体角で一様
+    spherical_rectangle sr(o, point3(x0, y0, k), vec3(x1 - x0, 0, 0), vec3(0, y1 - y0, 0));
+    if (sr.solid_angle >= MIN_SPHERICAL_SAMPLE_AREA) {
+      return 1.0 / sr.solid_angle;
+    }
+    return area_pdf_to_solid_angle(o, p);
+  }
+
+  /// light_pdfと同じ面上の判定だけで属性を求める(交差判定をしない)
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override {
+    if (!on_surface(rec.p)) {
+      return false;
+    }
+    light_surface(o, rec);
+    return true;
+  }
+
+  /// どちら側から発光するかは面からは決まらないので両面とする
+  bool emission_bounds(light_bounds &b) const override {
+    this->bounding_box(0, 1, b.box);
+    b.axis = vec3(0, 0, 1);
+    b.theta_o = 0.0;
+    b.theta_e = M_PI / 2;
+    b.phi = (x1 - x0) * (y1 - y0) * emission_scale(mp);
+    b.two_sided = true;
+    return true;
+  }
+
+ private:
+  /// 点が面上にあるか
+  bool on_surface(const point3 &p) const {
+    return fabs(p.z() - k) <= 0.0001 && x0 <= p.x() && p.x() <= x1 && y0 <= p.y() && p.y() <= y1;
+  }
+
+  /// 面上の点rec.pを点oから見た交差の属性(rec.t = 1)
+  void light_surface(const point3 &o, hit_record<mat> &rec) const {
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.y() - y0) / (y1 - y0);
+    rec.t = 1;
+    rec.set_face_normal(ray(o, rec.p - o), vec3(0, 0, 1));
+    rec.mat_ptr = mp;
+    rec.obj_id = this->id;
+  }
+
+  /// 近くの点からは立体角で一様に、遠くの点からは面積で一様にサンプリングし、立体角測度のpdfを返す
+  double sample_point(const point3 &o, point3 &p) const {
+    spherical_rectangle sr(o, point3(x0, y0, k), vec3(x1 - x0, 0, 0), vec3(0, y1 - y0, 0));
+    if (sr.solid_angle >= MIN_SPHERICAL_SAMPLE_AREA) {
+      p = sr.sample(random_double(), random_double());
+      // 丸め誤差で平面から外れないように
+      p[2] = k;
+      return 1.0 / sr.solid_angle;
+    }
+    p = point3(random_double(x0, x1), random_double(y0, y1), k);
+    return area_pdf_to_solid_angle(o, p);
+  }
+
+  double area_pdf_to_solid_angle(const point3 &o, const point3 &p) const {
+    vec3 d = p - o;
+    auto area = (x1 - x0) * (y1 - y0);
+    auto distance_squared = d.squared_length();
+    auto cosine = fabs(d.z()) / sqrt(distance_squared);
+    return distance_squared / (cosine * area);
   }
 
  public:
@@ -43,7 +163,7 @@ class xy_rect : public hittable<mat> {
 };
 
 template<typename mat>
-bool xy_rect<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+bool xy_rect<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
   auto t = (k - r.origin().z()) / r.direction().z();
   if (t < t_min || t_max < t) {
     return false;
@@ -53,16 +173,42 @@ bool xy_rect<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat>
   if (x < x0 || x1 < x || y < y0 || y1 < y) {
     return false;
   }
-  rec.u = (x - x0) / (x1 - x0);
-  rec.v = (y - y0) / (y1 - y0);
+  // 面上の座標はsurfaceでUVにする
+  rec.u = x;
+  rec.v = y;
   rec.t = t;
-  auto outward_normal = vec3(0, 0, 1);
-  rec.set_face_normal(r, outward_normal);
-  rec.mat_ptr = mp;
-  rec.p = r.point_at_parameter(t);
+  rec.obj_id = this->id;
+  rec.prim = this;
   return true;
 }
 
+template<typename mat>
+void xy_rect<mat>::intersect_packet(ray_packet &packet, hit_record<mat> *recs) const {
+  aarect_intersect_packet<mat>(this, k, x0, x1, y0, y1,
+                               packet.oz.data(), packet.dz.data(),
+                               packet.ox.data(), packet.dx.data(), packet.oy.data(), packet.dy.data(), packet, recs);
+}
+
+template<typename mat>
+void xy_rect<mat>::surface(const ray &r, hit_record<mat> &rec) const {
+  rec.u = (rec.u - x0) / (x1 - x0);
+  rec.v = (rec.v - y0) / (y1 - y0);
+  rec.set_face_normal(r, vec3(0, 0, 1));
+  rec.mat_ptr = mp;
+  rec.p = r.point_at_parameter(rec.t);
+}
+
+template<typename mat>
+bool xy_rect<mat>::occluded(const ray &r, double t_min, double t_max) const {
+  auto t = (k - r.origin().z()) / r.direction().z();
+  if (t < t_min || t_max < t) {
+    return false;
+  }
+  auto x = r.origin().x() + t * r.direction().x();
+  auto y = r.origin().y() + t * r.direction().y();
+  return x0 <= x && x <= x1 && y0 <= y && y <= y1;
+}
+
 /// XZ面
 template<typename mat>
 class xz_rect : public hittable<mat> {
@@ -72,7 +218,10 @@ class xz_rect : public hittable<mat> {
   xz_rect(double x_0, double x_1, double z_0, double z_1, double y, shared_ptr<mat> m)
       : x0(x_0), x1(x_1), z0(z_0), z1(z_1), k(y), mp(m) {};
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void intersect_packet(ray_packet &packet, hit_record<mat> *recs) const override;
+  void surface(const ray &r, hit_record<mat> &rec) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override;
   bool bounding_box(double time0, double time1, aabb &box) const override {
     box = aabb(point3(x0, k - 0.0001, z0), point3(x1, k + 0.0001, z1));
     return true;
@@ -83,17 +232,89 @@ class xz_rect : public hittable<mat> {
     if (!this->hit(ray(o, v), 0.001, INF, rec)) {
       return 0;
     }
+    return light_pdf(o, rec);
+  }
 
-    auto area = (x1 - x0) * (z1 - z0);
-    auto distance_squared = rec.t * rec.t * v.squared_length();
-    auto cosine = fabs(dot(v, rec.normal) / v.length());
+  vec3 random(const vec3 &o) const override {
+    point3 p;
+    sample_point(o, p);
+    return p - o;
+  }
 
-    return distance_squared / (cosine * area);
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override {
+    pdf_w = sample_point(o, rec.p);
+    light_surface(o, rec);
+    return pdf_w > 0.0 && pdf_w < INF;
   }
 
-  vec3 random(const vec3 &o) const override {
-    auto random_point = point3(random_double(x0, x1), k, random_double(z0, z1));
-    return random_point - o;
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override {
+    const point3 &p = rec.p;
+    if (!on_surface(p)) {
+      return 0;
+    }
+    /// 立体角で一様
+    spherical_rectangle sr(o, point3(x0, k, z0), vec3(x1 - x0, 0, 0), vec3(0, 0, z1 - z0));
+    if (sr.solid_angle >= MIN_SPHERICAL_SAMPLE_AREA) {
+      return 1.0 / sr.solid_angle;
+    }
+    return area_pdf_to_solid_angle(o, p);
+  }
+
+  /// light_pdfと同じ面上の判定だけで属性を求める(交差判定をしない)
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override {
+    if (!on_surface(rec.p)) {
+      return false;
+    }
+    light_surface(o, rec);
+    return true;
+  }
+
+  /// どちら側から発光するかは面からは決まらないので両面とする
+  bool emission_bounds(light_bounds &b) const override {
+    this->bounding_box(0, 1, b.box);
+    b.axis = vec3(0, 1, 0);
+    b.theta_o = 0.0;
+    b.theta_e = M_PI / 2;
+    b.phi = (x1 - x0) * (z1 - z0) * emission_scale(mp);
+    b.two_sided = true;
+    return true;
+  }
+
+ private:
+  /// 点が面上にあるか
+  bool on_surface(const point3 &p) const {
+    return fabs(p.y() - k) <= 0.0001 && x0 <= p.x() && p.x() <= x1 && z0 <= p.z() && p.z() <= z1;
+  }
+
+  /// 面上の点rec.pを点oから見た交差の属性(rec.t = 1)
+  void light_surface(const point3 &o, hit_record<mat> &rec) const {
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
+    rec.t = 1;
+    rec.set_face_normal(ray(o, rec.p - o), vec3(0, 1, 0));
+    rec.mat_ptr = mp;
+    rec.obj_id = this->id;
+  }
+
+  /// 近くの点からは立体角で一様に、遠くの点からは面積で一様にサンプリングし、立体角測度のpdfを返す
+  double sample_point(const point3 &o, point3 &p) const {
+    spherical_rectangle sr(o, point3(x0, k, z0), vec3(x1 - x0, 0, 0), vec3(0, 0, z1 - z0));
+    if (sr.solid_angle >= MIN_SPHERICAL_SAMPLE_AREA) {
+      p = sr.sample(random_double(), random_double());
+      // 丸め誤差で平面から外れないように
+      p[1] = k;
+      return 1.0 / sr.solid_angle;
+    }
+    p = point3(random_double(x0, x1), k, random_double(z0, z1));
+    return area_pdf_to_solid_angle(o, p);
+  }
+
+  double area_pdf_to_solid_angle(const point3 &o, const point3 &p) const {
+    vec3 d = p - o;
+    auto area = (x1 - x0) * (z1 - z0);
+    auto distance_squared = d.squared_length();
+    auto cosine = fabs(d.y()) / sqrt(distance_squared);
+    return distance_squared / (cosine * area);
   }
 
  public:
@@ -102,7 +323,7 @@ class xz_rect : public hittable<mat> {
 };
 
 template<typename mat>
-bool xz_rect<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+bool xz_rect<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
   auto t = (k - r.origin().y()) / r.direction().y();
   if (t < t_min || t_max < t) {
     return false;
@@ -112,16 +333,42 @@ bool xz_rect<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat>
   if (x < x0 || x1 < x || z < z0 || z1 < z) {
     return false;
   }
-  rec.u = (x - x0) / (x1 - x0);
-  rec.v = (z - z0) / (z1 - z0);
+  // 面上の座標はsurfaceでUVにする
+  rec.u = x;
+  rec.v = z;
   rec.t = t;
-  auto outward_normal = vec3(0, 1, 0);
-  rec.set_face_normal(r, outward_normal);
-  rec.mat_ptr = mp;
-  rec.p = r.point_at_parameter(t);
+  rec.obj_id = this->id;
+  rec.prim = this;
   return true;
 }
 
+template<typename mat>
+void xz_rect<mat>::intersect_packet(ray_packet &packet, hit_record<mat> *recs) const {
+  aarect_intersect_packet<mat>(this, k, x0, x1, z0, z1,
+                               packet.oy.data(), packet.dy.data(),
+                               packet.ox.data(), packet.dx.data(), packet.oz.data(), packet.dz.data(), packet, recs);
+}
+
+template<typename mat>
+void xz_rect<mat>::surface(const ray &r, hit_record<mat> &rec) const {
+  rec.u = (rec.u - x0) / (x1 - x0);
+  rec.v = (rec.v - z0) / (z1 - z0);
+  rec.set_face_normal(r, vec3(0, 1, 0));
+  rec.mat_ptr = mp;
+  rec.p = r.point_at_parameter(rec.t);
+}
+
+template<typename mat>
+bool xz_rect<mat>::occluded(const ray &r, double t_min, double t_max) const {
+  auto t = (k - r.origin().y()) / r.direction().y();
+  if (t < t_min || t_max < t) {
+    return false;
+  }
+  auto x = r.origin().x() + t * r.direction().x();
+  auto z = r.origin().z() + t * r.direction().z();
+  return x0 <= x && x <= x1 && z0 <= z && z <= z1;
+}
+
 /// YZ面
 template<typename mat>
 class yz_rect : public hittable<mat> {
@@ -131,7 +378,10 @@ class yz_rect : public hittable<mat> {
   yz_rect(double y_0, double y_1, double z_0, double z_1, double x, shared_ptr<mat> m)
       : y0(y_0), y1(y_1), z0(z_0), z1(z_1), k(x), mp(m) {};
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void intersect_packet(ray_packet &packet, hit_record<mat> *recs) const override;
+  void surface(const ray &r, hit_record<mat> &rec) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override;
   bool bounding_box(double time0, double time1, aabb &box) const override {
     box = aabb(point3(k - 0.0001, y0, z0), point3(k + 0.0001, y1, z1));
     return true;
@@ -142,17 +392,89 @@ class yz_rect : public hittable<mat> {
     if (!this->hit(ray(o, v), 0.001, INF, rec)) {
       return 0;
     }
+    return light_pdf(o, rec);
+  }
 
-    auto area = (y1 - y0) * (z1 - z0);
-    auto distance_squared = rec.t * rec.t * v.squared_length();
-    auto cosine = fabs(dot(v, rec.normal) / v.length());
+  vec3 random(const vec3 &o) const override {
+    point3 p;
+    sample_point(o, p);
+    return p - o;
+  }
 
-    return distance_squared / (cosine * area);
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override {
+    pdf_w = sample_point(o, rec.p);
+    light_surface(o, rec);
+    return pdf_w > 0.0 && pdf_w < INF;
   }
 
-  vec3 random(const vec3 &o) const override {
-    auto random_point = point3(k, random_double(y0, y1), random_double(z0, z1));
-    return random_point - o;
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override {
+    const point3 &p = rec.p;
+    if (!on_surface(p)) {
+      return 0;
+    }
+    /// 立体角で一様
+    spherical_rectangle sr(o, point3(k, y0, z0), vec3(0, y1 - y0, 0), vec3(0, 0, z1 - z0));
+    if (sr.solid_angle >= MIN_SPHERICAL_SAMPLE_AREA) {
+      return 1.0 / sr.solid_angle;
+    }
+    return area_pdf_to_solid_angle(o, p);
+  }
+
+  /// light_pdfと同じ面上の判定だけで属性を求める(交差判定をしない)
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override {
+    if (!on_surface(rec.p)) {
+      return false;
+    }
+    light_surface(o, rec);
+    return true;
+  }
+
+  /// どちら側から発光するかは面からは決まらないので両面とする
+  bool emission_bounds(light_bounds &b) const override {
+    this->bounding_box(0, 1, b.box);
+    b.axis = vec3(1, 0, 0);
+    b.theta_o = 0.0;
+    b.theta_e = M_PI / 2;
+    b.phi = (y1 - y0) * (z1 - z0) * emission_scale(mp);
+    b.two_sided = true;
+    return true;
+  }
+
+ private:
+  /// 点が面上にあるか
+  bool on_surface(const point3 &p) const {
+    return fabs(p.x() - k) <= 0.0001 && y0 <= p.y() && p.y() <= y1 && z0 <= p.z() && p.z() <= z1;
+  }
+
+  /// 面上の点rec.pを点oから見た交差の属性(rec.t = 1)
+  void light_surface(const point3 &o, hit_record<mat> &rec) const {
+    rec.u = (rec.p.y() - y0) / (y1 - y0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
+    rec.t = 1;
+    rec.set_face_normal(ray(o, rec.p - o), vec3(1, 0, 0));
+    rec.mat_ptr = mp;
+    rec.obj_id = this->id;
+  }
+
+  /// 近くの点からは立体角で一様に、遠くの点からは面積で一様にサンプリングし、立体角測度のpdfを返す
+  double sample_point(const point3 &o, point3 &p) const {
+    spherical_rectangle sr(o, point3(k, y0, z0), vec3(0, y1 - y0, 0), vec3(0, 0, z1 - z0));
+    if (sr.solid_angle >= MIN_SPHERICAL_SAMPLE_AREA) {
+      p = sr.sample(random_double(), random_double());
+      // 丸め誤差で平面から外れないように
+      p[0] = k;
+      return 1.0 / sr.solid_angle;
+    }
+    p = point3(k, random_double(y0, y1), random_double(z0, z1));
+    return area_pdf_to_solid_angle(o, p);
+  }
+
+  double area_pdf_to_solid_angle(const point3 &o, const point3 &p) const {
+    vec3 d = p - o;
+    auto area = (y1 - y0) * (z1 - z0);
+    auto distance_squared = d.squared_length();
+    auto cosine = fabs(d.x()) / sqrt(distance_squared);
+    return distance_squared / (cosine * area);
   }
 
  public:
@@ -161,7 +483,7 @@ class yz_rect : public hittable<mat> {
 };
 
 template<typename mat>
-bool yz_rect<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+bool yz_rect<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
   auto t = (k - r.origin().x()) / r.direction().x();
   if (t < t_min || t_max < t) {
     return false;
@@ -171,14 +493,40 @@ bool yz_rect<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat>
   if (y < y0 || y1 < y || z < z0 || z1 < z) {
     return false;
   }
-  rec.u = (y - y0) / (y1 - y0);
-  rec.v = (z - z0) / (z1 - z0);
+  // 面上の座標はsurfaceでUVにする
+  rec.u = y;
+  rec.v = z;
   rec.t = t;
-  auto outward_normal = vec3(1, 0, 0);
-  rec.set_face_normal(r, outward_normal);
-  rec.mat_ptr = mp;
-  rec.p = r.point_at_parameter(t);
+  rec.obj_id = this->id;
+  rec.prim = this;
   return true;
 }
 
+template<typename mat>
+void yz_rect<mat>::intersect_packet(ray_packet &packet, hit_record<mat> *recs) const {
+  aarect_intersect_packet<mat>(this, k, y0, y1, z0, z1,
+                               packet.ox.data(), packet.dx.data(),
+                               packet.oy.data(), packet.dy.data(), packet.oz.data(), packet.dz.data(), packet, recs);
+}
+
+template<typename mat>
+void yz_rect<mat>::surface(const ray &r, hit_record<mat> &rec) const {
+  rec.u = (rec.u - y0) / (y1 - y0);
+  rec.v = (rec.v - z0) / (z1 - z0);
+  rec.set_face_normal(r, vec3(1, 0, 0));
+  rec.mat_ptr = mp;
+  rec.p = r.point_at_parameter(rec.t);
+}
+
+template<typename mat>
+bool yz_rect<mat>::occluded(const ray &r, double t_min, double t_max) const {
+  auto t = (k - r.origin().x()) / r.direction().x();
+  if (t < t_min || t_max < t) {
+    return false;
+  }
+  auto y = r.origin().y() + t * r.direction().y();
+  auto z = r.origin().z() + t * r.direction().z();
+  return y0 <= y && y <= y1 && z0 <= z && z <= z1;
+}
+
 #endif //FLUORSWITCH_SRC_OBJECTS_AARECT_H_
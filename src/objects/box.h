@@ -12,11 +12,21 @@ class box : public hittable<mat> {
   box() {}
   box(const point3 &p0, const point3 &p1, shared_ptr<mat> ptr);
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void intersect_packet(ray_packet &packet, hit_record<mat> *recs) const override {
+    std::vector<double> t_before(packet.t_max.begin(), packet.t_max.begin() + packet.size);
+    sides.intersect_packet(packet, recs);
+    for (int k = 0; k < packet.size; ++k) {
+      if (packet.t_max[k] < t_before[k]) recs[k].obj_id = this->id;
+    }
+  }
   bool bounding_box(double time0, double time1, aabb &output_box) const override {
     output_box = aabb(box_min, box_max);
     return true;
   }
+  bool occluded(const ray &r, double t_min, double t_max) const override {
+    return sides.occluded(r, t_min, t_max);
+  }
 
   double pdf_value(const point3 &o, const vec3 &v) const override {
     hit_record<mat> rec;
@@ -54,8 +64,12 @@ box<mat>::box(const point3 &p0, const point3 &p1, shared_ptr<mat> ptr) {
 }
 
 template<typename mat>
-bool box<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
-  return sides.hit(r, t_min, t_max, rec);
+bool box<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+  if (!sides.intersect(r, t_min, t_max, rec)) {
+    return false;
+  }
+  rec.obj_id = this->id;
+  return true;
 }
 
 #endif //FLUORSWITCH_SRC_OBJECTS_BOX_H_
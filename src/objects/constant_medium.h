@@ -2,6 +2,7 @@
 #define FLUORSWITCH_SRC_OBJECTS_CONSTANT_MEDIUM_H_
 
 #include "../utils/hittable.h"
+#include "../utils/fast_math.h"
 #include "../material/material.h"
 
 template<typename mat>
@@ -17,7 +18,7 @@ class constant_medium : public hittable<mat> {
         neg_inv_density(-1 / d),
         phase_function(make_shared<isotropic>(c)) {}
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
 
   bool bounding_box(double t0, double t1, aabb &box) const override {
     return boundary->bounding_box(t0, t1, box);
@@ -30,7 +31,7 @@ class constant_medium : public hittable<mat> {
 };
 
 template<typename mat>
-bool constant_medium<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+bool constant_medium<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
 
   hit_record<mat> rec1, rec2;
 
@@ -54,7 +55,7 @@ bool constant_medium<mat>::hit(const ray &r, double t_min, double t_max, hit_rec
 
   const auto ray_length = r.direction().length();
   const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-  const auto hit_distance = neg_inv_density * log(random_double());
+  const auto hit_distance = neg_inv_density * fast_log(random_double());
 
   if (hit_distance > distance_inside_boundary) {
     return false;
@@ -67,6 +68,9 @@ bool constant_medium<mat>::hit(const ray &r, double t_min, double t_max, hit_rec
   rec.normal = X_UP;
   rec.front_face = true;
   rec.mat_ptr = phase_function;
+  rec.obj_id = this->id;
+  // 属性は求め終わっている
+  rec.prim = nullptr;
 
   return true;
 }
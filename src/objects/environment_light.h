@@ -0,0 +1,192 @@
+#ifndef FLUORSWITCH_SRC_OBJECTS_ENVIRONMENT_LIGHT_H_
+#define FLUORSWITCH_SRC_OBJECTS_ENVIRONMENT_LIGHT_H_
+
+#include <vector>
+#include "../utils/hittable.h"
+#include "../utils/fast_math.h"
+#include "../utils/rtw_stb_image.h"
+#include "../material/material.h"
+#include "../sampling/alias_table.h"
+
+/// HDR画像(正距円筒図法、上端が+y)の環境光
+/// UVは球と同じ(u: -xから-z側へ回る方位角、v: -yからの天頂角)
+/// 画素毎に 輝度 x sinθ に比例する別名表で画素を選び、画素内で一様に方向を選ぶ
+class environment_map {
+ public:
+  environment_map(const char *filename, double scale) {
+    int components = 3;
+    float *data = stbi_loadf(filename, &width, &height, &components, 3);
+    if (data == nullptr) {
+      std::cerr << "ERROR: Could not load environment map '" << filename << "'.\n";
+      width = height = 0;
+      return;
+    }
+    texels.resize(size_t(width) * height);
+    std::vector<double> weights(texels.size());
+    for (int j = 0; j < height; ++j) {
+      double sin_theta = sin(M_PI * (j + 0.5) / height);
+      for (int i = 0; i < width; ++i) {
+        size_t k = size_t(j) * width + i;
+        texels[k] = scale * color(data[3 * k], data[3 * k + 1], data[3 * k + 2]);
+        weights[k] = ffmax(luminance(texels[k]), 0.0) * sin_theta;
+      }
+    }
+    stbi_image_free(data);
+    table = alias_table(weights);
+  }
+
+  bool valid() const {
+    return !texels.empty();
+  }
+
+  color radiance(const vec3 &dir) const {
+    double sin_theta;
+    return texels[texel(dir, sin_theta)];
+  }
+
+  /// 方向を選び、立体角測度のpdfを返す
+  vec3 sample(double &pdf_w) const {
+    double pmf;
+    size_t k = table.sample(random_double(), pmf);
+    double u = (k % width + random_double()) / width;
+    double v = 1.0 - (k / width + random_double()) / height;
+    double sin_theta, cos_theta, sin_phi, cos_phi;
+    fast_sincos(M_PI * v, sin_theta, cos_theta);
+    fast_sincos(2 * M_PI * u, sin_phi, cos_phi);
+    pdf_w = sin_theta > 0.0 ? pmf * width * height / (2 * M_PI * M_PI * sin_theta) : 0.0;
+    return vec3(-sin_theta * cos_phi, -cos_theta, sin_theta * sin_phi);
+  }
+
+  double pdf(const vec3 &dir) const {
+    double sin_theta;
+    size_t k = texel(dir, sin_theta);
+    return sin_theta > 0.0 ? table.pmf(k) * width * height / (2 * M_PI * M_PI * sin_theta) : 0.0;
+  }
+
+ private:
+  size_t texel(const vec3 &dir, double &sin_theta) const {
+    vec3 d = unit_vector(dir);
+    double u = (fast_atan2(-d.z(), d.x()) + M_PI) * M_1_PI * 0.5;
+    double v = fast_acos(-d.y()) * M_1_PI;
+    sin_theta = sqrt(ffmax(1.0 - d.y() * d.y(), 0.0));
+    int i = std::min(std::max(int(u * width), 0), width - 1);
+    int j = std::min(std::max(int((1.0 - v) * height), 0), height - 1);
+    return size_t(j) * width + i;
+  }
+
+ private:
+  int width{0};
+  int height{0};
+  std::vector<color> texels;
+  alias_table table;
+};
+
+/// 環境光の発光(入射レイの方向で画像を引く、light_pdfと同じく見ている点からの方向)
+class environment_emitter : public material {
+ public:
+  explicit environment_emitter(shared_ptr<environment_map> m) : map(m) {}
+
+  color emitted(const ray &r_in, const hit_record<material> &rec, double u, double v, const point3 &p) const override {
+    return map->radiance(r_in.direction());
+  }
+
+ public:
+  shared_ptr<environment_map> map;
+};
+
+/// シーンを囲む大きな球の内側の面として環境光を置く
+/// ワールドに加えると外へ抜けたレイがこの面に当たり、光源のリストに加えると画像に比例して方向をサンプリングする
+/// (ワールドと光源のリストで同じインスタンスを共有し、light_pdfはマテリアルで自分の点かを判定する)
+template<typename mat>
+class environment_light : public hittable<mat> {
+ public:
+  environment_light(shared_ptr<environment_map> m, const point3 &c, double r, shared_ptr<mat> e)
+      : map(m), center(c), radius(r), emitter(e) {}
+
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override {
+    double t;
+    if (!exit_distance(r, t) || t < t_min || t_max < t) {
+      return false;
+    }
+    rec.t = t;
+    rec.obj_id = this->id;
+    rec.prim = this;
+    return true;
+  }
+
+  void surface(const ray &r, hit_record<mat> &rec) const override {
+    rec.p = r.point_at_parameter(rec.t);
+    rec.set_face_normal(r, (center - rec.p) / radius);
+    rec.mat_ptr = emitter;
+    rec.u = 0.0;
+    rec.v = 0.0;
+  }
+
+  /// 無限遠にあるのでシーンの範囲には含めない(中心の点だけ)
+  bool bounding_box(double t0, double t1, aabb &box) const override {
+    box = aabb(center, center);
+    return true;
+  }
+
+  double pdf_value(const point3 &o, const vec3 &v) const override {
+    return map->pdf(v);
+  }
+
+  vec3 random(const vec3 &o) const override {
+    double pdf_w;
+    return map->sample(pdf_w);
+  }
+
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override {
+    vec3 dir = map->sample(pdf_w);
+    ray r(o, dir);
+    double t;
+    if (pdf_w <= 0.0 || !exit_distance(r, t)) {
+      return false;
+    }
+    rec.t = t;
+    surface(r, rec);
+    rec.obj_id = this->id;
+    // 点への方向は rec.p - o
+    rec.t = 1;
+    return true;
+  }
+
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override {
+    return rec.mat_ptr == emitter ? map->pdf(rec.p - o) : 0.0;
+  }
+
+  /// 球面上の点か(交差判定をしない)
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override {
+    if (fabs((rec.p - center).length() - radius) > 0.0001 * radius) {
+      return false;
+    }
+    rec.t = 1;
+    surface(ray(o, rec.p - o), rec);
+    rec.obj_id = this->id;
+    return true;
+  }
+
+ private:
+  /// 球の内側から外へ出る距離
+  bool exit_distance(const ray &r, double &t) const {
+    vec3 oc = r.origin() - center;
+    double a = r.direction().squared_length();
+    double half_b = dot(oc, r.direction());
+    double c = oc.squared_length() - radius * radius;
+    double discriminant = half_b * half_b - a * c;
+    if (c >= 0.0 || discriminant < 0.0) {
+      return false;
+    }
+    t = (-half_b + sqrt(discriminant)) / a;
+    return true;
+  }
+
+ public:
+  shared_ptr<environment_map> map;
+  point3 center;
+  double radius;
+  shared_ptr<mat> emitter;
+};
+
+#endif //FLUORSWITCH_SRC_OBJECTS_ENVIRONMENT_LIGHT_H_
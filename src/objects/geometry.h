@@ -7,6 +7,7 @@
 #include "../../external/tinyobjloader/tiny_obj_loader.h"
 #include "../utils/util_funcs.h"
 #include "../utils/hittable.h"
+#include "../utils/bvh.h"
 #include "triangle.h"
 
 template<typename mat>
@@ -16,18 +17,22 @@ class geometry : public hittable<mat> {
   geometry(const char *file_path);
   geometry(const char *file_path, shared_ptr<mat> m);
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
   bool bounding_box(double t0, double t1, aabb &box) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override;
   vec3 random(const vec3 &o) const override;
   double pdf_value(const point3 &o, const vec3 &v) const override;
  private:
   void load_obj(const char *file_path, std::vector<vertex> &vertices);
+  void build_bvh();
 
  public:
   tinyobj::attrib_t attrib;
   std::vector<tinyobj::shape_t> shapes;
   std::vector<tinyobj::material_t> materials;
   std::vector<shared_ptr<triangle<mat>>> tris;
+  // 三角形のBVH(読み込み時に構築)
+  shared_ptr<bvh_node<mat>> tri_bvh;
 };
 
 // TODO blenderマテリアルを取得
@@ -39,6 +44,7 @@ geometry<mat>::geometry(const char *file_path) {
     shared_ptr<material> m = make_shared<lambertian>(CYAN);
     tris.push_back(make_shared<triangle<mat>>(vertices[i * 3], vertices[i * 3 + 1], vertices[i * 3 + 2], m));
   }
+  build_bvh();
 }
 
 template<typename mat>
@@ -48,6 +54,17 @@ geometry<mat>::geometry(const char *file_path, shared_ptr<mat> m) {
   for (int i = 0; i < vertices.size() / 3; ++i) {
     tris.push_back(make_shared<triangle<mat>>(vertices[i * 3], vertices[i * 3 + 1], vertices[i * 3 + 2], m));
   }
+  build_bvh();
+}
+
+/// 三角形のBVHを構築し、構築時間と木の品質を表示
+template<typename mat>
+void geometry<mat>::build_bvh() {
+  if (tris.empty()) {
+    return;
+  }
+  tri_bvh = make_shared<bvh_node<mat>>(std::vector<shared_ptr<hittable<mat>>>(tris.begin(), tris.end()), 0, tris.size(), 0, 1);
+  print_bvh_stats(std::cout, tri_bvh->stats);
 }
 
 template<typename mat>
@@ -117,19 +134,22 @@ void geometry<mat>::load_obj(const char *file_path, std::vector<vertex> &vertice
 }
 
 template<typename mat>
-bool geometry<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
-  long triangles_size = tris.size();
-  for (long i = 0; i < triangles_size; ++i) {
-    if (tris[i]->hit(r, t_min, t_max, rec)) {
-      return true;
-    }
+bool geometry<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+  if (!tri_bvh || !tri_bvh->intersect(r, t_min, t_max, rec)) {
+    return false;
   }
-  return false;
+  if (this->id != 0) rec.obj_id = this->id;
+  return true;
+}
+
+template<typename mat>
+bool geometry<mat>::occluded(const ray &r, double t_min, double t_max) const {
+  return tri_bvh && tri_bvh->occluded(r, t_min, t_max);
 }
 
 template<typename mat>
 bool geometry<mat>::bounding_box(double t0, double t1, aabb &box) const {
-  return true;
+  return tri_bvh && tri_bvh->bounding_box(t0, t1, box);
 }
 
 template<typename mat>
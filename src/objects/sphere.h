@@ -5,16 +5,23 @@
 #define RAY_OBJECTS_SPHERE_H_
 
 #include "../utils/hittable.h"
+#include "../utils/fast_math.h"
 
 template<typename mat>
 class sphere : public hittable<mat> {
  public:
   sphere();
   sphere(vec3 cen, double r, shared_ptr<mat> m) : center(cen), radius(r), mat_ptr(m) {};
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void surface(const ray &r, hit_record<mat> &rec) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override;
   bool bounding_box(double time0, double time1, aabb &box) const override;
   double pdf_value(const point3 &o, const vec3 &v) const override;
   vec3 random(const vec3 &o) const override;
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override;
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override;
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override;
+  bool emission_bounds(light_bounds &b) const override;
 
  public:
   vec3 center;
@@ -22,9 +29,24 @@ class sphere : public hittable<mat> {
   shared_ptr<mat> mat_ptr;
 
  private:
+  /// 点oが球の外にあり、点pが球面上にあるか
+  bool on_surface(const point3 &o, const point3 &p) const {
+    return (center - o).squared_length() > radius * radius && fabs((p - center).length() - radius) <= 0.0001 * radius;
+  }
+
+  /// 球面上の点rec.pを点oから見た交差の属性(rec.t = 1)
+  void light_surface(const point3 &o, hit_record<mat> &rec) const {
+    rec.t = 1;
+    vec3 outward_normal = (rec.p - center) / radius;
+    rec.set_face_normal(ray(o, rec.p - o), outward_normal);
+    get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.mat_ptr = mat_ptr;
+    rec.obj_id = this->id;
+  }
+
   static void get_sphere_uv(const point3 &p, double &u, double &v) {
-    auto theta = acos(-p.y());
-    auto phi = atan2(-p.z(), p.x()) + M_PI;
+    auto theta = fast_acos(-p.y());
+    auto phi = fast_atan2(-p.z(), p.x()) + M_PI;
 
     u = phi * M_1_PI * 0.5;
     v = theta * M_1_PI;
@@ -32,7 +54,7 @@ class sphere : public hittable<mat> {
 };
 
 template<typename mat>
-bool sphere<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+bool sphere<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
   vec3 oc = r.origin() - center;
   double a = r.direction().squared_length();
   double half_b = dot(oc, r.direction());
@@ -54,13 +76,40 @@ bool sphere<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat>
   }
 
   rec.t = root;
+  rec.obj_id = this->id;
+  rec.prim = this;
+
+  return true;
+}
+
+template<typename mat>
+void sphere<mat>::surface(const ray &r, hit_record<mat> &rec) const {
   rec.p = r.point_at_parameter(rec.t);
   vec3 outward_normal = (rec.p - center) / radius;
   rec.set_face_normal(r, outward_normal);
   get_sphere_uv(outward_normal, rec.u, rec.v);
   rec.mat_ptr = mat_ptr;
+}
 
-  return true;
+/// 2つの解のどちらかが範囲内にあるか(交差点・法線・UVは求めない)
+template<typename mat>
+bool sphere<mat>::occluded(const ray &r, double t_min, double t_max) const {
+  vec3 oc = r.origin() - center;
+  double a = r.direction().squared_length();
+  double half_b = dot(oc, r.direction());
+  double c = oc.squared_length() - radius * radius;
+
+  double discriminant = half_b * half_b - a * c;
+  if (discriminant < 0) {
+    return false;
+  }
+  auto sqrt_d = sqrt(discriminant);
+  auto root = (-half_b - sqrt_d) / a;
+  if (t_min <= root && root <= t_max) {
+    return true;
+  }
+  root = (-half_b + sqrt_d) / a;
+  return t_min <= root && root <= t_max;
 }
 
 template<typename mat>
@@ -92,6 +141,57 @@ double sphere<mat>::pdf_value(const point3 &o, const vec3 &v) const {
   return 1 / solid_angle;
 }
 
+template<typename mat>
+bool sphere<mat>::sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const {
+  vec3 direction = center - o;
+  auto distance_squared = direction.squared_length();
+  if (distance_squared <= radius * radius) {
+    return false;
+  }
+  onb uvw;
+  uvw.build_from_w(direction);
+  vec3 local = random_to_sphere(radius, distance_squared);
+  vec3 dir = uvw.local(local);
+  // 円錐内の方向から球面上の手前の交点までの距離
+  auto sin2 = ffmax(0.0, 1 - local.z() * local.z());
+  auto t = sqrt(distance_squared) * local.z() - sqrt(ffmax(0.0, radius * radius - distance_squared * sin2));
+  rec.p = o + t * dir;
+  light_surface(o, rec);
+  pdf_w = light_pdf(o, rec);
+  return pdf_w > 0.0;
+}
+
+template<typename mat>
+double sphere<mat>::light_pdf(const point3 &o, const hit_record<mat> &rec) const {
+  if (!on_surface(o, rec.p)) {
+    return 0;
+  }
+  auto cos_theta_max = sqrt(1 - radius * radius / (center - o).squared_length());
+  return 1 / (2 * M_PI * (1 - cos_theta_max));
+}
+
+/// light_pdfと同じ球面上の判定だけで属性を求める(交差判定をしない)
+template<typename mat>
+bool sphere<mat>::light_record(const point3 &o, hit_record<mat> &rec) const {
+  if (!on_surface(o, rec.p)) {
+    return false;
+  }
+  light_surface(o, rec);
+  return true;
+}
+
+/// 法線は全方向
+template<typename mat>
+bool sphere<mat>::emission_bounds(light_bounds &b) const {
+  bounding_box(0, 1, b.box);
+  b.axis = vec3(0, 0, 1);
+  b.theta_o = M_PI;
+  b.theta_e = M_PI / 2;
+  b.phi = 4 * M_PI * radius * radius * emission_scale(mat_ptr);
+  b.two_sided = false;
+  return true;
+}
+
 /// 移動球
 template<typename mat>
 class moving_sphere : public hittable<mat> {
@@ -105,7 +205,8 @@ class moving_sphere : public hittable<mat> {
       time0(t0), time1(t1),
       radius(r),
       mat_ptr(m) {};
-  virtual bool hit(const ray &r, double tmin, double tmax, hit_record<mat> &rec) const override;
+  virtual bool intersect(const ray &r, double tmin, double tmax, hit_record<mat> &rec) const override;
+  virtual void surface(const ray &r, hit_record<mat> &rec) const override;
   virtual bool bounding_box(double t0, double t1, aabb &box) const override;
   vec3 center(double time) const;
   vec3 center0, center1;
@@ -123,7 +224,7 @@ vec3 moving_sphere<mat>::center(double time) const {
 
 /// 交差判定
 template<typename mat>
-bool moving_sphere<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+bool moving_sphere<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
   vec3 oc = r.origin() - center(r.time());
   double a = dot(r.direction(), r.direction());
   double b = dot(oc, r.direction());
@@ -131,26 +232,28 @@ bool moving_sphere<mat>::hit(const ray &r, double t_min, double t_max, hit_recor
   double discriminant = b * b - a * c;
   if (discriminant > 0) {
     double temp = (-b - sqrt(discriminant)) / a;
-    if (t_min < temp && temp < t_max) {
-      rec.t = temp;
-      rec.p = r.point_at_parameter(rec.t);
-      rec.normal = (rec.p - center(r.time())) / radius;
-      rec.mat_ptr = mat_ptr;
-      return true;
+    /// 近くになければ別の交差点
+    if (!(t_min < temp && temp < t_max)) {
+      temp = (-b + sqrt(discriminant)) / a;
     }
-    /// 別の交差点
-    temp = (-b + sqrt(discriminant)) / a;
     if (t_min < temp && temp < t_max) {
       rec.t = temp;
-      rec.p = r.point_at_parameter(rec.t);
-      rec.normal = (rec.p - center(r.time())) / radius;
-      rec.mat_ptr = mat_ptr;
+      rec.obj_id = this->id;
+      rec.prim = this;
       return true;
     }
   }
   return false;
 }
 
+/// 交差点の属性
+template<typename mat>
+void moving_sphere<mat>::surface(const ray &r, hit_record<mat> &rec) const {
+  rec.p = r.point_at_parameter(rec.t);
+  rec.set_face_normal(r, (rec.p - center(r.time())) / radius);
+  rec.mat_ptr = mat_ptr;
+}
+
 template<typename mat>
 bool moving_sphere<mat>::bounding_box(double t0, double t1, aabb &box) const {
   vec3 scale = vec3(radius, radius, radius);
@@ -1,7 +1,9 @@
 #ifndef FLUORSWITCH_SRC_OBJECTS_TRIANGLE_H_
 #define FLUORSWITCH_SRC_OBJECTS_TRIANGLE_H_
 
+#include <algorithm>
 #include "../utils/hittable.h"
+#include "../sampling/spherical_sampling.h"
 
 struct vertex {
  public:
@@ -50,7 +52,13 @@ class triangle : public hittable<mat> {
     mat_ptr = m;
   };
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void intersect_packet(ray_packet &packet, hit_record<mat> *recs) const override;
+  void surface(const ray &r, hit_record<mat> &rec) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override {
+    double t, b1, b2;
+    return intersect(r, t_min, t_max, t, b1, b2);
+  }
   bool bounding_box(double time0, double time1, aabb &box) const override {
     vec3 a, b;
     for (int i = 0; i < 3; ++i) {
@@ -62,6 +70,10 @@ class triangle : public hittable<mat> {
   }
   double pdf_value(const point3 &o, const vec3 &v) const override;
   vec3 random(const vec3 &o) const override;
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override;
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override;
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override;
+  bool emission_bounds(light_bounds &b) const override;
   vec3 barycentric(vec3 &p);
 
  public:
@@ -71,10 +83,16 @@ class triangle : public hittable<mat> {
   double u[3];
   double v[3];
   shared_ptr<mat> mat_ptr;
+
+ private:
+  bool intersect(const ray &r, double t_min, double t_max, double &t, double &b1, double &b2) const;
+  bool on_surface(const point3 &o, const point3 &p, double &b1, double &b2) const;
+  double sample_point(const point3 &o, point3 &p) const;
+  double area_pdf_to_solid_angle(const point3 &o, const point3 &p) const;
 };
 
 template<typename mat>
-bool triangle<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+bool triangle<mat>::intersect(const ray &r, double t_min, double t_max, double &t, double &b1, double &b2) const {
   /// Möller–Trumbore intersection algorithm
   vec3 p_vec = cross(r.direction(), e2);
   // 行列式
@@ -94,15 +112,88 @@ bool triangle<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat
   if (v_ < 0.0 || 1.0 < u_ + v_) {
     return false;
   }
-  double t = dot(e2, q_vec) * inv_det;
-  if (t < t_min || t_max < t) {
+  t = dot(e2, q_vec) * inv_det;
+  b1 = u_;
+  b2 = v_;
+  return t_min <= t && t <= t_max;
+}
+
+template<typename mat>
+bool triangle<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+  double t, b1, b2;
+  if (!intersect(r, t_min, t_max, t, b1, b2)) {
     return false;
   }
+  // UVは重心座標(vert[1], vert[2]の重み)
   rec.t = t;
+  rec.u = b1;
+  rec.v = b2;
+  rec.obj_id = this->id;
+  rec.prim = this;
+  return true;
+}
+
+/// レイの束との交差(activeなレイをまとめてSIMDでMöller–Trumboreを計算し、当たったレイにintersectと同じ値を書く)
+template<typename mat>
+void triangle<mat>::intersect_packet(ray_packet &packet, hit_record<mat> *recs) const {
+  // 束全体の区間で外れることが分かれば、レイ毎の判定をしない
+  aabb box;
+  bounding_box(0, 1, box);
+  const double lo[3] = {box.min().x(), box.min().y(), box.min().z()};
+  const double hi[3] = {box.max().x(), box.max().y(), box.max().z()};
+  if (!packet.may_hit(lo, hi)) {
+    return;
+  }
+  const int chunk = 16;
+  const double t_min = packet.t_min;
+  const double e1x = e1.x(), e1y = e1.y(), e1z = e1.z();
+  const double e2x = e2.x(), e2y = e2.y(), e2z = e2.z();
+  const double v0x = vert[0].x(), v0y = vert[0].y(), v0z = vert[0].z();
+  for (int k0 = 0; k0 < packet.size; k0 += chunk) {
+    const int n = std::min(chunk, packet.size - k0);
+    double t[chunk], b1[chunk], b2[chunk];
+    int hit[chunk];
+#pragma omp simd
+    for (int i = 0; i < n; ++i) {
+      const int r = k0 + i;
+      const double dx = packet.dx[r], dy = packet.dy[r], dz = packet.dz[r];
+      // p = d x e2
+      double px = dy * e2z - dz * e2y;
+      double py = -(dx * e2z - dz * e2x);
+      double pz = dx * e2y - dy * e2x;
+      double det = e1x * px + e1y * py + e1z * pz;
+      double inv_det = 1.0 / det;
+      double tx = packet.ox[r] - v0x, ty = packet.oy[r] - v0y, tz = packet.oz[r] - v0z;
+      double u_ = (tx * px + ty * py + tz * pz) * inv_det;
+      // q = t x e1
+      double qx = ty * e1z - tz * e1y;
+      double qy = -(tx * e1z - tz * e1x);
+      double qz = tx * e1y - ty * e1x;
+      double v_ = (dx * qx + dy * qy + dz * qz) * inv_det;
+      t[i] = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+      b1[i] = u_;
+      b2[i] = v_;
+      hit[i] = packet.active[r] && det > 0.0 && !(u_ < 0.0 || 1.0 < u_) && !(v_ < 0.0 || 1.0 < u_ + v_)
+          && t_min <= t[i] && t[i] <= packet.t_max[r] ? 1 : 0;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (!hit[i]) continue;
+      hit_record<mat> &rec = recs[k0 + i];
+      rec.t = t[i];
+      rec.u = b1[i];
+      rec.v = b2[i];
+      rec.obj_id = this->id;
+      rec.prim = this;
+      packet.t_max[k0 + i] = t[i];
+    }
+  }
+}
+
+template<typename mat>
+void triangle<mat>::surface(const ray &r, hit_record<mat> &rec) const {
   rec.p = r.point_at_parameter(rec.t);
   rec.set_face_normal(r, face_norm);
   rec.mat_ptr = mat_ptr;
-  return true;
 }
 
 template<typename mat>
@@ -111,19 +202,121 @@ double triangle<mat>::pdf_value(const point3 &o, const vec3 &v) const {
   if (!this->hit(ray(o, v), 0.001, INF, rec)) {
     return 0;
   }
+  return light_pdf(o, rec);
+}
 
-  auto area = 0.5 * sqrt(e1.squared_length() * e2.squared_length() - pow(dot(e1, e2), 2));
-  auto distance_squared = rec.t * rec.t * v.squared_length();
-  auto cosine = fabs(dot(v, rec.normal) / v.length());
+template<typename mat>
+vec3 triangle<mat>::random(const vec3 &o) const {
+  point3 p;
+  sample_point(o, p);
+  return p - o;
+}
 
-  return distance_squared / (cosine * area);
+template<typename mat>
+bool triangle<mat>::sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const {
+  // hitと同じく表側からだけ見える
+  if (dot(vert[0] - o, face_norm) >= 0.0) {
+    return false;
+  }
+  pdf_w = sample_point(o, rec.p);
+  rec.t = 1;
+  rec.set_face_normal(ray(o, rec.p - o), face_norm);
+  rec.mat_ptr = mat_ptr;
+  rec.obj_id = this->id;
+  return pdf_w > 0.0 && pdf_w < INF;
 }
 
 template<typename mat>
-vec3 triangle<mat>::random(const vec3 &o) const {
-  auto k = random_double(0, 1);
-  auto random_point = e1 * k + e2 * (1 - k);
-  return random_point - o;
+double triangle<mat>::light_pdf(const point3 &o, const hit_record<mat> &rec) const {
+  double b1, b2;
+  if (!on_surface(o, rec.p, b1, b2)) {
+    return 0;
+  }
+  /// 立体角で一様
+  spherical_triangle st(o, vert[0], vert[1], vert[2]);
+  if (st.solid_angle >= MIN_SPHERICAL_SAMPLE_AREA) {
+    return 1.0 / st.solid_angle;
+  }
+  return area_pdf_to_solid_angle(o, rec.p);
+}
+
+/// light_pdfと同じ三角形上の判定だけで属性を求める(交差判定をしない)
+template<typename mat>
+bool triangle<mat>::light_record(const point3 &o, hit_record<mat> &rec) const {
+  double b1, b2;
+  if (!on_surface(o, rec.p, b1, b2)) {
+    return false;
+  }
+  rec.t = 1;
+  rec.u = b1;
+  rec.v = b2;
+  rec.set_face_normal(ray(o, rec.p - o), face_norm);
+  rec.mat_ptr = mat_ptr;
+  rec.obj_id = this->id;
+  return true;
+}
+
+/// 点pが点oから見える(表側の)三角形上にあるか、あれば重心座標(vert[1], vert[2]の重み)
+template<typename mat>
+bool triangle<mat>::on_surface(const point3 &o, const point3 &p, double &b1, double &b2) const {
+  vec3 t = p - vert[0];
+  if (dot(vert[0] - o, face_norm) >= 0.0 || fabs(dot(t, face_norm)) > 0.0001) {
+    return false;
+  }
+  double d00 = dot(e1, e1);
+  double d01 = dot(e1, e2);
+  double d11 = dot(e2, e2);
+  double d20 = dot(t, e1);
+  double d21 = dot(t, e2);
+  double d = d00 * d11 - d01 * d01;
+  b1 = (d11 * d20 - d01 * d21) / d;
+  b2 = (d00 * d21 - d01 * d20) / d;
+  const double eps = 1e-9;
+  return !(b1 < -eps || b2 < -eps || 1 + eps < b1 + b2);
+}
+
+/// 表側(面法線の向き)だけから発光する
+template<typename mat>
+bool triangle<mat>::emission_bounds(light_bounds &b) const {
+  bounding_box(0, 1, b.box);
+  b.axis = face_norm;
+  b.theta_o = 0.0;
+  b.theta_e = M_PI / 2;
+  b.phi = 0.5 * cross(e1, e2).length() * emission_scale(mat_ptr);
+  b.two_sided = false;
+  return true;
+}
+
+/// 近くの点からは立体角で一様に、遠くの点からは面積で一様にサンプリングし、立体角測度のpdfを返す
+template<typename mat>
+double triangle<mat>::sample_point(const point3 &o, point3 &p) const {
+  spherical_triangle st(o, vert[0], vert[1], vert[2]);
+  if (st.solid_angle >= MIN_SPHERICAL_SAMPLE_AREA) {
+    vec3 dir = st.sample(random_double(), random_double());
+    // 三角形の平面までの距離
+    double cosine = dot(dir, face_norm);
+    if (fabs(cosine) <= 1e-12) {
+      // 平面と平行な方向(light_pdfは立体角のpdfを返すので面積のサンプリングに切り替えずに棄却する)
+      p = o + dir;
+      return 0;
+    }
+    p = o + dir * (dot(vert[0] - o, face_norm) / cosine);
+    return 1.0 / st.solid_angle;
+  }
+  // 重心座標で一様(sqrtで面積の偏りを補正)
+  auto su = sqrt(random_double());
+  auto k = random_double();
+  p = vert[0] + e1 * (su * (1 - k)) + e2 * (su * k);
+  return area_pdf_to_solid_angle(o, p);
+}
+
+template<typename mat>
+double triangle<mat>::area_pdf_to_solid_angle(const point3 &o, const point3 &p) const {
+  vec3 d = p - o;
+  auto area = 0.5 * sqrt(e1.squared_length() * e2.squared_length() - pow(dot(e1, e2), 2));
+  auto distance_squared = d.squared_length();
+  auto cosine = fabs(dot(d, face_norm)) / sqrt(distance_squared);
+  return distance_squared / (cosine * area);
 }
 
 template<typename mat>
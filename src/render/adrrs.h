@@ -0,0 +1,195 @@
+#ifndef FLUORSWITCH_SRC_RENDER_ADRRS_H_
+#define FLUORSWITCH_SRC_RENDER_ADRRS_H_
+
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "../utils/util_funcs.h"
+
+/// パス1本分の状態(画面領域、画素、カメラからの重み、ここまでの分岐数の積、追跡したレイの数)
+struct rrs_context {
+  int region{0};
+  int pixel{0};
+  double throughput{1.0};
+  double split{1.0};
+  long *rays{nullptr};
+};
+
+/// 効率を考慮したロシアンルーレットと分岐 (ADRRS: Vorba and Křivánek 2016 / EARS: Rath et al. 2022)
+/// 画面領域 x 反射回数毎に反射放射輝度の二次モーメントと部分パスのコスト、画素毎の分散、領域毎の画素のコストを記録し、
+/// 前のフレームの統計から 分岐数 = 重み x sqrt(二次モーメント / 画素の分散 x 画素のコスト / 部分パスのコスト) を決める
+/// 画素の分散は領域でまとめない(光源の縁などの分散の大きな画素で領域全体の分岐数が下がるため)
+/// 1未満ならその確率で生き残り(ロシアンルーレット)、1以上なら確率的に丸めた本数に分岐する
+class rrs_controller {
+ public:
+  /// 画像サイズに合わせて領域を確保(サイズが変わった場合は統計を捨てる)
+  void prepare(unsigned int w, unsigned int h, int max_bounce) {
+    int tx = int((w + ADRRS_TILE - 1) / ADRRS_TILE);
+    int ty = int((h + ADRRS_TILE - 1) / ADRRS_TILE);
+    if (w == width && size_t(w) * h == pixel_variance.size() && max_bounce == bounces) {
+      return;
+    }
+    width = w;
+    tiles_x = tx;
+    tiles_y = ty;
+    bounces = max_bounce;
+    const size_t regions = size_t(tx) * ty;
+    const size_t cells = regions * bounces;
+    vertex_m2.assign(cells, 0.0);
+    vertex_cost.assign(cells, 0.0);
+    pixel_variance.assign(size_t(w) * h, 0.0);
+    pixel_cost.assign(regions, 0.0);
+    trained.assign(cells, 0);
+    building_vertex.reset(new std::atomic<double>[cells * 3]);
+    building_pixel.reset(new std::atomic<double>[regions * 2]);
+    building_variance.reset(new std::atomic<double>[size_t(w) * h]);
+    decisions.reset(new std::atomic<double>[cells * 4]);
+    reset_building();
+  }
+
+  int region(unsigned int i, unsigned int j) const {
+    return int(j / ADRRS_TILE) * tiles_x + int(i / ADRRS_TILE);
+  }
+
+  int pixel(unsigned int i, unsigned int j) const {
+    return int(j * width + i);
+  }
+
+  /// 期待する分岐数(統計が無ければ1)
+  double factor(const rrs_context &ctx, int bounce) const {
+    if (bounce >= bounces) {
+      return 1.0;
+    }
+    size_t c = size_t(ctx.region) * bounces + bounce;
+    double variance = pixel_variance[ctx.pixel];
+    if (!trained[c] || variance <= 0.0 || vertex_cost[c] <= 0.0) {
+      return 1.0;
+    }
+    double n = ctx.throughput * sqrt(vertex_m2[c] / variance * pixel_cost[ctx.region] / vertex_cost[c]);
+    // 分岐した結果で画素の分散が下がると次のフレームでさらに分岐するので、カメラからの分岐数の積を ADRRS_MAX_SPLIT までに抑える
+    // NaNは1として扱う
+    return n == n ? clamp(n, ADRRS_MIN_FACTOR, ffmax(1.0, ADRRS_MAX_SPLIT / ctx.split)) : 1.0;
+  }
+
+  /// 反射放射輝度の推定値(輝度)と部分パスのレイの数
+  void record_vertex(int region, int bounce, double lum, double cost) {
+    if (bounce >= bounces || !(fabs(lum) < INF)) return;
+    size_t c = (size_t(region) * bounces + bounce) * 3;
+    atomic_add(building_vertex[c], lum * lum);
+    atomic_add(building_vertex[c + 1], cost);
+    atomic_add(building_vertex[c + 2], 1.0);
+  }
+
+  /// 画素1つ分の輝度の和と二乗和、サンプル数、レイの数
+  void record_pixel(const rrs_context &ctx, double lum, double lum_sq, int samples, double cost) {
+    if (!(fabs(lum_sq) < INF)) return;
+    // サンプル1つ当たりの分散(1サンプルの画素は前の値を残す)
+    if (samples >= 2) {
+      building_variance[ctx.pixel].store(ffmax(lum_sq - lum * lum / samples, 0.0) / (samples - 1),
+                                         std::memory_order_relaxed);
+    }
+    size_t c = size_t(ctx.region) * 2;
+    atomic_add(building_pixel[c], cost);
+    atomic_add(building_pixel[c + 1], samples);
+  }
+
+  /// 判断の記録(統計の表示用)
+  void record_decision(int region, int bounce, double n, int branches) {
+    if (bounce >= bounces) return;
+    size_t c = (size_t(region) * bounces + bounce) * 4;
+    atomic_add(decisions[c], n);
+    atomic_add(decisions[c + 1], 1.0);
+    if (branches == 0) atomic_add(decisions[c + 2], 1.0);
+    if (branches > 1) atomic_add(decisions[c + 3], 1.0);
+  }
+
+  /// このフレームの記録を次のフレームの統計にする(描画スレッドの外で呼ぶ)
+  void refine() {
+    const size_t regions = size_t(tiles_x) * tiles_y;
+    for (size_t r = 0; r < regions; ++r) {
+      double samples = building_pixel[r * 2 + 1].load(std::memory_order_relaxed);
+      if (samples < 1.0) continue;
+      pixel_cost[r] = building_pixel[r * 2].load(std::memory_order_relaxed) / samples;
+      for (int b = 0; b < bounces; ++b) {
+        size_t c = r * bounces + b;
+        double n = building_vertex[c * 3 + 2].load(std::memory_order_relaxed);
+        trained[c] = n >= ADRRS_MIN_SAMPLES;
+        if (!trained[c]) continue;
+        vertex_m2[c] = building_vertex[c * 3].load(std::memory_order_relaxed) / n;
+        vertex_cost[c] = building_vertex[c * 3 + 1].load(std::memory_order_relaxed) / n;
+      }
+    }
+    for (size_t p = 0; p < pixel_variance.size(); ++p) {
+      double v = building_variance[p].load(std::memory_order_relaxed);
+      if (v >= 0.0) pixel_variance[p] = v;
+    }
+    reset_building();
+  }
+
+  /// 領域毎の判断の表示(最初の反射の平均分岐数の地図と、反射回数毎の分岐・打ち切りの割合)
+  /// 地図の記号: '.' 打ち切り寄り(< 0.5), '-' (< 0.95), '=' ほぼ1, '2'-'8' 分岐数
+  void dump(std::ostream &out, int frame) const {
+    const size_t regions = size_t(tiles_x) * tiles_y;
+    out << "\n[ADRRS] frame " << frame << std::endl;
+    for (int b = 0; b < bounces; ++b) {
+      double sum = 0.0, count = 0.0, kills = 0.0, splits = 0.0;
+      for (size_t r = 0; r < regions; ++r) {
+        size_t c = (r * bounces + b) * 4;
+        sum += decisions[c].load(std::memory_order_relaxed);
+        count += decisions[c + 1].load(std::memory_order_relaxed);
+        kills += decisions[c + 2].load(std::memory_order_relaxed);
+        splits += decisions[c + 3].load(std::memory_order_relaxed);
+      }
+      if (count <= 0.0) break;
+      out << "  bounce " << b << ": factor " << std::fixed << std::setprecision(2) << sum / count
+          << ", killed " << 100.0 * kills / count << "%, split " << 100.0 * splits / count << "%" << std::endl;
+    }
+    // 画面の上を先頭に表示
+    for (int ty = tiles_y - 1; ty >= 0; --ty) {
+      out << "  ";
+      for (int tx = 0; tx < tiles_x; ++tx) {
+        size_t c = (size_t(ty * tiles_x + tx) * bounces) * 4;
+        double count = decisions[c + 1].load(std::memory_order_relaxed);
+        double n = count > 0.0 ? decisions[c].load(std::memory_order_relaxed) / count : 1.0;
+        char mark = n < 0.5 ? '.' : n < 0.95 ? '-' : n < 1.5 ? '=' : char('0' + std::min(int(n + 0.5), 8));
+        out << mark;
+      }
+      out << std::endl;
+    }
+    out << std::defaultfloat;
+  }
+
+ private:
+  void reset_building() {
+    const size_t regions = size_t(tiles_x) * tiles_y;
+    const size_t cells = regions * bounces;
+    for (size_t k = 0; k < cells * 3; ++k) building_vertex[k].store(0.0, std::memory_order_relaxed);
+    for (size_t k = 0; k < regions * 2; ++k) building_pixel[k].store(0.0, std::memory_order_relaxed);
+    for (size_t k = 0; k < pixel_variance.size(); ++k) building_variance[k].store(-1.0, std::memory_order_relaxed);
+    for (size_t k = 0; k < cells * 4; ++k) decisions[k].store(0.0, std::memory_order_relaxed);
+  }
+
+ private:
+  unsigned int width{0};
+  int tiles_x{0};
+  int tiles_y{0};
+  int bounces{0};
+  // 前のフレームの統計
+  std::vector<double> vertex_m2;
+  std::vector<double> vertex_cost;
+  std::vector<double> pixel_variance;
+  std::vector<double> pixel_cost;
+  std::vector<char> trained;
+  // このフレームの記録
+  std::unique_ptr<std::atomic<double>[]> building_vertex;
+  std::unique_ptr<std::atomic<double>[]> building_pixel;
+  std::unique_ptr<std::atomic<double>[]> building_variance;
+  std::unique_ptr<std::atomic<double>[]> decisions;
+};
+
+rrs_controller RGB_RRS;
+rrs_controller SPECTRAL_RRS;
+
+#endif //FLUORSWITCH_SRC_RENDER_ADRRS_H_
@@ -0,0 +1,511 @@
+#ifndef FLUORSWITCH_SRC_RENDER_BDPT_H_
+#define FLUORSWITCH_SRC_RENDER_BDPT_H_
+
+#include <algorithm>
+#include <vector>
+#include <omp.h>
+#include "../camera/camera.h"
+#include "../utils/hittable.h"
+#include "../utils/hittable_list.h"
+#include "../sampling/sampler.h"
+#include "frame_buffer.h"
+#include "film.h"
+#include "integrator_traits.h"
+
+/// 部分パスの頂点
+template<typename mat>
+struct bdpt_vertex {
+  using traits = integrator_traits<mat>;
+  enum vertex_type { camera_vertex, light_vertex, surface_vertex };
+
+  vertex_type type{surface_vertex};
+  point3 p{ZERO_VEC3};
+  // 面の法線(光源は発光側、カメラは視線方向)
+  vec3 n{ZERO_VEC3};
+  ray r_in;
+  hit_record<mat> rec;
+  typename traits::scatter_record s_rec;
+  bool scatters{false};
+  bool delta{false};
+  // 光源側: この頂点に届く放射束 / pdf (光源頂点は Le / pdf)
+  // カメラ側: この頂点の発光
+  typename traits::radiance value;
+  // カメラ側: この頂点で次の方向を選んだときの scattering_pdf / pdf
+  double scale{1.0};
+  // 面積測度のpdf (fwd: 部分パスを生成した向き、rev: 逆向き)
+  double pdf_fwd{0.0};
+  double pdf_rev{0.0};
+
+  bool connectible() const {
+    return !delta && (type != surface_vertex || scatters);
+  }
+};
+
+/// 双方向パストレーシング (Veach 1997)
+/// カメラと光源から部分パスを生成し、全ての接続方法をpower heuristicのMISで重み付けする
+/// カメラはピンホールとして扱い、光源側の頂点をカメラへ接続したもの(t = 1)は画像へ原子的に加算する
+/// 蛍光は波長の間の線形写像なので、カメラ側は積を持たずに接続毎に traits::reflect を順に適用する
+template<typename mat>
+class bdpt_integrator {
+  using traits = integrator_traits<mat>;
+  using radiance = typename traits::radiance;
+  using vertex = bdpt_vertex<mat>;
+
+  /// 光源側の部分パスに割り当てるサンプラーの反射回数(カメラ側の最大反射回数の後ろ)
+  static constexpr int LIGHT_BOUNCE_OFFSET = BDPT_MAX_DEPTH + 1;
+
+  /// スレッド毎の作業領域(部分パスの頂点は再利用し、生成中に確保しない)
+  struct arena {
+    std::vector<vertex> camera_path;
+    std::vector<vertex> light_path;
+  };
+
+ public:
+  bdpt_integrator(unsigned int w, unsigned int h) : width(w), height(h), arenas(MAX_THREAD_NUM), image(w, h) {
+    for (auto &a : arenas) {
+      a.camera_path.resize(BDPT_MAX_DEPTH + 2);
+      a.light_path.resize(BDPT_MAX_DEPTH + 1);
+    }
+  }
+
+  /// rgb_render / spectral_render と同じ形式でfbへ描画
+  void render(frame_buffer &fb, int spp, const hittable_list<mat> &world, shared_ptr<hittable_list<mat>> &lights,
+              const std::vector<int> *spp_map = nullptr) {
+    const size_t n = size_t(width) * height;
+    setup_camera();
+    aabb box;
+    world.bounding_box(0, 1, box);
+    center = 0.5 * (box.min() + box.max());
+    image.clear();
+    std::vector<color> col(n, ZERO);
+    std::vector<double> lum(n, 0.0), lum_sq(n, 0.0);
+    std::vector<aov_record> aov_sum(n);
+    // 光源側の部分パスの総数(加算した寄与の正規化に使う)
+    double light_paths = 0.0;
+    for (size_t p = 0; p < n; ++p) {
+      light_paths += spp_map != nullptr ? ffmax((*spp_map)[p], 0) : spp;
+    }
+
+    const uint32_t pass = next_sampler_pass();
+    // 1行を1タイルとして描画し、全行の描画後に行の順にまとめる
+    std::vector<film_tile> tiles(height, film_tile(image));
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+    for (int j = 0; j < height; ++j) {
+      auto &a = arenas[omp_get_thread_num()];
+      pixel_sampler sampler(pass);
+      current_random_stream() = &sampler;
+      film_tile &tile = tiles[j];
+      tile.reset(0, j, width, j + 1);
+      for (int i = 0; i < width; ++i) {
+        size_t p = fb.index(i, j);
+        int ns = spp_map != nullptr ? (*spp_map)[p] : spp;
+        for (int s = 0; s < ns; ++s) {
+          sampler.start_sample(i, j, s);
+          aov_record aov;
+          double x, y;
+          int t_len = camera_walk(world, i, j, a.camera_path, aov, x, y);
+          int s_len = light_walk(world, *lights, a.light_path);
+          color c = connect(world, *lights, a, t_len, s_len);
+          tile.add_sample(x, y, c);
+          col[p] += c;
+          lum[p] += luminance(c);
+          lum_sq[p] += luminance(c) * luminance(c);
+          accumulate_aov(aov_sum[p], aov);
+        }
+      }
+      current_random_stream() = nullptr;
+    }
+    for (const auto &tile : tiles) {
+      image.merge(tile);
+    }
+
+    /// 分散と補助バッファを書き込み、放射輝度はカメラからのサンプルと光源側からの加算を合わせたもので置き換える
+    for (int j = 0; j < height; ++j) {
+      for (int i = 0; i < width; ++i) {
+        size_t p = fb.index(i, j);
+        int ns = spp_map != nullptr ? (*spp_map)[p] : spp;
+        if (ns <= 0) continue;
+        fb.set_pixel(i, j, ns, col[p], lum[p], lum_sq[p], aov_sum[p]);
+      }
+    }
+    image.write(fb, spp_map, light_paths > 0.0 ? n / light_paths : 0.0);
+  }
+
+ private:
+  /// ピンホールカメラ: 距離1の像面の面積(SCENE_CAMERAの設定から求める)
+  void setup_camera() {
+    const auto &cam = SCENE_CAMERA;
+    forward = -cam.w;
+    double focus = dot(cam.origin - cam.lower_left_corner, cam.w);
+    image_area = cam.horizontal.length() * cam.vertical.length() / (focus * focus);
+    // 絞りがある場合はレンズ上の点を扱えないので、カメラへの接続は使わない
+    light_tracing = cam.lens_radius <= 0.0;
+  }
+
+  /// カメラから方向wに対応する画面上の位置 [0, 1)^2
+  bool raster(const vec3 &w, double &s, double &t) const {
+    const auto &cam = SCENE_CAMERA;
+    double cos_theta = dot(w, forward);
+    if (cos_theta <= 0.0) {
+      return false;
+    }
+    double focus = dot(cam.origin - cam.lower_left_corner, cam.w);
+    vec3 q = cam.origin + w * (focus / cos_theta) - cam.lower_left_corner;
+    s = dot(q, cam.horizontal) / cam.horizontal.squared_length();
+    t = dot(q, cam.vertical) / cam.vertical.squared_length();
+    return s >= 0.0 && s < 1.0 && t >= 0.0 && t < 1.0;
+  }
+
+  /// カメラが方向wを選ぶ立体角のpdf 1 / (A cos^3)
+  double camera_pdf(const vec3 &w) const {
+    double s, t;
+    if (!raster(w, s, t)) {
+      return 0.0;
+    }
+    double cos_theta = dot(w, forward);
+    return 1.0 / (image_area * cos_theta * cos_theta * cos_theta);
+  }
+
+  /// 立体角測度 -> 面積測度
+  static double convert(double pdf_w, const vertex &from, const vertex &to) {
+    vec3 d = to.p - from.p;
+    double dist2 = d.squared_length();
+    if (dist2 <= 0.0) {
+      return 0.0;
+    }
+    double pdf = pdf_w / dist2;
+    if (to.type != vertex::camera_vertex) {
+      pdf *= fabs(dot(to.n, d)) / sqrt(dist2);
+    }
+    return pdf;
+  }
+
+  /// 頂点vから発光する方向(cos / π)としてnextを選ぶ面積測度のpdf
+  static double emission_pdf(const vertex &v, const vertex &next) {
+    vec3 w = unit_vector(next.p - v.p);
+    return convert(ffmax(dot(v.n, w), 0.0) * M_1_PI, v, next);
+  }
+
+  /// 頂点vの次の頂点としてnextを選ぶ面積測度のpdf
+  /// 拡散面のpdfは入射方向に依らないので、部分パスの生成時に作ったpdfを逆向きの評価にも使う
+  double pdf(const vertex &v, const vertex &next) const {
+    if (v.type == vertex::light_vertex) {
+      return emission_pdf(v, next);
+    }
+    vec3 w = unit_vector(next.p - v.p);
+    if (v.type == vertex::camera_vertex) {
+      return convert(camera_pdf(w), v, next);
+    }
+    if (!v.scatters || v.delta) {
+      return 0.0;
+    }
+    return convert(v.s_rec.pdf_ptr->value(w), v, next);
+  }
+
+  /// 光源の点vを光源側の部分パスの始点として選ぶ面積測度のpdf
+  double light_origin_pdf(const hittable_list<mat> &lights, const vertex &v) const {
+    vec3 d = v.p - center;
+    double dist2 = d.squared_length();
+    if (dist2 <= 0.0) {
+      return 0.0;
+    }
+    return lights.light_pdf(center, v.rec) * fabs(dot(v.n, d)) / (dist2 * sqrt(dist2));
+  }
+
+  /// 光源上の点と発光
+  /// 発光は光源のマテリアル(rec.mat_ptr)から求め、中心から見た側が光らなければ裏側を発光面とする
+  bool sample_emitter(const hittable_list<mat> &lights, vertex &y0) const {
+    hit_record<mat> lrec;
+    double pdf_w;
+    if (!lights.sample_light(center, lrec, pdf_w) || !lrec.mat_ptr) {
+      return false;
+    }
+    vec3 dir = lrec.p - center;
+    double dist2 = dir.squared_length();
+    double pdf_pos = pdf_w * fabs(dot(lrec.normal, unit_vector(dir))) / dist2;
+    if (pdf_pos <= 0.0) {
+      return false;
+    }
+    for (int side = 0; side < 2; ++side) {
+      if (side == 1) {
+        lrec.front_face = !lrec.front_face;
+        lrec.normal = -lrec.normal;
+      }
+      ray r_in(lrec.p + lrec.normal, -lrec.normal);
+      auto le = lrec.mat_ptr->emitted(r_in, lrec, lrec.u, lrec.v, lrec.p);
+      if (traits::is_zero(le)) continue;
+      y0.type = vertex::light_vertex;
+      y0.p = lrec.p;
+      y0.n = lrec.normal;
+      y0.rec = lrec;
+      y0.scatters = false;
+      y0.delta = false;
+      y0.value = le * (1.0 / pdf_pos);
+      y0.pdf_fwd = pdf_pos;
+      y0.pdf_rev = 0.0;
+      return true;
+    }
+    return false;
+  }
+
+  /// 部分パスの生成(頂点start以降を埋めて頂点数を返す)
+  /// beta: 光源側で次の頂点に届く放射束 / pdf
+  int random_walk(const hittable_list<mat> &world, ray r, double pdf_w, radiance beta,
+                  std::vector<vertex> &path, int start, int max_vertices, bool camera_side, aov_record *aov) const {
+    int k = start;
+    while (k < max_vertices) {
+      // 乱数の次元: カメラ側は反射回数、光源側はその後ろ
+      begin_bounce(camera_side ? k - 1 : LIGHT_BOUNCE_OFFSET + 1 + k);
+      hit_record<mat> rec;
+      if (!world.hit(r, 0.001, INF, rec)) break;
+      auto &prev = path[k - 1];
+      auto &v = path[k];
+      v.type = vertex::surface_vertex;
+      v.p = rec.p;
+      v.n = rec.normal;
+      v.r_in = r;
+      v.rec = rec;
+      v.delta = false;
+      v.scale = 1.0;
+      v.pdf_fwd = convert(pdf_w, prev, v);
+      v.pdf_rev = 0.0;
+      v.scatters = rec.mat_ptr->scatter(r, rec, v.s_rec);
+      if (camera_side) {
+        v.value = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+      } else {
+        v.value = beta;
+      }
+
+      /// 最初の交差点の特徴量
+      if (aov != nullptr && k == 1) {
+        aov->albedo = v.scatters ? traits::albedo(v.s_rec) : traits::to_rgb(v.value);
+        aov->normal = rec.normal;
+        aov->depth = rec.t * r.direction().length();
+      }
+
+      // 光源側では散乱しない頂点(発光面)は接続に使えないので残さない
+      if (!v.scatters) {
+        if (camera_side) ++k;
+        break;
+      }
+      ++k;
+      if (k >= max_vertices) break;
+
+      double pdf_val;
+      vec3 dir = traits::sample(v.s_rec, pdf_val);
+      ray scattered(rec.p, dir, r.time());
+      if (traits::specular(v.s_rec)) {
+        // 鏡面は接続できず、MISでも数えない
+        v.delta = true;
+        pdf_w = 0.0;
+        prev.pdf_rev = 0.0;
+      } else {
+        if (pdf_val <= 0.0) break;
+        v.scale = rec.mat_ptr->scattering_pdf(r, rec, scattered) / pdf_val;
+        if (v.scale <= 0.0) break;
+        prev.pdf_rev = convert(v.s_rec.pdf_ptr->value(-unit_vector(r.direction())), v, prev);
+        pdf_w = pdf_val;
+      }
+      if (!camera_side) {
+        beta = traits::reflect(v.s_rec, v.scale, beta);
+      }
+      r = scattered;
+    }
+    return k;
+  }
+
+  /// x, y: 画面上の位置(画素単位)
+  int camera_walk(const hittable_list<mat> &world, int i, int j, std::vector<vertex> &path, aov_record &aov,
+                  double &x, double &y) const {
+    x = i + random_double();
+    y = j + random_double();
+    ray r = SCENE_CAMERA.get_ray(x / double(width), y / double(height));
+    auto &z0 = path[0];
+    z0.type = vertex::camera_vertex;
+    z0.p = r.origin();
+    z0.n = forward;
+    z0.scatters = false;
+    z0.delta = false;
+    z0.pdf_fwd = 1.0;
+    z0.pdf_rev = 0.0;
+    return random_walk(world, r, camera_pdf(unit_vector(r.direction())), traits::zero(),
+                       path, 1, BDPT_MAX_DEPTH + 2, true, &aov);
+  }
+
+  int light_walk(const hittable_list<mat> &world, const hittable_list<mat> &lights, std::vector<vertex> &path) const {
+    auto &y0 = path[0];
+    begin_bounce(LIGHT_BOUNCE_OFFSET);
+    if (!sample_emitter(lights, y0)) {
+      return 0;
+    }
+    begin_bounce(LIGHT_BOUNCE_OFFSET + 1);
+    onb uvw;
+    uvw.build_from_w(y0.n);
+    vec3 dir = uvw.local(random_cosine_direction());
+    double pdf_w = dot(unit_vector(dir), y0.n) * M_1_PI;
+    if (pdf_w <= 0.0) {
+      return 1;
+    }
+    // Le cos / (pdf_pos pdf_w) = Le π / pdf_pos
+    return random_walk(world, ray(y0.p, dir), pdf_w, y0.value * M_PI, path, 1, BDPT_MAX_DEPTH + 1, false, nullptr);
+  }
+
+  static bool visible(const hittable_list<mat> &world, const point3 &a, const point3 &b) {
+    vec3 d = b - a;
+    double dist = d.length();
+    return !world.occluded(ray(a, d / dist), 0.001, dist - 0.001);
+  }
+
+  /// 光源側の頂点yから方向wへ出て距離の二乗dist2だけ進んだ点に届く放射照度 / pdf
+  bool leave(const vertex &y, const vec3 &w, double dist2, radiance &out) const {
+    if (y.type == vertex::light_vertex) {
+      double cos_y = dot(y.n, w);
+      if (cos_y <= 0.0) return false;
+      out = y.value * (cos_y / dist2);
+      return true;
+    }
+    double f = y.rec.mat_ptr->scattering_pdf(y.r_in, y.rec, ray(y.p, w, y.r_in.time()));
+    if (f <= 0.0) return false;
+    out = traits::reflect(y.s_rec, f / dist2, y.value);
+    return true;
+  }
+
+  /// 全ての接続方法の寄与(t = 1 はスレッドの加算バッファへ)
+  color connect(const hittable_list<mat> &world, const hittable_list<mat> &lights, arena &a, int t_len, int s_len) const {
+    const auto &cam = a.camera_path;
+    const auto &lig = a.light_path;
+    color sum = ZERO;
+    for (int t = 1; t <= t_len; ++t) {
+      for (int s = 0; s <= s_len; ++s) {
+        int depth = s + t - 2;
+        if ((s == 1 && t == 1) || depth < 0 || depth > BDPT_MAX_DEPTH) continue;
+        if (t == 1) {
+          splat(world, lights, a, s);
+          continue;
+        }
+        const auto &z = cam[t - 1];
+        radiance L;
+        if (s == 0) {
+          // カメラ側の部分パスが光源に当たった場合
+          if (traits::is_zero(z.value)) continue;
+          L = z.value;
+        } else {
+          const auto &y = lig[s - 1];
+          if (!z.connectible() || !y.connectible()) continue;
+          vec3 d = y.p - z.p;
+          double dist2 = d.squared_length();
+          if (dist2 <= 0.0) continue;
+          vec3 w = d / sqrt(dist2);
+          double f = z.rec.mat_ptr->scattering_pdf(z.r_in, z.rec, ray(z.p, w, z.r_in.time()));
+          if (f <= 0.0) continue;
+          radiance incoming;
+          if (!leave(y, -w, dist2, incoming)) continue;
+          if (!visible(world, z.p, y.p)) continue;
+          L = traits::reflect(z.s_rec, f, incoming);
+        }
+        // カメラまでの反射を順に適用
+        for (int k = t - 2; k >= 1; --k) {
+          L = traits::reflect(cam[k].s_rec, cam[k].scale, L);
+        }
+        sum += mis_weight(lights, a, s, t) * traits::to_rgb(L);
+      }
+    }
+    return sum;
+  }
+
+  /// 光源側の頂点をカメラへ直接接続して、対応する画素へ加算
+  void splat(const hittable_list<mat> &world, const hittable_list<mat> &lights, arena &a, int s) const {
+    if (!light_tracing) {
+      return;
+    }
+    const auto &y = a.light_path[s - 1];
+    const auto &z0 = a.camera_path[0];
+    if (!y.connectible()) {
+      return;
+    }
+    vec3 d = z0.p - y.p;
+    double dist2 = d.squared_length();
+    vec3 w = d / sqrt(dist2);
+    double u, v;
+    if (!raster(-w, u, v)) {
+      return;
+    }
+    radiance incoming;
+    if (!leave(y, w, dist2, incoming)) {
+      return;
+    }
+    if (!visible(world, y.p, z0.p)) {
+      return;
+    }
+    // 画素で正規化した重要度 We cos = 1 / (A cos^3)
+    double we = camera_pdf(-w);
+    image.add_splat(u * width, v * height, (mis_weight(lights, a, s, 1) * we) * traits::to_rgb(incoming));
+  }
+
+  /// power heuristic によるMISの重み
+  /// 接続で変わる端点付近のpdfだけを置き換え、他の接続方法とのpdfの比を部分パスに沿って累積する
+  double mis_weight(const hittable_list<mat> &lights, const arena &a, int s, int t) const {
+    if (s + t == 2) {
+      return 1.0;
+    }
+    const auto &cam = a.camera_path;
+    const auto &lig = a.light_path;
+    double cam_fwd[BDPT_MAX_DEPTH + 2], cam_rev[BDPT_MAX_DEPTH + 2];
+    bool cam_delta[BDPT_MAX_DEPTH + 2];
+    double lig_fwd[BDPT_MAX_DEPTH + 1], lig_rev[BDPT_MAX_DEPTH + 1];
+    bool lig_delta[BDPT_MAX_DEPTH + 1];
+    for (int i = 0; i < t; ++i) {
+      cam_fwd[i] = cam[i].pdf_fwd;
+      cam_rev[i] = cam[i].pdf_rev;
+      cam_delta[i] = cam[i].delta;
+    }
+    for (int i = 0; i < s; ++i) {
+      lig_fwd[i] = lig[i].pdf_fwd;
+      lig_rev[i] = lig[i].pdf_rev;
+      lig_delta[i] = lig[i].delta;
+    }
+
+    const vertex &pt = cam[t - 1];
+    if (s > 0) {
+      const vertex &qs = lig[s - 1];
+      cam_rev[t - 1] = pdf(qs, pt);
+      if (t > 1) cam_rev[t - 2] = pdf(pt, cam[t - 2]);
+      lig_rev[s - 1] = pdf(pt, qs);
+      if (s > 1) lig_rev[s - 2] = pdf(qs, lig[s - 2]);
+      lig_delta[s - 1] = false;
+    } else {
+      // 光源に当たった頂点を光源側から選ぶpdf
+      cam_rev[t - 1] = light_origin_pdf(lights, pt);
+      cam_rev[t - 2] = emission_pdf(pt, cam[t - 2]);
+    }
+    cam_delta[t - 1] = false;
+
+    auto remap = [](double p) { return p != 0.0 ? p : 1.0; };
+    double sum = 0.0;
+    double r = 1.0;
+    for (int i = t - 1; i > 0; --i) {
+      r *= remap(cam_rev[i]) / remap(cam_fwd[i]);
+      if (!cam_delta[i] && !cam_delta[i - 1] && (i > 1 || light_tracing)) sum += r * r;
+    }
+    r = 1.0;
+    for (int i = s - 1; i >= 0; --i) {
+      r *= remap(lig_rev[i]) / remap(lig_fwd[i]);
+      if (!lig_delta[i] && !(i > 0 && lig_delta[i - 1])) sum += r * r;
+    }
+    return 1.0 / (1.0 + sum);
+  }
+
+ private:
+  unsigned int width;
+  unsigned int height;
+  std::vector<arena> arenas;
+  film image;
+  // カメラ
+  vec3 forward{ZERO_VEC3};
+  double image_area{1.0};
+  bool light_tracing{true};
+  // 光源の点を選ぶ基準点(シーンの中心)
+  point3 center{ZERO_VEC3};
+};
+
+#endif //FLUORSWITCH_SRC_RENDER_BDPT_H_
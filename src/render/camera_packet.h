@@ -0,0 +1,78 @@
+#ifndef FLUORSWITCH_SRC_RENDER_CAMERA_PACKET_H_
+#define FLUORSWITCH_SRC_RENDER_CAMERA_PACKET_H_
+
+#include <algorithm>
+#include <vector>
+#include "../camera/camera.h"
+#include "../utils/hittable.h"
+#include "../utils/ray_packet.h"
+#include "../sampling/sampler.h"
+
+/// 画素[i0, i1) x [j0, j1)のカメラレイを最初の交差まで辿り、サンプル毎にshadeを呼ぶ
+/// samples(i, j): 画素のサンプル数, shade(i, j, x, y, r, rec): (x, y)は画面上の位置、recは属性を求めた最初の交差(当たらなければnullptr)
+/// USE_RAY_PACKETSなら同じサンプル番号のレイを束にして辿る。どちらでもshadeを呼ぶ時点のサンプラーは
+/// カメラのサンプルを生成した直後で、1本ずつ辿る場合と同じ乱数列になる
+template<typename mat, typename S, typename F>
+inline void trace_camera_tile(sampler &smp, const hittable<mat> &world, unsigned int nx, unsigned int ny,
+                              int i0, int j0, int i1, int j1, S &&samples, F &&shade) {
+#if USE_RAY_PACKETS
+  const int capacity = (i1 - i0) * (j1 - j0);
+  ray_packet packet(capacity);
+  std::vector<hit_record<mat>> recs(capacity);
+  std::vector<int> pixel_i(capacity), pixel_j(capacity);
+  int max_ns = 0;
+  for (int j = j0; j < j1; ++j) {
+    for (int i = i0; i < i1; ++i) {
+      max_ns = std::max(max_ns, samples(i, j));
+    }
+  }
+  for (int s = 0; s < max_ns; ++s) {
+    packet.clear();
+    for (int j = j0; j < j1; ++j) {
+      for (int i = i0; i < i1; ++i) {
+        if (samples(i, j) <= s) continue;
+        smp.start_sample(i, j, s);
+        double x = i + random_double();
+        double y = j + random_double();
+        pixel_i[packet.size] = i;
+        pixel_j[packet.size] = j;
+        recs[packet.size] = hit_record<mat>();
+        packet.add(SCENE_CAMERA.get_ray(x / double(nx), y / double(ny)));
+      }
+    }
+    packet.finalize();
+    world.intersect_packet(packet, recs.data());
+    for (int k = 0; k < packet.size; ++k) {
+      // 同じサンプルを始め直してカメラのサンプルを同じ順に引き直す
+      smp.start_sample(pixel_i[k], pixel_j[k], s);
+      double x = pixel_i[k] + random_double();
+      double y = pixel_j[k] + random_double();
+      ray r = SCENE_CAMERA.get_ray(x / double(nx), y / double(ny));
+      hit_record<mat> *rec = nullptr;
+      if (packet.t_max[k] < INF) {
+        rec = &recs[k];
+        hittable<mat>::resolve(r, *rec);
+      }
+      shade(pixel_i[k], pixel_j[k], x, y, r, rec);
+    }
+  }
+#else
+  hit_record<mat> rec;
+  for (int j = j0; j < j1; ++j) {
+    for (int i = i0; i < i1; ++i) {
+      const int ns = samples(i, j);
+      for (int s = 0; s < ns; ++s) {
+        smp.start_sample(i, j, s);
+        double x = i + random_double();
+        double y = j + random_double();
+        ray r = SCENE_CAMERA.get_ray(x / double(nx), y / double(ny));
+        rec = hit_record<mat>();
+        bool hit = world.hit(r, 0.001, INF, rec);
+        shade(i, j, x, y, r, hit ? &rec : nullptr);
+      }
+    }
+  }
+#endif
+}
+
+#endif //FLUORSWITCH_SRC_RENDER_CAMERA_PACKET_H_
@@ -0,0 +1,108 @@
+#ifndef FLUORSWITCH_SRC_RENDER_DENOISER_H_
+#define FLUORSWITCH_SRC_RENDER_DENOISER_H_
+
+#include <algorithm>
+#include <vector>
+#include "../utils/util_funcs.h"
+#include "frame_buffer.h"
+
+/// Edge-Avoiding À-Trous Wavelet フィルタ (Dammertz et al. 2010)
+/// 輝度の重みは画素毎の分散で正規化する(SVGF)
+/// アルベドで除算した照度を平滑化し、最後にアルベドを掛け戻す
+inline void denoise(frame_buffer &fb) {
+  const int w = fb.width;
+  const int h = fb.height;
+  const size_t n = size_t(w) * h;
+  // B3スプライン
+  const double kernel[3] = {3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0};
+
+  std::vector<color> irradiance(n), irradiance_tmp(n), demodulate(n);
+  std::vector<double> variance(n), variance_tmp(n), variance_blur(n);
+
+  /// アルベドで除算
+  for (size_t p = 0; p < n; ++p) {
+    color a = fb.albedo[p];
+    demodulate[p] = color(ffmax(a.x(), DENOISE_ALBEDO_EPS), ffmax(a.y(), DENOISE_ALBEDO_EPS), ffmax(a.z(), DENOISE_ALBEDO_EPS));
+    color c = fb.radiance[p];
+    // NaNを除外
+    if (c.x() != c.x() || c.y() != c.y() || c.z() != c.z()) c = ZERO;
+    irradiance[p] = c / demodulate[p];
+    double var = fb.variance[p];
+    double lum_a = luminance(demodulate[p]);
+    variance[p] = var == var ? var / (lum_a * lum_a) : 0.0;
+  }
+
+  for (int iteration = 0; iteration < DENOISE_ITERATIONS; ++iteration) {
+    const int step = 1 << iteration;
+    // 輝度の重みに使う分散は3x3ガウシアンで平滑化(分散0の外れ値が残るのを防ぐ)
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+    for (int j = 0; j < h; ++j) {
+      for (int i = 0; i < w; ++i) {
+        double sum = 0.0, sum_k = 0.0;
+        for (int dy = -1; dy <= 1; ++dy) {
+          for (int dx = -1; dx <= 1; ++dx) {
+            int x = i + dx, y = j + dy;
+            if (x < 0 || w <= x || y < 0 || h <= y) continue;
+            double k = (dx == 0 ? 0.5 : 0.25) * (dy == 0 ? 0.5 : 0.25);
+            sum += k * variance[fb.index(x, y)];
+            sum_k += k;
+          }
+        }
+        variance_blur[fb.index(i, j)] = sum / sum_k;
+      }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+    for (int j = 0; j < h; ++j) {
+      for (int i = 0; i < w; ++i) {
+        size_t p = fb.index(i, j);
+        double lum_p = luminance(irradiance[p]);
+        double sigma_l = DENOISE_SIGMA_LUM * sqrt(variance_blur[p]) + 1e-6;
+        const vec3 &n_p = fb.normal[p];
+        double z_p = fb.depth[p];
+        const color &a_p = fb.albedo[p];
+
+        color sum_c = ZERO;
+        double sum_v = 0.0;
+        double sum_w = 0.0;
+        for (int dy = -2; dy <= 2; ++dy) {
+          int y = j + dy * step;
+          if (y < 0 || h <= y) continue;
+          for (int dx = -2; dx <= 2; ++dx) {
+            int x = i + dx * step;
+            if (x < 0 || w <= x) continue;
+            size_t q = fb.index(x, y);
+
+            // 輝度
+            double w_l = exp(-fabs(luminance(irradiance[q]) - lum_p) / sigma_l);
+            // 法線
+            const vec3 &n_q = fb.normal[q];
+            double w_n = (n_p.near_zero() && n_q.near_zero()) ? 1.0 : pow(ffmax(dot(n_p, n_q), 0.0), DENOISE_SIGMA_NORMAL);
+            // 深度
+            double dist = step * std::max(abs(dx), abs(dy));
+            double w_z = exp(-fabs(z_p - fb.depth[q]) / (DENOISE_SIGMA_DEPTH * z_p * dist + 1e-6));
+            // アルベド
+            double w_a = exp(-(fb.albedo[q] - a_p).squared_length() / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO));
+
+            double weight = kernel[abs(dx)] * kernel[abs(dy)] * w_l * w_n * w_z * w_a;
+            sum_c += weight * irradiance[q];
+            sum_v += weight * weight * variance[q];
+            sum_w += weight;
+          }
+        }
+        // 中心画素の重みは常に正
+        irradiance_tmp[p] = sum_c / sum_w;
+        variance_tmp[p] = sum_v / (sum_w * sum_w);
+      }
+    }
+    irradiance.swap(irradiance_tmp);
+    variance.swap(variance_tmp);
+  }
+
+  /// アルベドを掛け戻す
+  for (size_t p = 0; p < n; ++p) {
+    fb.radiance[p] = irradiance[p] * demodulate[p];
+  }
+}
+
+#endif //FLUORSWITCH_SRC_RENDER_DENOISER_H_
@@ -0,0 +1,229 @@
+#ifndef FLUORSWITCH_SRC_RENDER_FILM_H_
+#define FLUORSWITCH_SRC_RENDER_FILM_H_
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "../utils/util_funcs.h"
+#include "frame_buffer.h"
+
+/// 再構成フィルタ(x, y で分離可能)
+/// 評価は画素の1/4の範囲 [0, radius]^2 を FILM_FILTER_TABLE_SIZE^2 に分けた表を引く
+class reconstruction_filter {
+ public:
+  enum type { box = 0, gaussian = 1, mitchell = 2, blackman_harris = 3 };
+
+  reconstruction_filter(int filter_type, double r) : radius(filter_type == box ? 0.5 : r) {
+    const int n = FILM_FILTER_TABLE_SIZE;
+    table.resize(size_t(n) * n);
+    integral = 0.0;
+    for (int y = 0; y < n; ++y) {
+      double fy = evaluate_1d(filter_type, (y + 0.5) * radius / n);
+      for (int x = 0; x < n; ++x) {
+        double f = evaluate_1d(filter_type, (x + 0.5) * radius / n) * fy;
+        table[size_t(y) * n + x] = f;
+        integral += f;
+      }
+    }
+    // 4象限分の積分(点から全画素へ配る寄与の正規化に使う)
+    integral *= 4.0 * radius * radius / (double(n) * n);
+    inv_radius = 1.0 / radius;
+  }
+
+  inline double operator()(double dx, double dy) const {
+    const int n = FILM_FILTER_TABLE_SIZE;
+    int x = std::min(int(fabs(dx) * inv_radius * n), n - 1);
+    int y = std::min(int(fabs(dy) * inv_radius * n), n - 1);
+    return table[size_t(y) * n + x];
+  }
+
+ private:
+  /// 1次元のフィルタ(x >= 0)
+  double evaluate_1d(int filter_type, double x) const {
+    switch (filter_type) {
+      case gaussian: {
+        // 半径で0になるようにずらす
+        return std::max(0.0, exp(-FILM_GAUSSIAN_ALPHA * x * x) - exp(-FILM_GAUSSIAN_ALPHA * radius * radius));
+      }
+      case mitchell: {
+        // Mitchell & Netravali 1988 (B = C = 1/3)、[0, 2]に伸ばして評価
+        const double B = 1.0 / 3.0, C = 1.0 / 3.0;
+        double t = 2.0 * x / radius;
+        if (t < 1.0) {
+          return ((12 - 9 * B - 6 * C) * t * t * t + (-18 + 12 * B + 6 * C) * t * t + (6 - 2 * B)) / 6.0;
+        }
+        if (t < 2.0) {
+          return ((-B - 6 * C) * t * t * t + (6 * B + 30 * C) * t * t + (-12 * B - 48 * C) * t + (8 * B + 24 * C)) / 6.0;
+        }
+        return 0.0;
+      }
+      case blackman_harris: {
+        // 4項のBlackman-Harris窓、[-radius, radius]を窓の[0, 1]に対応させる
+        double t = 0.5 + 0.5 * x / radius;
+        return 0.35875 - 0.48829 * cos(2 * M_PI * t) + 0.14128 * cos(4 * M_PI * t) - 0.01168 * cos(6 * M_PI * t);
+      }
+      default:
+        return 1.0;
+    }
+  }
+
+ public:
+  double radius;
+  double inv_radius;
+  // フィルタの積分
+  double integral;
+
+ private:
+  std::vector<double> table;
+};
+
+class film;
+
+/// タイル毎の矩形の書き込み先(画素の範囲の外側にフィルタの半径分の余白を持つ)
+/// 全タイルの描画が終わったら、タイルの順にfilm::mergeで画像へまとめる
+class film_tile {
+ public:
+  explicit film_tile(const film &f) : owner(f) {}
+
+  /// 画素 [x0, x1) x [y0, y1) にサンプルを置く
+  inline void reset(int x0, int y0, int x1, int y1);
+
+  /// 画面上の位置(x, y) (画素(i, j)は[i, i + 1) x [j, j + 1))のサンプルをフィルタの重みで周囲の画素へ加える
+  inline void add_sample(double x, double y, const color &c);
+
+ private:
+  friend class film;
+  const film &owner;
+  // 余白を含む範囲
+  int bx0{0}, by0{0}, bx1{0}, by1{0};
+  std::vector<color> sum;
+  std::vector<double> weight;
+};
+
+/// 再構成フィルタで重み付けした画像
+/// カメラからのサンプルはタイル毎のfilm_tileで重みと共に集め、光源側からの寄与(画像のどこにでも届く)は固定小数点で原子的に直接加える
+/// どちらも加算の順序がスレッドのスケジュールに依らないので、スレッド数に依らず同じ画像になる
+class film {
+ public:
+  film(unsigned int w, unsigned int h)
+      : width(w), height(h), filter(FILM_FILTER, FILM_FILTER_RADIUS),
+        sum(size_t(w) * h, ZERO), weight(size_t(w) * h, 0.0),
+        splats(new std::atomic<int64_t>[3 * size_t(w) * h]) {
+    clear();
+  }
+
+  void clear() {
+    std::fill(sum.begin(), sum.end(), ZERO);
+    std::fill(weight.begin(), weight.end(), 0.0);
+    for (size_t k = 0; k < 3 * size_t(width) * height; ++k) {
+      splats[k].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /// 描画の終わったタイルを画像へ加える
+  /// タイルの余白は隣のタイルと重なり、加える順で和が変わるので、並列の描画が終わってからタイルの順に呼ぶ
+  void merge(const film_tile &tile) {
+    int tw = tile.bx1 - tile.bx0;
+    for (int j = tile.by0; j < tile.by1; ++j) {
+      for (int i = tile.bx0; i < tile.bx1; ++i) {
+        size_t t = size_t(j - tile.by0) * tw + (i - tile.bx0);
+        size_t p = index(i, j);
+        sum[p] += tile.sum[t];
+        weight[p] += tile.weight[t];
+      }
+    }
+  }
+
+  /// 光源側からの寄与を画面上の位置(x, y)に加える(フィルタの積分で正規化する)
+  /// 加算は原子的なので、描画中の積分器(const)から複数スレッドで同時に呼べる(固定小数点なので和は順序に依らない)
+  void add_splat(double x, double y, const color &c) const {
+    double px = x - 0.5, py = y - 0.5;
+    int i0 = std::max(int(floor(px - filter.radius)) + 1, 0);
+    int i1 = std::min(int(floor(px + filter.radius)), int(width) - 1);
+    int j0 = std::max(int(floor(py - filter.radius)) + 1, 0);
+    int j1 = std::min(int(floor(py + filter.radius)), int(height) - 1);
+    double inv_integral = 1.0 / filter.integral;
+    for (int j = j0; j <= j1; ++j) {
+      for (int i = i0; i <= i1; ++i) {
+        double w = filter(i - px, j - py) * inv_integral;
+        if (w == 0.0) continue;
+        size_t p = 3 * index(i, j);
+        atomic_add_fixed(splats[p], w * c.x());
+        atomic_add_fixed(splats[p + 1], w * c.y());
+        atomic_add_fixed(splats[p + 2], w * c.z());
+      }
+    }
+  }
+
+  /// 画素の値: カメラからのサンプルの重み付き平均 + 光源側からの寄与 x splat_scale
+  color pixel(unsigned int i, unsigned int j, double splat_scale = 0.0) const {
+    size_t p = index(i, j);
+    color c = weight[p] != 0.0 ? sum[p] / weight[p] : ZERO;
+    if (splat_scale != 0.0) {
+      c += splat_scale * color(fixed_to_double(splats[3 * p].load(std::memory_order_relaxed)),
+                               fixed_to_double(splats[3 * p + 1].load(std::memory_order_relaxed)),
+                               fixed_to_double(splats[3 * p + 2].load(std::memory_order_relaxed)));
+    }
+    return c;
+  }
+
+  /// 描画した画素(spp_mapで0より大きい画素)の放射輝度を書き込む(分散と補助バッファはset_pixelの値のまま)
+  void write(frame_buffer &fb, const std::vector<int> *spp_map, double splat_scale = 0.0) const {
+    for (unsigned int j = 0; j < height; ++j) {
+      for (unsigned int i = 0; i < width; ++i) {
+        size_t p = index(i, j);
+        if (spp_map != nullptr && (*spp_map)[p] <= 0) continue;
+        fb.radiance[fb.index(i, j)] = pixel(i, j, splat_scale);
+      }
+    }
+  }
+
+  inline size_t index(unsigned int i, unsigned int j) const {
+    return size_t(j) * width + i;
+  }
+
+ public:
+  unsigned int width;
+  unsigned int height;
+  reconstruction_filter filter;
+
+ private:
+  std::vector<color> sum;
+  std::vector<double> weight;
+  std::unique_ptr<std::atomic<int64_t>[]> splats;
+};
+
+inline void film_tile::reset(int x0, int y0, int x1, int y1) {
+  // 範囲内のサンプルが届く画素([x - 0.5 - radius, x - 0.5 + radius]に画素の中心がある)
+  int margin = int(ceil(owner.filter.radius - 0.5));
+  bx0 = std::max(x0 - margin, 0);
+  by0 = std::max(y0 - margin, 0);
+  bx1 = std::min(x1 + margin, int(owner.width));
+  by1 = std::min(y1 + margin, int(owner.height));
+  size_t n = size_t(bx1 - bx0) * (by1 - by0);
+  sum.assign(n, ZERO);
+  weight.assign(n, 0.0);
+}
+
+inline void film_tile::add_sample(double x, double y, const color &c) {
+  const auto &filter = owner.filter;
+  // 画素の中心を整数にした座標で、(p - radius, p + radius]にある画素
+  double px = x - 0.5, py = y - 0.5;
+  int i0 = std::max(int(floor(px - filter.radius)) + 1, bx0);
+  int i1 = std::min(int(floor(px + filter.radius)), bx1 - 1);
+  int j0 = std::max(int(floor(py - filter.radius)) + 1, by0);
+  int j1 = std::min(int(floor(py + filter.radius)), by1 - 1);
+  int tw = bx1 - bx0;
+  for (int j = j0; j <= j1; ++j) {
+    for (int i = i0; i <= i1; ++i) {
+      double w = filter(i - px, j - py);
+      size_t t = size_t(j - by0) * tw + (i - bx0);
+      sum[t] += w * c;
+      weight[t] += w;
+    }
+  }
+}
+
+#endif //FLUORSWITCH_SRC_RENDER_FILM_H_
@@ -0,0 +1,67 @@
+#ifndef FLUORSWITCH_SRC_RENDER_FRAME_BUFFER_H_
+#define FLUORSWITCH_SRC_RENDER_FRAME_BUFFER_H_
+
+#include <vector>
+#include "../utils/util_funcs.h"
+
+/// 最初の交差点の特徴量
+struct aov_record {
+  color albedo{ZERO};
+  vec3 normal{ZERO_VEC3};
+  double depth{0.0};
+};
+
+/// 線形輝度と補助バッファ(アルベド・法線・深度)
+class frame_buffer {
+ public:
+  frame_buffer(unsigned int w, unsigned int h)
+      : width(w), height(h),
+        radiance(w * h, ZERO), variance(w * h, 0.0),
+        albedo(w * h, ZERO), normal(w * h, ZERO_VEC3), depth(w * h, 0.0) {}
+
+  inline size_t index(unsigned int i, unsigned int j) const {
+    return size_t(j) * width + i;
+  }
+
+  /// 画素の書き込み
+  /// lum_sum, lum_sq_sum: サンプル輝度の和と二乗和(分散の推定用)
+  inline void set_pixel(unsigned int i, unsigned int j, int ns,
+                        const color &col_sum, double lum_sum, double lum_sq_sum,
+                        const aov_record &aov_sum) {
+    auto idx = index(i, j);
+    double inv_ns = 1.0 / ns;
+    radiance[idx] = col_sum * inv_ns;
+    double mean = lum_sum * inv_ns;
+    // 平均値の分散
+    variance[idx] = ns > 1 ? ffmax(lum_sq_sum * inv_ns - mean * mean, 0.0) / (ns - 1) : 0.0;
+    albedo[idx] = aov_sum.albedo * inv_ns;
+    normal[idx] = aov_sum.normal.near_zero() ? ZERO_VEC3 : unit_vector(aov_sum.normal);
+    depth[idx] = aov_sum.depth * inv_ns;
+  }
+
+  /// ガンマ補正して8bitのビットマップへ
+  void write(unsigned char *data) const {
+    for (unsigned int j = 0; j < height; ++j) {
+      for (unsigned int i = 0; i < width; ++i) {
+        drawPix(data, width, height, i, j, gamma_correct(radiance[index(i, j)]));
+      }
+    }
+  }
+
+ public:
+  unsigned int width;
+  unsigned int height;
+  std::vector<color> radiance;
+  std::vector<double> variance;
+  std::vector<color> albedo;
+  std::vector<vec3> normal;
+  std::vector<double> depth;
+};
+
+inline void accumulate_aov(aov_record &sum, const aov_record &aov) {
+  sum.albedo += aov.albedo;
+  sum.normal += aov.normal;
+  sum.depth += aov.depth;
+}
+
+#endif //FLUORSWITCH_SRC_RENDER_FRAME_BUFFER_H_
@@ -0,0 +1,85 @@
+#ifndef FLUORSWITCH_SRC_RENDER_INTEGRATOR_TRAITS_H_
+#define FLUORSWITCH_SRC_RENDER_INTEGRATOR_TRAITS_H_
+
+#include "../material/material.h"
+#include "../material/spectral_material.h"
+#include "frame_buffer.h"
+#include "path_trace.h"
+#include "spectral_path_trace.h"
+
+/// 積分器をマテリアルの種類(RGB / スペクトラル)に依らず書くための型情報
+template<typename mat>
+struct integrator_traits;
+
+template<>
+struct integrator_traits<material> {
+  using radiance = color;
+  using scatter_record = scattered_record;
+  static constexpr int max_depth = RGB_MAX_RAY_DEPTH;
+
+  static radiance zero() { return ZERO; }
+  static bool is_zero(const radiance &c) { return c.x() <= 0.0 && c.y() <= 0.0 && c.z() <= 0.0; }
+  static color to_rgb(const radiance &c) { return c; }
+  static color albedo(const scatter_record &s_rec) { return s_rec.attenuation; }
+  static bool specular(const scatter_record &s_rec) { return s_rec.is_specular; }
+
+  /// 反射方向のサンプリング(鏡面の場合はpdf = 0)
+  static vec3 sample(const scatter_record &s_rec, double &pdf_val) {
+    if (s_rec.is_specular) {
+      pdf_val = 0.0;
+      return s_rec.specular_ray.direction();
+    }
+    vec3 dir = s_rec.pdf_ptr->generate();
+    pdf_val = s_rec.pdf_ptr->value(dir);
+    return dir;
+  }
+
+  /// 既存のパストレーサーで入射放射輝度を推定
+  static radiance trace(const ray &r, const hittable<material> &world, shared_ptr<hittable_list<material>> &lights,
+                        int depth, bool count_emitted = true) {
+    return path_trace(r, world, lights, depth, nullptr, count_emitted);
+  }
+
+  /// 入射放射輝度 incoming に対するBSDF x cos (scattering_pdf = cos / π)
+  static radiance reflect(const scatter_record &s_rec, double scattering_pdf, const radiance &incoming) {
+    return s_rec.attenuation * scattering_pdf * incoming;
+  }
+};
+
+template<>
+struct integrator_traits<spectral_material> {
+  using radiance = spectral_distribution;
+  using scatter_record = spectral_scattered_record;
+  static constexpr int max_depth = SPECTRAL_MAX_RAY_DEPTH;
+
+  static radiance zero() { return zero_spectra; }
+  static bool is_zero(const radiance &s) { return s.sum() <= 0.0; }
+  static color to_rgb(const radiance &s) { return spectralToRgb(s); }
+  static color albedo(const scatter_record &s_rec) { return spectralToRgb(s_rec.attenuation); }
+  static bool specular(const scatter_record &s_rec) { return false; }
+
+  static vec3 sample(const scatter_record &s_rec, double &pdf_val) {
+    vec3 dir = s_rec.pdf_ptr->generate();
+    pdf_val = s_rec.pdf_ptr->value(dir);
+    return dir;
+  }
+
+  static radiance trace(const ray &r, const hittable<spectral_material> &world,
+                        shared_ptr<hittable_list<spectral_material>> &lights,
+                        int depth, bool count_emitted = true) {
+    return spectral_path_trace(r, world, lights, depth, nullptr, count_emitted);
+  }
+
+  /// 蛍光は励起スペクトルで吸収した分を発光スペクトルで再放射する
+  /// BSDFサンプリング(pdf = cos / π)の場合、spectral_path_traceの蛍光項と一致する
+  static radiance reflect(const scatter_record &s_rec, double scattering_pdf, const radiance &incoming) {
+    auto reflected = s_rec.attenuation * scattering_pdf * incoming;
+    if (s_rec.is_fluor) {
+      auto K = s_rec.excitation * incoming;
+      reflected = reflected + s_rec.emission * (K.sum() * inv_wave_pdf_val * scattering_pdf);
+    }
+    return reflected;
+  }
+};
+
+#endif //FLUORSWITCH_SRC_RENDER_INTEGRATOR_TRAITS_H_
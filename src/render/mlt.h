@@ -0,0 +1,294 @@
+#ifndef FLUORSWITCH_SRC_RENDER_MLT_H_
+#define FLUORSWITCH_SRC_RENDER_MLT_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <omp.h>
+#include "../camera/camera.h"
+#include "../utils/hittable.h"
+#include "../utils/hittable_list.h"
+#include "../sampling/sampler.h"
+#include "frame_buffer.h"
+#include "integrator_traits.h"
+
+/// 変異用の乱数(splitmix64、種から同じ列を再現できる)
+class mlt_rng {
+ public:
+  explicit mlt_rng(uint64_t seed) : state(seed) {}
+
+  uint64_t next_u64() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  double uniform() {
+    return (next_u64() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  /// 標準正規分布(Box-Muller)
+  double normal() {
+    double u1 = 1.0 - uniform();
+    double u2 = uniform();
+    return sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+  }
+
+ private:
+  uint64_t state;
+};
+
+/// 主標本空間の点 (Kelemen et al. 2002)
+/// random_doubleの差し替え先として既存のパストレーサーに乱数を供給する
+/// 各次元は参照されたときに、最後の変更以降の変異をまとめて適用する
+class pss_sampler : public random_stream {
+  struct primary_sample {
+    double value{0.0};
+    double backup{0.0};
+    long last_modified{0};
+    long modify_backup{0};
+  };
+
+ public:
+  explicit pss_sampler(uint64_t seed) : rng(seed) {}
+
+  void start_iteration() {
+    ++iteration;
+    large_step = rng.uniform() < MLT_LARGE_STEP_PROB;
+    index = 0;
+  }
+
+  void accept() {
+    if (large_step) {
+      last_large_step = iteration;
+    }
+  }
+
+  void reject() {
+    for (auto &x : samples) {
+      if (x.last_modified == iteration) {
+        x.value = x.backup;
+        x.last_modified = x.modify_backup;
+      }
+    }
+    --iteration;
+  }
+
+  double next() override {
+    if (index >= samples.size()) {
+      samples.resize(index + 1);
+    }
+    auto &x = samples[index++];
+    // 最後の大きな変異より前の値は一様乱数で置き換える
+    if (x.last_modified < last_large_step) {
+      x.value = rng.uniform();
+      x.last_modified = last_large_step;
+    }
+    x.backup = x.value;
+    x.modify_backup = x.last_modified;
+    if (large_step) {
+      x.value = rng.uniform();
+    } else {
+      double sigma = MLT_SIGMA * sqrt(double(iteration - x.last_modified));
+      x.value += rng.normal() * sigma;
+      x.value -= floor(x.value);
+      if (x.value >= 1.0) x.value = 0.0;
+    }
+    x.last_modified = iteration;
+    return x.value;
+  }
+
+  double uniform() { return rng.uniform(); }
+
+ private:
+  mlt_rng rng;
+  std::vector<primary_sample> samples;
+  size_t index{0};
+  long iteration{0};
+  long last_large_step{0};
+  bool large_step{true};
+};
+
+/// Primary Sample Space MLT
+/// 既存のパストレーサーを主標本空間の関数として扱い、画素毎ではなく画像全体を複数のマルコフ連鎖で探索する
+/// 暗いフレームで寄与の大きい稀なパス(弱い紫外光による蛍光など)の周辺を重点的に調べる
+template<typename mat>
+class pssmlt_integrator {
+  using traits = integrator_traits<mat>;
+  using radiance = typename traits::radiance;
+
+  /// 画像(分散の推定用に偶数番目と奇数番目の連鎖で分ける)
+  /// 全連鎖から固定小数点で原子的に加えるので、和は連鎖を実行するスレッドや順序に依らない
+  struct film {
+    std::unique_ptr<std::atomic<int64_t>[]> half[2];
+  };
+
+ public:
+  pssmlt_integrator(unsigned int w, unsigned int h) : width(w), height(h) {
+    image.half[0].reset(new std::atomic<int64_t>[3 * size_t(w) * h]);
+    image.half[1].reset(new std::atomic<int64_t>[3 * size_t(w) * h]);
+  }
+
+  /// rgb_render / spectral_render と同じ形式でfbへ描画
+  /// 連鎖は画像全体を動くので、spp_mapは平均のサンプル数(変異の総数)としてだけ使い、全画素を書き込む
+  /// 一部の画素だけを描き直す使い方(時間方向の再利用)はできない
+  void render(frame_buffer &fb, int spp, const hittable_list<mat> &world, shared_ptr<hittable_list<mat>> &lights,
+              const std::vector<int> *spp_map = nullptr) {
+    const size_t n = size_t(width) * height;
+    double total_spp = double(spp) * n;
+    if (spp_map != nullptr) {
+      total_spp = 0.0;
+      for (int ns : *spp_map) total_spp += ffmax(ns, 0);
+    }
+    for (size_t k = 0; k < 3 * n; ++k) {
+      image.half[0][k].store(0, std::memory_order_relaxed);
+      image.half[1][k].store(0, std::memory_order_relaxed);
+    }
+    // 描画パス毎に異なる乱数列(スレッドの乱数の状態に依らない)
+    const uint64_t salt = mix64(next_sampler_pass() + 0x9e3779b97f4a7c15ULL);
+
+    /// ブートストラップ: 一様な主標本でパスを求め、画像全体の明るさを推定
+    const int n_bootstrap = std::max(1, int(MLT_BOOTSTRAP_PER_PIXEL * n));
+    std::vector<double> cdf(n_bootstrap + 1, 0.0);
+    #pragma omp parallel for schedule(dynamic, 256) num_threads(MAX_THREAD_NUM)
+    for (int k = 0; k < n_bootstrap; ++k) {
+      pss_sampler sampler(seed(salt, k));
+      double u, v;
+      cdf[k + 1] = contribution(evaluate(sampler, world, lights, u, v));
+    }
+    for (int k = 0; k < n_bootstrap; ++k) {
+      cdf[k + 1] += cdf[k];
+    }
+    const double b = cdf[n_bootstrap] / n_bootstrap;
+
+    /// 連鎖毎の変異
+    const int n_chains = 2 * std::max(1, MLT_CHAINS / 2);
+    const long mutations = std::max(1L, long(ceil(total_spp / n_chains)));
+    if (b > 0.0) {
+      #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+      for (int c = 0; c < n_chains; ++c) {
+        auto &out = image.half[c & 1];
+        // 明るさに比例してブートストラップのパスを選び、同じ乱数列で再現して連鎖の初期状態にする
+        mlt_rng chain_rng(seed(~salt, c));
+        double x = chain_rng.uniform() * cdf[n_bootstrap];
+        int k = int(std::upper_bound(cdf.begin() + 1, cdf.end(), x) - cdf.begin()) - 1;
+        k = std::min(std::max(k, 0), n_bootstrap - 1);
+        pss_sampler sampler(seed(salt, k));
+        double u_cur, v_cur;
+        color L_cur = evaluate(sampler, world, lights, u_cur, v_cur);
+        double I_cur = contribution(L_cur);
+
+        for (long m = 0; m < mutations; ++m) {
+          sampler.start_iteration();
+          double u_prop, v_prop;
+          color L_prop = evaluate(sampler, world, lights, u_prop, v_prop);
+          double I_prop = contribution(L_prop);
+          double accept = I_cur > 0.0 ? ffmin(1.0, I_prop / I_cur) : 1.0;
+          // 採択確率で重み付けした期待値を両方の点へ加算
+          if (accept > 0.0) {
+            splat(out, u_prop, v_prop, L_prop * (accept / I_prop));
+          }
+          if (I_cur > 0.0 && accept < 1.0) {
+            splat(out, u_cur, v_cur, L_cur * ((1.0 - accept) / I_cur));
+          }
+          if (sampler.uniform() < accept) {
+            u_cur = u_prop;
+            v_cur = v_prop;
+            L_cur = L_prop;
+            I_cur = I_prop;
+            sampler.accept();
+          } else {
+            sampler.reject();
+          }
+        }
+      }
+    }
+
+    /// 画像を書き込み
+    // 半分ずつの連鎖がそれぞれ画像全体の推定になるように正規化
+    const double scale = b * n / (mutations * (n_chains / 2));
+    #pragma omp parallel for num_threads(MAX_THREAD_NUM)
+    for (int j = 0; j < height; ++j) {
+      for (int i = 0; i < width; ++i) {
+        size_t p = 3 * fb.index(i, j);
+        color half[2];
+        for (int h = 0; h < 2; ++h) {
+          half[h] = color(fixed_to_double(image.half[h][p].load(std::memory_order_relaxed)),
+                          fixed_to_double(image.half[h][p + 1].load(std::memory_order_relaxed)),
+                          fixed_to_double(image.half[h][p + 2].load(std::memory_order_relaxed)));
+        }
+        half[0] *= scale;
+        half[1] *= scale;
+        double l0 = luminance(half[0]), l1 = luminance(half[1]);
+        aov_record aov = primary_aov(world, i, j);
+        aov.albedo *= 2.0;
+        aov.normal *= 2.0;
+        aov.depth *= 2.0;
+        // 2つの独立な推定の平均として書き込む(分散は差から求まる)
+        fb.set_pixel(i, j, 2, half[0] + half[1], l0 + l1, l0 * l0 + l1 * l1, aov);
+      }
+    }
+  }
+
+ private:
+  static uint64_t seed(uint64_t salt, uint64_t index) {
+    mlt_rng r(salt ^ (index * 0x9e3779b97f4a7c15ULL));
+    return r.next_u64();
+  }
+
+  /// 受理判定に使うスカラーの寄与(負のRGB成分を持つスペクトルも取りこぼさないよう絶対値の和)
+  static double contribution(const color &c) {
+    return fabs(c.x()) + fabs(c.y()) + fabs(c.z());
+  }
+
+  /// 主標本の最初の2次元で画面上の位置を決め、残りを既存のパストレーサーに渡す
+  color evaluate(pss_sampler &sampler, const hittable_list<mat> &world, shared_ptr<hittable_list<mat>> &lights,
+                 double &u, double &v) const {
+    current_random_stream() = &sampler;
+    u = sampler.next();
+    v = sampler.next();
+    ray r = SCENE_CAMERA.get_ray(u, v);
+    color c = traits::to_rgb(traits::trace(r, world, lights, traits::max_depth));
+    current_random_stream() = nullptr;
+    // NaN, INFを除外
+    if (!(fabs(c.x()) < INF && fabs(c.y()) < INF && fabs(c.z()) < INF)) {
+      return ZERO;
+    }
+    return c;
+  }
+
+  void splat(std::unique_ptr<std::atomic<int64_t>[]> &out, double u, double v, const color &c) const {
+    int i = std::min(int(u * width), int(width) - 1);
+    int j = std::min(int(v * height), int(height) - 1);
+    size_t p = 3 * (size_t(j) * width + i);
+    atomic_add_fixed(out[p], c.x());
+    atomic_add_fixed(out[p + 1], c.y());
+    atomic_add_fixed(out[p + 2], c.z());
+  }
+
+  /// 画素中心の最初の交差点の特徴量(デノイザー用)
+  aov_record primary_aov(const hittable_list<mat> &world, int i, int j) const {
+    aov_record aov;
+    ray r = SCENE_CAMERA.get_ray((i + 0.5) / double(width), (j + 0.5) / double(height));
+    hit_record<mat> rec;
+    if (!world.hit(r, 0.001, INF, rec)) {
+      return aov;
+    }
+    typename traits::scatter_record s_rec;
+    bool scatters = rec.mat_ptr->scatter(r, rec, s_rec);
+    aov.albedo = scatters ? traits::albedo(s_rec) : traits::to_rgb(rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p));
+    aov.normal = rec.normal;
+    aov.depth = rec.t * r.direction().length();
+    return aov;
+  }
+
+ private:
+  unsigned int width;
+  unsigned int height;
+  film image;
+};
+
+#endif //FLUORSWITCH_SRC_RENDER_MLT_H_
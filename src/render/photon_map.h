@@ -0,0 +1,329 @@
+#ifndef FLUORSWITCH_SRC_RENDER_PHOTON_MAP_H_
+#define FLUORSWITCH_SRC_RENDER_PHOTON_MAP_H_
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <omp.h>
+#include "../camera/camera.h"
+#include "../material/spectral_material.h"
+#include "../utils/hittable.h"
+#include "../utils/hittable_list.h"
+#include "../utils/spectral_distribution.h"
+#include "../sampling/sampler.h"
+#include "frame_buffer.h"
+#include "integrator_traits.h"
+
+/// 波長付きフォトン
+/// 波長(インデックス)毎に1本ずつ追跡し、蛍光面では発光スペクトルに従って波長を変える
+struct photon {
+  point3 p;
+  vec3 normal;
+  int wavelength;
+  double power;
+};
+
+/// フォトンのハッシュグリッド
+/// セル毎の数え上げ -> 累積和 -> 書き込みの3段階で作る
+/// 書き込みはフォトンの順に逐次行い、セルの中の並び(収集で加える順)をスレッド数に依らず決める
+class photon_grid {
+ public:
+  void build(const std::vector<photon> &photons, double size) {
+    cell_size = size;
+    const size_t n = photons.size();
+    table_size = 1;
+    while (table_size < 2 * n) table_size <<= 1;
+    std::unique_ptr<std::atomic<uint32_t>[]> counts(new std::atomic<uint32_t>[table_size]);
+    #pragma omp parallel for num_threads(MAX_THREAD_NUM)
+    for (long h = 0; h < long(table_size); ++h) {
+      counts[h].store(0, std::memory_order_relaxed);
+    }
+    std::vector<uint32_t> cells(n);
+    #pragma omp parallel for num_threads(MAX_THREAD_NUM)
+    for (long k = 0; k < long(n); ++k) {
+      cells[k] = cell_hash(photons[k].p);
+      counts[cells[k]].fetch_add(1, std::memory_order_relaxed);
+    }
+    cell_start.assign(table_size + 1, 0);
+    for (size_t h = 0; h < table_size; ++h) {
+      cell_start[h + 1] = cell_start[h] + counts[h].load(std::memory_order_relaxed);
+      counts[h].store(cell_start[h], std::memory_order_relaxed);
+    }
+    // 同じセルのフォトンを連続させる(参照の局所性のため)
+    sorted.resize(n);
+    for (size_t k = 0; k < n; ++k) {
+      sorted[counts[cells[k]].fetch_add(1, std::memory_order_relaxed)] = photons[k];
+    }
+  }
+
+  /// 点pから半径radius以内のフォトン(セルのハッシュ衝突は距離で除外)
+  template<typename F>
+  void query(const point3 &p, double radius, F &&f) const {
+    if (sorted.empty()) {
+      return;
+    }
+    const double r2 = radius * radius;
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; ++a) {
+      lo[a] = int(floor((p[a] - radius) / cell_size));
+      hi[a] = int(floor((p[a] + radius) / cell_size));
+    }
+    for (int x = lo[0]; x <= hi[0]; ++x) {
+      for (int y = lo[1]; y <= hi[1]; ++y) {
+        for (int z = lo[2]; z <= hi[2]; ++z) {
+          uint32_t h = hash(x, y, z);
+          for (uint32_t k = cell_start[h]; k < cell_start[h + 1]; ++k) {
+            const auto &ph = sorted[k];
+            if ((ph.p - p).squared_length() <= r2) {
+              f(ph);
+            }
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  uint32_t hash(int x, int y, int z) const {
+    uint32_t h = (uint32_t(x) * 73856093u) ^ (uint32_t(y) * 19349663u) ^ (uint32_t(z) * 83492791u);
+    return h & uint32_t(table_size - 1);
+  }
+
+  uint32_t cell_hash(const point3 &p) const {
+    return hash(int(floor(p.x() / cell_size)), int(floor(p.y() / cell_size)), int(floor(p.z() / cell_size)));
+  }
+
+ private:
+  double cell_size{1.0};
+  size_t table_size{1};
+  std::vector<uint32_t> cell_start;
+  std::vector<photon> sorted;
+};
+
+/// スペクトラル・フォトンマッピング (SPPM, Hachisuka and Jensen 2009)
+/// 描画パス毎に可視点を求めてフォトンを集め、画素毎の半径を徐々に小さくする
+/// 蛍光による波長の移動(紫外 -> 可視)を光源側から追跡するので、カメラ側から届きにくい蛍光も推定できる
+class photon_mapper {
+  using traits = integrator_traits<spectral_material>;
+
+  /// 画素の可視点
+  struct visible_point {
+    bool valid{false};
+    ray r_in;
+    hit_record<spectral_material> rec;
+  };
+
+ public:
+  photon_mapper(unsigned int w, unsigned int h) : width(w), height(h) {}
+
+  /// spectral_render と同じ形式でfbへ描画(sppは描画パス数)
+  void render(frame_buffer &fb, int spp, const hittable_list<spectral_material> &world,
+              shared_ptr<hittable_list<spectral_material>> &lights,
+              const std::vector<int> *spp_map = nullptr) {
+    const size_t n = size_t(width) * height;
+    int max_ns = spp;
+    if (spp_map != nullptr) {
+      max_ns = *std::max_element(spp_map->begin(), spp_map->end());
+    }
+    std::vector<visible_point> points(n);
+    std::vector<color> emitted(n, ZERO);
+    std::vector<double> lum(n, 0.0), lum_sq(n, 0.0);
+    std::vector<aov_record> aov_sum(n);
+    // SPPMの画素毎の状態
+    std::vector<double> radius2(n, PHOTON_INITIAL_RADIUS * PHOTON_INITIAL_RADIUS);
+    std::vector<double> photon_count(n, 0.0);
+    std::vector<color> flux(n, ZERO);
+
+    aabb box;
+    world.bounding_box(0, 1, box);
+    point3 center = 0.5 * (box.min() + box.max());
+
+    const uint32_t pass = next_sampler_pass();
+    for (int s = 0; s < max_ns; ++s) {
+      /// 可視点
+      #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+      for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+          size_t p = fb.index(i, j);
+          auto &vp = points[p];
+          vp = visible_point();
+          if (!active(p, s, spp, spp_map)) continue;
+          seed_random(pass, uint32_t(p), s, 0);
+          double u = double(i + random_double()) / double(width);
+          double v = double(j + random_double()) / double(height);
+          vp.r_in = SCENE_CAMERA.get_ray(u, v);
+          if (!world.hit(vp.r_in, 0.001, INF, vp.rec)) continue;
+          const auto &rec = vp.rec;
+          spectral_scattered_record s_rec;
+          vp.valid = rec.mat_ptr->scatter(vp.r_in, rec, s_rec);
+          color le = spectralToRgb(rec.mat_ptr->emitted(vp.r_in, rec, rec.u, rec.v, rec.p));
+          emitted[p] += le;
+
+          aov_record aov;
+          aov.albedo = vp.valid ? spectralToRgb(s_rec.attenuation) : le;
+          aov.normal = rec.normal;
+          aov.depth = rec.t * vp.r_in.direction().length();
+          accumulate_aov(aov_sum[p], aov);
+          if (!vp.valid) {
+            lum[p] += luminance(le);
+            lum_sq[p] += luminance(le) * luminance(le);
+          }
+        }
+      }
+
+      /// フォトンの追跡と格子の構築
+      std::vector<photon> photons;
+      trace_photons(world, *lights, center, std::max(1, int(PHOTONS_PER_PIXEL * n)), pass, s, photons);
+      photon_grid grid;
+      grid.build(photons, 2.0 * PHOTON_INITIAL_RADIUS);
+
+      /// フォトンの収集と半径の更新
+      #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+      for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+          size_t p = fb.index(i, j);
+          const auto &vp = points[p];
+          if (!vp.valid) continue;
+          const auto &rec = vp.rec;
+          spectral_distribution incoming = zero_spectra;
+          double found = 0.0;
+          grid.query(rec.p, sqrt(radius2[p]), [&](const photon &ph) {
+            if (dot(ph.normal, rec.normal) < PHOTON_NORMAL_THRESHOLD) return;
+            incoming.set_intensity(ph.wavelength, incoming.get_intensity(ph.wavelength) + ph.power);
+            found += 1.0;
+          });
+          spectral_scattered_record s_rec;
+          rec.mat_ptr->scatter(vp.r_in, rec, s_rec);
+          // 拡散面のBRDF(1 / π)で反射・蛍光させた放射束
+          color phi = spectralToRgb(traits::reflect(s_rec, M_1_PI, incoming));
+
+          // このパスだけの推定値(分散の推定用)
+          double instant = luminance(phi) / (M_PI * radius2[p]);
+          lum[p] += instant;
+          lum_sq[p] += instant * instant;
+
+          if (found > 0.0) {
+            double n_new = photon_count[p] + PHOTON_ALPHA * found;
+            double ratio = n_new / (photon_count[p] + found);
+            flux[p] = (flux[p] + phi) * ratio;
+            radius2[p] *= ratio;
+            photon_count[p] = n_new;
+          }
+        }
+      }
+    }
+
+    for (int j = 0; j < height; ++j) {
+      for (int i = 0; i < width; ++i) {
+        size_t p = fb.index(i, j);
+        int ns = spp_map != nullptr ? (*spp_map)[p] : spp;
+        if (ns <= 0) continue;
+        // 放射束はパス毎のフォトン数で正規化済み
+        color L = flux[p] / (ns * M_PI * radius2[p]) + emitted[p] / ns;
+        fb.set_pixel(i, j, ns, L * ns, lum[p], lum_sq[p], aov_sum[p]);
+      }
+    }
+  }
+
+ private:
+  static bool active(size_t p, int s, int spp, const std::vector<int> *spp_map) {
+    return s < (spp_map != nullptr ? (*spp_map)[p] : spp);
+  }
+
+  /// 光源からn_photons本のフォトンを追跡(PHOTON_CHUNK_SIZE本毎に貯めて最後に番号順に連結)
+  /// 連結の順序がスレッドのスケジュールに依らないので、グリッドの中の並びもスレッド数に依らない
+  /// フォトン毎の乱数は(pass, フォトン番号, 描画のサンプル番号s)で決める
+  static void trace_photons(const hittable_list<spectral_material> &world,
+                            const hittable_list<spectral_material> &lights,
+                            const point3 &center, int n_photons, uint32_t pass, int s, std::vector<photon> &out) {
+    const int n_chunks = (n_photons + PHOTON_CHUNK_SIZE - 1) / PHOTON_CHUNK_SIZE;
+    std::vector<std::vector<photon>> chunks(n_chunks);
+    const int n_lights = int(lights.objects.size());
+    if (n_lights == 0) {
+      return;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+    for (int c = 0; c < n_chunks; ++c) {
+      auto &store = chunks[c];
+      const int k_end = std::min(n_photons, (c + 1) * PHOTON_CHUNK_SIZE);
+      for (int k = c * PHOTON_CHUNK_SIZE; k < k_end; ++k) {
+        seed_random(pass, uint32_t(k), s, 1);
+
+        /// 光源上の点: 発光はサンプリング用の光源のマテリアルから求める
+        hit_record<spectral_material> lrec;
+        double pdf_w;
+        if (!lights.sample_light(center, lrec, pdf_w) || !lrec.mat_ptr) continue;
+        vec3 to_light = lrec.p - center;
+        ray probe(center, to_light);
+        auto le = lrec.mat_ptr->emitted(probe, lrec, lrec.u, lrec.v, lrec.p);
+        double le_sum = le.sum();
+        double cos_l = fabs(dot(lrec.normal, unit_vector(to_light)));
+        if (le_sum <= 0.0 || cos_l <= 0.0) continue;
+        double area_pdf = pdf_w * cos_l / (lrec.p - center).squared_length();
+
+        /// 波長は発光スペクトルに比例して選ぶ
+        int wavelength = sample_index(le, le_sum);
+        // Le(λ) cos / (p(λ) p_A cos / π) / N
+        double power = le_sum * M_PI / (area_pdf * n_photons);
+
+        onb uvw;
+        uvw.build_from_w(lrec.normal);
+        ray r(lrec.p, uvw.local(random_cosine_direction()), probe.time());
+        for (int depth = 0; depth < PHOTON_MAX_DEPTH; ++depth) {
+          hit_record<spectral_material> rec;
+          if (!world.hit(r, 0.001, INF, rec)) break;
+          spectral_scattered_record s_rec;
+          if (!rec.mat_ptr->scatter(r, rec, s_rec)) break;
+          store.push_back(photon{rec.p, rec.normal, wavelength, power});
+
+          /// ロシアンルーレットで反射・蛍光・吸収を選ぶ
+          double reflect = s_rec.attenuation.get_intensity(wavelength);
+          double fluor = 0.0, emission_sum = 0.0;
+          if (s_rec.is_fluor) {
+            emission_sum = s_rec.emission.sum();
+            fluor = s_rec.excitation.get_intensity(wavelength) * inv_wave_pdf_val * emission_sum;
+          }
+          double p_reflect = ffmin(reflect, 1.0);
+          double p_fluor = ffmin(fluor, 1.0 - p_reflect);
+          double x = random_double();
+          if (x < p_reflect) {
+            power *= reflect / p_reflect;
+          } else if (x < p_reflect + p_fluor) {
+            // 波長の移動
+            wavelength = sample_index(s_rec.emission, emission_sum);
+            power *= fluor / p_fluor;
+          } else {
+            break;
+          }
+          onb n;
+          n.build_from_w(rec.normal);
+          r = ray(rec.p, n.local(random_cosine_direction()), r.time());
+        }
+      }
+    }
+
+    size_t total = 0;
+    for (const auto &l : chunks) total += l.size();
+    out.reserve(total);
+    for (const auto &l : chunks) out.insert(out.end(), l.begin(), l.end());
+  }
+
+  /// 分布に比例してインデックスを選ぶ
+  static int sample_index(const spectral_distribution &s, double sum) {
+    double x = random_double() * sum;
+    int last = int(s.size()) - 1;
+    for (int k = 0; k < last; ++k) {
+      x -= s.get_intensity(k);
+      if (x < 0.0) return k;
+    }
+    return last;
+  }
+
+ private:
+  unsigned int width;
+  unsigned int height;
+};
+
+#endif //FLUORSWITCH_SRC_RENDER_PHOTON_MAP_H_
@@ -0,0 +1,137 @@
+#ifndef FLUORSWITCH_SRC_RENDER_RADIANCE_CACHE_H_
+#define FLUORSWITCH_SRC_RENDER_RADIANCE_CACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "../utils/util_funcs.h"
+#include "../utils/radiance_traits.h"
+
+/// ワールド空間のハッシュグリッド放射輝度キャッシュ
+/// キーは量子化した位置と法線(主軸方向の6区分)
+/// パス自身が拡散面で求めた反射放射輝度を書き込み、全スレッドからロックフリーで更新する
+/// 描画中に読み書きするので、参照時に集まっているサンプルはスレッドのスケジュールに依る(スレッド数に依らず同じ画像が要るときはUSE_RADIANCE_CACHEを0にする)
+template<typename T>
+class radiance_cache {
+ public:
+  explicit radiance_cache(size_t cap) : capacity(cap) {}
+
+  /// 全セルを空にする(シーンが変わるフレーム毎に呼ぶ)
+  void clear() {
+    const size_t ch = radiance_traits<T>::channels();
+    if (!keys) {
+      keys.reset(new std::atomic<uint64_t>[capacity]);
+      counts.reset(new std::atomic<uint32_t>[capacity]);
+      sums.reset(new std::atomic<double>[capacity * ch]);
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+      keys[i].store(0, std::memory_order_relaxed);
+      counts[i].store(0, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < capacity * ch; ++i) {
+      sums[i].store(0.0, std::memory_order_relaxed);
+    }
+  }
+
+  /// 十分なサンプルが集まったセルの平均放射輝度
+  /// セル境界のブロック状のアーティファクトを避けるため、位置を接平面内でジッターする
+  bool lookup(const point3 &p, const vec3 &n, T &value) const {
+    if (!keys) {
+      return false;
+    }
+    vec3 jitter(random_double() - 0.5, random_double() - 0.5, random_double() - 0.5);
+    point3 jittered = p + CACHE_CELL_SIZE * (jitter - dot(jitter, n) * n);
+    long slot = find(cell_key(jittered, n), false);
+    if (slot < 0) {
+      return false;
+    }
+    uint32_t count = counts[slot].load(std::memory_order_relaxed);
+    if (count < CACHE_MIN_SAMPLES) {
+      return false;
+    }
+    const size_t ch = radiance_traits<T>::channels();
+    value = radiance_traits<T>::zero();
+    for (size_t k = 0; k < ch; ++k) {
+      radiance_traits<T>::set(value, k, sums[slot * ch + k].load(std::memory_order_relaxed) / count);
+    }
+    return true;
+  }
+
+  /// 放射輝度の推定値を追加
+  void insert(const point3 &p, const vec3 &n, const T &value) {
+    if (!keys) {
+      return;
+    }
+    const size_t ch = radiance_traits<T>::channels();
+    for (size_t k = 0; k < ch; ++k) {
+      double v = radiance_traits<T>::get(value, k);
+      // NaN, INFを除外
+      if (!(fabs(v) < INF)) return;
+    }
+    long slot = find(cell_key(p, n), true);
+    if (slot < 0) {
+      return;
+    }
+    for (size_t k = 0; k < ch; ++k) {
+      atomic_add(sums[slot * ch + k], radiance_traits<T>::get(value, k));
+    }
+    counts[slot].fetch_add(1, std::memory_order_relaxed);
+  }
+
+ private:
+  static uint64_t cell_key(const point3 &p, const vec3 &n) {
+    const uint64_t mask = (1ULL << 20) - 1;
+    const double inv_cell = 1.0 / CACHE_CELL_SIZE;
+    auto ix = uint64_t(int64_t(floor(p.x() * inv_cell)) + (1LL << 19)) & mask;
+    auto iy = uint64_t(int64_t(floor(p.y() * inv_cell)) + (1LL << 19)) & mask;
+    auto iz = uint64_t(int64_t(floor(p.z() * inv_cell)) + (1LL << 19)) & mask;
+    // 法線の主軸と符号
+    int axis = fabs(n.x()) > fabs(n.y()) ? (fabs(n.x()) > fabs(n.z()) ? 0 : 2) : (fabs(n.y()) > fabs(n.z()) ? 1 : 2);
+    uint64_t n_bin = axis * 2 + (n[axis] < 0 ? 1 : 0);
+    // 最上位ビットで空スロット(0)と区別
+    return (1ULL << 63) | (n_bin << 60) | (ix << 40) | (iy << 20) | iz;
+  }
+
+  static uint64_t hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  /// 線形探索でスロットを探す(insertの場合は空スロットをCASで確保)
+  long find(uint64_t key, bool insert) const {
+    const uint64_t mask = capacity - 1;
+    uint64_t h = hash(key);
+    for (int probe = 0; probe < CACHE_MAX_PROBE; ++probe) {
+      size_t slot = (h + probe) & mask;
+      uint64_t stored = keys[slot].load(std::memory_order_acquire);
+      if (stored == key) {
+        return long(slot);
+      }
+      if (stored == 0) {
+        if (!insert) {
+          return -1;
+        }
+        uint64_t expected = 0;
+        if (keys[slot].compare_exchange_strong(expected, key, std::memory_order_acq_rel) || expected == key) {
+          return long(slot);
+        }
+      }
+    }
+    return -1;
+  }
+
+ private:
+  size_t capacity;
+  std::unique_ptr<std::atomic<uint64_t>[]> keys;
+  std::unique_ptr<std::atomic<uint32_t>[]> counts;
+  std::unique_ptr<std::atomic<double>[]> sums;
+};
+
+radiance_cache<color> RGB_RADIANCE_CACHE(CACHE_RGB_CAPACITY);
+radiance_cache<spectral_distribution> SPECTRAL_RADIANCE_CACHE(CACHE_SPECTRAL_CAPACITY);
+
+#endif //FLUORSWITCH_SRC_RENDER_RADIANCE_CACHE_H_
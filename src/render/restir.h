@@ -0,0 +1,382 @@
+#ifndef FLUORSWITCH_SRC_RENDER_RESTIR_H_
+#define FLUORSWITCH_SRC_RENDER_RESTIR_H_
+
+#include <algorithm>
+#include <vector>
+#include "../camera/camera.h"
+#include "../utils/hittable.h"
+#include "../utils/hittable_list.h"
+#include "../sampling/sampler.h"
+#include "frame_buffer.h"
+#include "integrator_traits.h"
+
+/// 光源上の点と、サンプリングした時の光源の属性(発光の評価に使い、光源へ交差判定をし直さない)
+template<typename mat>
+struct light_sample {
+  point3 p{ZERO_VEC3};
+  // サンプリングした点から見た法線と表裏
+  vec3 n{ZERO_VEC3};
+  bool front_face{true};
+  double u{0.0};
+  double v{0.0};
+  // 光源のマテリアル(前フレームから引き継いだ点はそのフレームの光源のリストで求め直す)
+  const mat *mat_ptr{nullptr};
+  // 放射輝度の輝度(目標関数に使う、前フレームから引き継いだ点はそのフレームの光源で評価し直す)
+  double le{1.0};
+  bool valid{false};
+
+  void set(const hit_record<mat> &lrec) {
+    p = lrec.p;
+    n = lrec.normal;
+    front_face = lrec.front_face;
+    u = lrec.u;
+    v = lrec.v;
+    mat_ptr = lrec.mat_ptr.get();
+  }
+
+  /// 点oから見た発光(oが法線の反対側なら表裏を入れ替える)
+  typename integrator_traits<mat>::radiance emitted(const point3 &o) const {
+    hit_record<mat> lrec;
+    bool same_side = dot(o - p, n) >= 0.0;
+    lrec.t = 1;
+    lrec.p = p;
+    lrec.normal = same_side ? n : -n;
+    lrec.front_face = same_side == front_face;
+    lrec.u = u;
+    lrec.v = v;
+    return mat_ptr->emitted(ray(o, p - o), lrec, u, v, p);
+  }
+};
+
+/// 重み付きリザーバーサンプリング
+/// W: 選ばれたサンプルの重み(1 / pdf の推定値)
+template<typename mat>
+struct reservoir {
+  light_sample<mat> y;
+  double w_sum{0.0};
+  double M{0.0};
+  double W{0.0};
+
+  bool update(const light_sample<mat> &x, double w, double count = 1.0) {
+    w_sum += w;
+    M += count;
+    if (w > 0.0 && random_double() * w_sum < w) {
+      y = x;
+      return true;
+    }
+    return false;
+  }
+};
+
+/// 最初の交差点(近傍画素から目標関数を評価するために保持)
+template<typename mat>
+struct restir_surface {
+  bool hit{false};
+  bool scatters{false};
+  ray r_in{ZERO_VEC3, ZERO_VEC3};
+  hit_record<mat> rec{0.0, ZERO_VEC3, ZERO_VEC3};
+  double depth{0.0};
+};
+
+/// 光源をひとつ選び、その上の点を面積測度のpdfと共にサンプリング
+template<typename mat>
+bool sample_light(const hittable_list<mat> &lights, const point3 &o, light_sample<mat> &y, double &area_pdf) {
+  hit_record<mat> lrec;
+  double pdf_w;
+  if (!lights.sample_light(o, lrec, pdf_w)) {
+    return false;
+  }
+  vec3 d = lrec.p - o;
+  double dist2 = d.squared_length();
+  double cos_y = fabs(dot(lrec.normal, unit_vector(d)));
+  if (cos_y <= 0.0) {
+    return false;
+  }
+  y.set(lrec);
+  y.le = y.mat_ptr ? luminance(integrator_traits<mat>::to_rgb(y.emitted(o))) : 1.0;
+  y.valid = true;
+  // 立体角測度 -> 面積測度
+  area_pdf = pdf_w * cos_y / dist2;
+  return true;
+}
+
+/// 前フレームから引き継いだ光源上の点の属性を、このフレームの光源のリストで求め直す(交差判定はしない)
+template<typename mat>
+bool refresh_light_sample(const hittable_list<mat> &lights, const point3 &o, light_sample<mat> &y) {
+  hit_record<mat> lrec;
+  lrec.p = y.p;
+  if (!lights.light_record(o, lrec) || !lrec.mat_ptr) {
+    return false;
+  }
+  y.set(lrec);
+  y.le = luminance(integrator_traits<mat>::to_rgb(y.emitted(o)));
+  return true;
+}
+
+/// 目標関数: BSDFのcos項 x 幾何項 x 光源の輝度(放射輝度そのものは可視性と共にシャドウレイで取得する)
+template<typename mat>
+double target_pdf(const restir_surface<mat> &s, const light_sample<mat> &y) {
+  if (!s.scatters || !y.valid) {
+    return 0.0;
+  }
+  vec3 d = y.p - s.rec.p;
+  double dist2 = d.squared_length();
+  if (dist2 <= 0.0) {
+    return 0.0;
+  }
+  vec3 wi = d / sqrt(dist2);
+  double cos_y = fabs(dot(y.n, wi));
+  double f = s.rec.mat_ptr->scattering_pdf(s.r_in, s.rec, ray(s.rec.p, wi, s.r_in.time()));
+  return f * cos_y / dist2 * y.le;
+}
+
+/// 近傍画素のリザーバーを再利用してよいか(法線と深度が近い)
+template<typename mat>
+inline bool similar_surface(const restir_surface<mat> &a, const restir_surface<mat> &b) {
+  return a.scatters && b.scatters
+      && dot(a.rec.normal, b.rec.normal) >= RESTIR_NORMAL_THRESHOLD
+      && fabs(a.depth - b.depth) <= RESTIR_DEPTH_THRESHOLD * b.depth;
+}
+
+/// ReSTIR DI (Bitterli et al. 2020)
+/// 最初の交差点の直接光を、光源候補のリサンプリングと時間・空間方向のリザーバー再利用で求める
+/// シャドウレイは光源数に依らず1サンプル当たり1本
+/// 2回目以降の反射は既存のパストレーサー(光源とBSDFの混合)に任せる
+template<typename mat>
+class restir_di {
+  using traits = integrator_traits<mat>;
+  using radiance = typename traits::radiance;
+
+ public:
+  restir_di(unsigned int w, unsigned int h)
+      : width(w), height(h),
+        surfaces(size_t(w) * h), prev_surfaces(size_t(w) * h),
+        candidates(size_t(w) * h), reservoirs(size_t(w) * h), history(size_t(w) * h) {}
+
+  /// rgb_render / spectral_render と同じ形式でfbへ描画
+  void render(frame_buffer &fb, int spp, const hittable_list<mat> &world, shared_ptr<hittable_list<mat>> &lights,
+              const std::vector<int> *spp_map = nullptr) {
+    const size_t n = size_t(width) * height;
+    int max_ns = spp;
+    if (spp_map != nullptr) {
+      max_ns = *std::max_element(spp_map->begin(), spp_map->end());
+    }
+    std::vector<color> col(n, ZERO);
+    std::vector<double> lum(n, 0.0), lum_sq(n, 0.0);
+    std::vector<aov_record> aov_sum(n);
+
+    // 前フレームのリザーバーの光源上の点は、このフレームの光源の強度で目標関数を評価し直す
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+    for (int j = 0; j < int(height); ++j) {
+      for (int i = 0; i < int(width); ++i) {
+        size_t p = fb.index(i, j);
+        light_sample<mat> &y = history[p].y;
+        if (history[p].M <= 0.0 || !y.valid) continue;
+        y.valid = refresh_light_sample(*lights, prev_surfaces[p].rec.p, y);
+      }
+    }
+
+    // サンプラーはカメラの次元と、シェーディングでの反射(間接光)の次元に使う(光源の候補は独立な乱数)
+    const uint32_t pass = next_sampler_pass();
+    // サンプル番号毎に全画素のリザーバーを更新する(空間方向の再利用のため)
+    for (int s = 0; s < max_ns; ++s) {
+      /// 最初の交差点・初期候補・時間方向の再利用
+      #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+      for (int j = 0; j < int(height); ++j) {
+        pixel_sampler sampler(pass);
+        current_random_stream() = &sampler;
+        for (int i = 0; i < int(width); ++i) {
+          size_t p = fb.index(i, j);
+          auto &surf = surfaces[p];
+          candidates[p] = reservoir<mat>();
+          if (!active(p, s, spp, spp_map)) {
+            surf = restir_surface<mat>();
+            continue;
+          }
+          sampler.start_sample(i, j, s);
+          double u = double(i + random_double()) / double(width);
+          double v = double(j + random_double()) / double(height);
+          trace_primary(SCENE_CAMERA.get_ray(u, v), world, surf, aov_sum[p]);
+          // カメラのブロックの残りは使わない
+          sampler.begin_bounce(SAMPLER_MAX_BOUNCE);
+          if (!surf.scatters) continue;
+
+          reservoir<mat> r;
+          for (int k = 0; k < RESTIR_CANDIDATES; ++k) {
+            light_sample<mat> y;
+            double area_pdf = 0.0;
+            double w = sample_light(*lights, surf.rec.p, y, area_pdf) ? target_pdf(surf, y) / area_pdf : 0.0;
+            r.update(y, w);
+          }
+          finalize(r, target_pdf(surf, r.y), r.M);
+
+          // 前のサンプル(前フレームを含む)のリザーバー
+          reservoir<mat> &prev = history[p];
+          if (prev.M > 0.0 && similar_surface(surf, prev_surfaces[p])) {
+            reservoir<mat> t;
+            t.update(r.y, target_pdf(surf, r.y) * r.W * r.M, r.M);
+            double prev_M = std::min(prev.M, double(RESTIR_TEMPORAL_M_CAP * RESTIR_CANDIDATES));
+            t.update(prev.y, target_pdf(surf, prev.y) * prev.W * prev_M, prev_M);
+            finalize(t, target_pdf(surf, t.y), t.M);
+            r = t;
+          }
+          candidates[p] = r;
+        }
+        current_random_stream() = nullptr;
+      }
+
+      /// 空間方向の再利用
+      #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+      for (int j = 0; j < int(height); ++j) {
+        for (int i = 0; i < int(width); ++i) {
+          size_t p = fb.index(i, j);
+          const auto &surf = surfaces[p];
+          if (!surf.scatters) {
+            reservoirs[p] = candidates[p];
+            continue;
+          }
+          size_t neighbors[RESTIR_SPATIAL_NEIGHBORS + 1];
+          int count = 0;
+          neighbors[count++] = p;
+          seed_random(pass, uint32_t(p), s, 1);
+          for (int k = 0; k < RESTIR_SPATIAL_NEIGHBORS; ++k) {
+            double radius = RESTIR_SPATIAL_RADIUS * sqrt(random_double());
+            double phi = 2 * M_PI * random_double();
+            int x = i + int(round(radius * cos(phi)));
+            int y = j + int(round(radius * sin(phi)));
+            if (x < 0 || int(width) <= x || y < 0 || int(height) <= y) continue;
+            size_t q = fb.index(x, y);
+            if (q == p || !similar_surface(surf, surfaces[q])) continue;
+            neighbors[count++] = q;
+          }
+
+          reservoir<mat> r;
+          for (int k = 0; k < count; ++k) {
+            const auto &c = candidates[neighbors[k]];
+            r.update(c.y, target_pdf(surf, c.y) * c.W * c.M, c.M);
+          }
+          // 選ばれたサンプルを生成し得た候補数で正規化(面の向きによる偏りを防ぐ)
+          double z = 0.0;
+          for (int k = 0; k < count; ++k) {
+            if (target_pdf(surfaces[neighbors[k]], r.y) > 0.0) {
+              z += candidates[neighbors[k]].M;
+            }
+          }
+          finalize(r, target_pdf(surf, r.y), z);
+          reservoirs[p] = r;
+        }
+      }
+
+      /// シェーディング
+      #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+      for (int j = 0; j < int(height); ++j) {
+        pixel_sampler sampler(pass);
+        current_random_stream() = &sampler;
+        for (int i = 0; i < int(width); ++i) {
+          size_t p = fb.index(i, j);
+          if (!active(p, s, spp, spp_map)) continue;
+          sampler.start_sample(i, j, s, 2);
+          sampler.begin_bounce(0);
+          color c = traits::to_rgb(shade(surfaces[p], reservoirs[p], world, lights));
+          col[p] += c;
+          lum[p] += luminance(c);
+          lum_sq[p] += luminance(c) * luminance(c);
+          // 次のサンプルへ引き継ぐ
+          history[p] = reservoirs[p];
+          prev_surfaces[p] = surfaces[p];
+        }
+        current_random_stream() = nullptr;
+      }
+    }
+
+    for (int j = 0; j < int(height); ++j) {
+      for (int i = 0; i < int(width); ++i) {
+        size_t p = fb.index(i, j);
+        int ns = spp_map != nullptr ? (*spp_map)[p] : spp;
+        if (ns <= 0) continue;
+        fb.set_pixel(i, j, ns, col[p], lum[p], lum_sq[p], aov_sum[p]);
+      }
+    }
+  }
+
+ private:
+  static bool active(size_t p, int s, int spp, const std::vector<int> *spp_map) {
+    return s < (spp_map != nullptr ? (*spp_map)[p] : spp);
+  }
+
+  static void finalize(reservoir<mat> &r, double p_hat, double z) {
+    r.W = (p_hat > 0.0 && z > 0.0) ? r.w_sum / (z * p_hat) : 0.0;
+  }
+
+  static void trace_primary(const ray &r, const hittable_list<mat> &world, restir_surface<mat> &surf, aov_record &aov_sum) {
+    surf = restir_surface<mat>();
+    surf.r_in = r;
+    if (!world.hit(r, 0.001, INF, surf.rec)) {
+      return;
+    }
+    surf.hit = true;
+    surf.depth = surf.rec.t * r.direction().length();
+    typename traits::scatter_record s_rec;
+    surf.scatters = surf.rec.mat_ptr->scatter(r, surf.rec, s_rec);
+
+    aov_record aov;
+    aov.albedo = surf.scatters ? traits::albedo(s_rec)
+                               : traits::to_rgb(surf.rec.mat_ptr->emitted(r, surf.rec, surf.rec.u, surf.rec.v, surf.rec.p));
+    aov.normal = surf.rec.normal;
+    aov.depth = surf.depth;
+    accumulate_aov(aov_sum, aov);
+  }
+
+  /// 直接光(リザーバーのサンプル) + 間接光(BSDFサンプリングで続くパス、次の交差点の発光は数えない)
+  static radiance shade(const restir_surface<mat> &surf, const reservoir<mat> &r,
+                        const hittable_list<mat> &world, shared_ptr<hittable_list<mat>> &lights) {
+    if (!surf.hit) {
+      return traits::zero();
+    }
+    const auto &rec = surf.rec;
+    radiance L = rec.mat_ptr->emitted(surf.r_in, rec, rec.u, rec.v, rec.p);
+    if (!surf.scatters) {
+      return L;
+    }
+    typename traits::scatter_record s_rec;
+    rec.mat_ptr->scatter(surf.r_in, rec, s_rec);
+
+    /// 直接光: 光源上の点までシャドウレイを飛ばし、遮られなければ放射輝度を得る
+    if (r.y.valid && r.y.mat_ptr && r.W > 0.0) {
+      ray shadow(rec.p, r.y.p - rec.p, surf.r_in.time());
+      // 方向ベクトルは光源上の点までなので t = 1 で光源に当たる
+      // 手前の遮蔽は属性を求めない判定で調べ、発光はサンプリングした時の光源の属性から求める
+      if (!world.occluded(shadow, 0.001, 1.0 - 1e-3)) {
+        radiance Le = r.y.emitted(rec.p);
+        vec3 wi = unit_vector(shadow.direction());
+        double dist2 = shadow.direction().squared_length();
+        double cos_y = fabs(dot(r.y.n, wi));
+        double f = rec.mat_ptr->scattering_pdf(surf.r_in, rec, ray(rec.p, wi, surf.r_in.time()));
+        L = L + traits::reflect(s_rec, f, Le) * (cos_y / dist2 * r.W);
+      }
+    }
+
+    /// 間接光
+    ray scattered(rec.p, s_rec.pdf_ptr->generate(), surf.r_in.time());
+    double pdf_val = s_rec.pdf_ptr->value(scattered.direction());
+    if (pdf_val > 0.0) {
+      auto ray_c = traits::trace(scattered, world, lights, traits::max_depth - 1, false);
+      double f = rec.mat_ptr->scattering_pdf(surf.r_in, rec, scattered);
+      L = L + traits::reflect(s_rec, f, ray_c) * (1.0 / pdf_val);
+    }
+    return L;
+  }
+
+ private:
+  unsigned int width;
+  unsigned int height;
+  std::vector<restir_surface<mat>> surfaces;
+  std::vector<restir_surface<mat>> prev_surfaces;
+  // 初期候補 + 時間方向の再利用
+  std::vector<reservoir<mat>> candidates;
+  // 空間方向の再利用後
+  std::vector<reservoir<mat>> reservoirs;
+  std::vector<reservoir<mat>> history;
+};
+
+#endif //FLUORSWITCH_SRC_RENDER_RESTIR_H_
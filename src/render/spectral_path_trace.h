@@ -7,73 +7,302 @@
 #include "../utils/hittable_list.h"
 #include "../utils/util_funcs.h"
 #include "../material/spectral_material.h"
+#include "frame_buffer.h"
+#include "film.h"
+#include "camera_packet.h"
+#include "radiance_cache.h"
+#include "adrrs.h"
+#include "../sampling/sd_tree.h"
+#include "../sampling/sampler.h"
+
+spectral_distribution inline spectral_path_trace_surface(const ray &r,
+                                                         hit_record<spectral_material> &rec,
+                                                         const hittable<spectral_material> &world,
+                                                         shared_ptr<hittable_list<spectral_material>> &lights,
+                                                         int depth,
+                                                         aov_record *aov,
+                                                         bool count_emitted,
+                                                         rrs_context *rrs);
 
 spectral_distribution inline spectral_path_trace(const ray &r,
                                                  const hittable<spectral_material> &world,
                                                  shared_ptr<hittable_list<spectral_material>> &lights,
-                                                 int depth) {
+                                                 int depth,
+                                                 aov_record *aov = nullptr,
+                                                 bool count_emitted = true,
+                                                 rrs_context *rrs = nullptr) {
   hit_record<spectral_material> rec;
+  if (rrs != nullptr) ++*rrs->rays;
 
   /// レイの最大反射後
   if (depth <= 0) {
     return zero_spectra;
   }
+  // この反射で使う乱数の次元
+  begin_bounce(SPECTRAL_MAX_RAY_DEPTH - depth);
 
   /// 背景色
   if (!world.hit(r, 0.001, INF, rec)) {
     return zero_spectra;
   }
+  return spectral_path_trace_surface(r, rec, world, lights, depth, aov, count_emitted, rrs);
+}
+
+/// 最初の交差(rec、当たらなければnullptr)が分かっているカメラレイから始める
+spectral_distribution inline spectral_path_trace_primary(const ray &r,
+                                                         hit_record<spectral_material> *rec,
+                                                         const hittable<spectral_material> &world,
+                                                         shared_ptr<hittable_list<spectral_material>> &lights,
+                                                         aov_record *aov,
+                                                         rrs_context *rrs) {
+  if (rrs != nullptr) ++*rrs->rays;
+  begin_bounce(0);
+  if (rec == nullptr) {
+    return zero_spectra;
+  }
+  return spectral_path_trace_surface(r, *rec, world, lights, SPECTRAL_MAX_RAY_DEPTH, aov, true, rrs);
+}
+
+/// 交差(rec、当たらなければnullptr)を求め済みの反射レイから続ける
+spectral_distribution inline spectral_path_trace_next(const ray &r,
+                                                      hit_record<spectral_material> *rec,
+                                                      const hittable<spectral_material> &world,
+                                                      shared_ptr<hittable_list<spectral_material>> &lights,
+                                                      int depth,
+                                                      rrs_context *rrs) {
+  if (rrs != nullptr) ++*rrs->rays;
+  if (depth <= 0) {
+    return zero_spectra;
+  }
+  begin_bounce(SPECTRAL_MAX_RAY_DEPTH - depth);
+  if (rec == nullptr) {
+    return zero_spectra;
+  }
+  return spectral_path_trace_surface(r, *rec, world, lights, depth, nullptr, true, rrs);
+}
 
+/// 交差点recからの放射輝度(発光 + 反射)
+spectral_distribution inline spectral_path_trace_surface(const ray &r,
+                                                         hit_record<spectral_material> &rec,
+                                                         const hittable<spectral_material> &world,
+                                                         shared_ptr<hittable_list<spectral_material>> &lights,
+                                                         int depth,
+                                                         aov_record *aov,
+                                                         bool count_emitted,
+                                                         rrs_context *rrs) {
   /// レイの反射
   spectral_scattered_record s_s_rec;
-  spectral_distribution emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+  // 直接光を別途計算している場合は発光を数えない
+  spectral_distribution emitted = count_emitted ? rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p) : zero_spectra;
+
+  bool scattered_ray = rec.mat_ptr->scatter(r, rec, s_s_rec);
+
+  /// 最初の交差点の特徴量
+  if (aov != nullptr) {
+    aov->albedo = spectralToRgb(scattered_ray ? s_s_rec.attenuation : emitted);
+    aov->normal = rec.normal;
+    aov->depth = rec.t * r.direction().length();
+  }
 
   /// 光源にヒットした場合
-  if (!rec.mat_ptr->scatter(r, rec, s_s_rec))
+  if (!scattered_ray)
     return emitted;
 
-  auto light_pdf = make_shared<hittable_pdf<spectral_material>>(lights, rec.p);
-  mixture_pdf mixture_pdf(light_pdf, s_s_rec.pdf_ptr);
+#if USE_RADIANCE_CACHE
+  /// 拡散面(蛍光面を含む)ではキャッシュ済みの放射輝度でパスを打ち切る
+  bool cacheable = !s_s_rec.is_specular && SPECTRAL_MAX_RAY_DEPTH - depth >= CACHE_MIN_BOUNCE;
+  spectral_distribution cached;
+  if (cacheable && SPECTRAL_RADIANCE_CACHE.lookup(rec.p, rec.normal, cached)) {
+    return emitted + cached;
+  }
+#endif
 
-  ray scattered = ray(rec.p, mixture_pdf.generate(), r.time());
-  auto inv_pdf_val = 1 / mixture_pdf.value(scattered.direction());
+  auto bsdf_pdf = s_s_rec.pdf_ptr;
+#if USE_PATH_GUIDING
+  /// 学習済みの入射放射輝度の分布とBSDFを混合
+  dtree *guide = SPECTRAL_PATH_GUIDE.guide(rec.p);
+  if (guide != nullptr) {
+    bsdf_pdf = make_shared<mixture_pdf>(make_shared<guided_pdf>(guide), s_s_rec.pdf_ptr, guide->selection_probability());
+  }
+#endif
 
-  auto ray_c = spectral_path_trace(scattered, world, lights, depth - 1);
-  /// TODO: 波長に対しての係数は必要???
-  auto reflectance_spectra = s_s_rec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scattered) * ray_c * inv_pdf_val;
+  /// 分岐数(0ならロシアンルーレットで打ち切り)
+  int branches = 1;
+  double branch_weight = 1.0;
+  int bounce = SPECTRAL_MAX_RAY_DEPTH - depth;
+  if (rrs != nullptr) {
+    double n = SPECTRAL_RRS.factor(*rrs, bounce);
+    branches = int(n + random_double());
+    branch_weight = 1.0 / n;
+    SPECTRAL_RRS.record_decision(rrs->region, bounce, n, branches);
+  }
+
+  spectral_distribution reflectance_spectra{s_s_rec.attenuation, 0.0};
+  for (int b = 0; b < branches; ++b) {
+    /// 光源とBSDFを半々で選ぶ混合サンプリング(光源へは交差判定をせず、light_pdfで混合pdfを求める)
+    // 光源側はsample_lightの点とpdfを使い、その点より手前で遮られた場合は数えない(その方向はBSDF側だけが受け持つ)
+    // BSDF側は次の交差点が光源上にあればそのlight_pdfを使う
+    bool from_light = random_double() < 0.5;
+    hit_record<spectral_material> lrec;
+    double light_pdf_w = 0.0;
+    if (from_light && !lights->sample_light(rec.p, lrec, light_pdf_w)) {
+      if (rrs != nullptr) {
+        SPECTRAL_RRS.record_vertex(rrs->region, bounce, 0.0, 0.0);
+      }
+      continue;
+    }
+    ray scattered = ray(rec.p, from_light ? lrec.p - rec.p : bsdf_pdf->generate(), r.time());
+    hit_record<spectral_material> next;
+    bool next_hit = depth > 1 && world.hit(scattered, 0.001, INF, next);
+    bool visible = !from_light || (next_hit && next.t > 1.0 - 1e-4);
+    if (!from_light && next_hit) {
+      light_pdf_w = lights->light_pdf(rec.p, next);
+    }
+    auto inv_pdf_val = 1 / (0.5 * light_pdf_w + 0.5 * bsdf_pdf->value(scattered.direction()));
+    auto sp = rec.mat_ptr->scattering_pdf(r, rec, scattered);
 
-  /// 蛍光の場合
-  if (s_s_rec.is_fluor) {
-    auto K = s_s_rec.excitation * ray_c;
-    return emitted + reflectance_spectra + s_s_rec.emission * K.sum() * inv_wave_pdf_val;
+    rrs_context child;
+    long rays_start = 0;
+    if (rrs != nullptr) {
+      child = *rrs;
+      child.throughput *= s_s_rec.attenuation.sum() / s_s_rec.attenuation.size() * sp * inv_pdf_val * branch_weight;
+      child.split *= ffmax(1.0 / branch_weight, 1.0);
+      rays_start = *rrs->rays;
+    }
+    // 蛍光項はサンプリングした方向の分布で重み付けされるので、遮られた光源側のサンプルも辿る(反射項には数えない)
+    auto ray_c = visible || s_s_rec.is_fluor
+                 ? spectral_path_trace_next(scattered, next_hit ? &next : nullptr, world, lights, depth - 1,
+                                            rrs != nullptr ? &child : nullptr)
+                 : zero_spectra;
+#if USE_PATH_GUIDING
+    // 直接光は光源サンプリングに任せ、間接光だけを学習する
+    // 紫外域も含めた全波長のエネルギーを使う(蛍光の励起光を導くため)
+    if (light_pdf_w <= 0.0) {
+      SPECTRAL_PATH_GUIDE.record(rec.p, scattered.direction(), ray_c.sum() * inv_pdf_val);
+    }
+#endif
+    /// TODO: 波長に対しての係数は必要???
+    auto branch = visible ? s_s_rec.attenuation * sp * ray_c * inv_pdf_val : zero_spectra;
+
+    /// 蛍光の場合
+    if (s_s_rec.is_fluor) {
+      auto K = s_s_rec.excitation * ray_c;
+#if USE_PATH_GUIDING
+      // 蛍光項はサンプリングpdfで重み付けされるため、ガイド無しの混合pdfとの比で期待値を揃える
+      double guide_weight = 0.5 * (light_pdf_w + s_s_rec.pdf_ptr->value(scattered.direction())) * inv_pdf_val;
+      K = K * guide_weight;
+#endif
+      branch = branch + s_s_rec.emission * K.sum() * inv_wave_pdf_val;
+    }
+#if USE_PATH_GUIDING
+    if (guide != nullptr) {
+      double dpdf = 0.5 * (guide->pdf(scattered.direction()) - s_s_rec.pdf_ptr->value(scattered.direction()));
+      guide->record_selection(branch.sum(), 1 / inv_pdf_val, dpdf);
+    }
+#endif
+    if (rrs != nullptr) {
+      SPECTRAL_RRS.record_vertex(rrs->region, bounce, luminance(spectralToRgb(branch)), double(*rrs->rays - rays_start));
+    }
+    reflectance_spectra = reflectance_spectra + branch;
+  }
+  reflectance_spectra = reflectance_spectra * branch_weight;
+
+#if USE_RADIANCE_CACHE
+  if (cacheable) {
+    SPECTRAL_RADIANCE_CACHE.insert(rec.p, rec.normal, reflectance_spectra);
   }
+#endif
 
   /// 再起処理
   return emitted + reflectance_spectra;
 }
 
-void inline spectral_render(unsigned char *data, unsigned int nx, unsigned int ny, int ns,
+void inline spectral_render(frame_buffer &fb, int spp,
                             std::vector<size_t> sample_wavelengths,
                             hittable_list<spectral_material> world, shared_ptr<hittable_list<spectral_material>> &lights,
-                            int frame = 1) {
-  spectral_distribution spectra{zero_spectra, sample_wavelengths};
-  spectral_distribution zero{spectra};
-  #pragma omp parallel for private(spectra) schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
-  for (int j = 0; j < ny; ++j) {
-    for (int i = 0; i < nx; ++i) {
-      spectra = zero;
-      for (int s = 0; s < ns; ++s) {
-        double u = double(i + drand48()) / double(nx);
-        double v = double(j + drand48()) / double(ny);
-        ray r = SCENE_CAMERA.get_ray(u, v);
-        spectra = spectra + spectral_path_trace(r, world, lights, SPECTRAL_MAX_RAY_DEPTH);
-      }
+                            int frame = 1,
+                            const std::vector<int> *spp_map = nullptr) {
+  unsigned int nx = fb.width;
+  unsigned int ny = fb.height;
+#if USE_ADRRS
+  SPECTRAL_RRS.prepare(nx, ny, SPECTRAL_MAX_RAY_DEPTH);
+#endif
+  const uint32_t pass = next_sampler_pass();
+  film image(nx, ny);
 
-      auto col = spectralToRgb(spectra / ns);
-      col = gamma_correct(col);
-      drawPix(data, nx, ny, i, j, col);
+  // RAY_PACKET_TILE_SIZE行を1タイルとして描画し、全タイルの描画後にタイルの順にまとめる
+  // タイルの中はRAY_PACKET_TILE_SIZE角毎にカメラレイを辿る(USE_RAY_PACKETSなら束にする)
+  const int ts = RAY_PACKET_TILE_SIZE;
+  const int bands = int(ny + ts - 1) / ts;
+  std::vector<film_tile> tiles(bands, film_tile(image));
+  #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+  for (int band = 0; band < bands; ++band) {
+    pixel_sampler sampler(pass);
+    current_random_stream() = &sampler;
+    const int j0 = band * ts, j1 = std::min(j0 + ts, int(ny));
+    film_tile &tile = tiles[band];
+    tile.reset(0, j0, nx, j1);
+    for (int i0 = 0; i0 < int(nx); i0 += ts) {
+      const int i1 = std::min(i0 + ts, int(nx));
+      // 画素毎の集計
+      struct pixel_sum {
+        color col{ZERO};
+        double lum{0.0}, lum_sq{0.0};
+        aov_record aov;
+        long rays{0};
+        rrs_context ctx;
+      };
+      std::vector<pixel_sum> sums(size_t(ts) * ts);
+      auto samples = [&](int i, int j) {
+        // 画素毎のサンプル数(0の画素は描画しない)
+        return spp_map != nullptr ? (*spp_map)[fb.index(i, j)] : spp;
+      };
+#if USE_ADRRS
+      for (int j = j0; j < j1; ++j) {
+        for (int i = i0; i < i1; ++i) {
+          auto &p = sums[(j - j0) * ts + (i - i0)];
+          p.ctx = rrs_context{SPECTRAL_RRS.region(i, j), SPECTRAL_RRS.pixel(i, j), 1.0, 1.0, &p.rays};
+        }
+      }
+#endif
+      trace_camera_tile<spectral_material>(sampler, world, nx, ny, i0, j0, i1, j1, samples,
+                                           [&](int i, int j, double x, double y, const ray &r,
+                                               hit_record<spectral_material> *rec) {
+        auto &p = sums[(j - j0) * ts + (i - i0)];
+        rrs_context *rrs = nullptr;
+#if USE_ADRRS
+        rrs = &p.ctx;
+#endif
+        aov_record aov;
+        auto sample = spectral_path_trace_primary(r, rec, world, lights, &aov, rrs);
+        // フィルタの重みは画素毎に異なるのでサンプル毎にRGBにする
+        color c = spectralToRgb(sample);
+        tile.add_sample(x, y, c);
+        p.col += c;
+        // 分散推定用の輝度
+        double l = luminance(c);
+        p.lum += l;
+        p.lum_sq += l * l;
+        accumulate_aov(p.aov, aov);
+      });
+      for (int j = j0; j < j1; ++j) {
+        for (int i = i0; i < i1; ++i) {
+          int ns = samples(i, j);
+          if (ns <= 0) continue;
+          auto &p = sums[(j - j0) * ts + (i - i0)];
+#if USE_ADRRS
+          SPECTRAL_RRS.record_pixel(p.ctx, p.lum, p.lum_sq, ns, double(p.rays));
+#endif
+          fb.set_pixel(i, j, ns, p.col, p.lum, p.lum_sq, p.aov);
+        }
+      }
     }
+    current_random_stream() = nullptr;
+  }
+  for (const auto &tile : tiles) {
+    image.merge(tile);
   }
+  image.write(fb, spp_map);
 }
 
 #endif //FLUORSWITCH_SRC_RENDER_SPECTRAL_PATH_TRACE_H_
@@ -0,0 +1,175 @@
+#ifndef FLUORSWITCH_SRC_RENDER_TEMPORAL_REUSE_H_
+#define FLUORSWITCH_SRC_RENDER_TEMPORAL_REUSE_H_
+
+#include <algorithm>
+#include <vector>
+#include "../camera/camera.h"
+#include "../utils/hittable.h"
+#include "frame_buffer.h"
+
+/// 画素中心レイの最初の交差点
+struct gbuffer_sample {
+  int obj_id{0};
+  double depth{0.0};
+  vec3 normal{ZERO_VEC3};
+};
+
+/// Gバッファの描画(1画素1レイ)
+template<typename mat>
+std::vector<gbuffer_sample> render_gbuffer(unsigned int nx, unsigned int ny, const hittable<mat> &world) {
+  std::vector<gbuffer_sample> gbuffer(size_t(nx) * ny);
+  #pragma omp parallel for schedule(dynamic, 1) num_threads(MAX_THREAD_NUM)
+  for (int j = 0; j < int(ny); ++j) {
+    for (int i = 0; i < int(nx); ++i) {
+      ray r = SCENE_CAMERA.get_ray((i + 0.5) / double(nx), (j + 0.5) / double(ny));
+      hit_record<mat> rec;
+      auto &g = gbuffer[size_t(j) * nx + i];
+      if (world.hit(r, 0.001, INF, rec)) {
+        g.obj_id = rec.obj_id;
+        g.depth = rec.t * r.direction().length();
+        g.normal = rec.normal;
+      }
+    }
+  }
+  return gbuffer;
+}
+
+/// 同じ物体の同じ面が見えているか
+inline bool same_surface(const gbuffer_sample &a, const gbuffer_sample &b) {
+  if (a.obj_id != b.obj_id) {
+    return false;
+  }
+  // 背景同士
+  if (a.depth == 0.0 && b.depth == 0.0) {
+    return true;
+  }
+  return fabs(a.depth - b.depth) <= TEMPORAL_DEPTH_TOLERANCE * b.depth
+      && dot(a.normal, b.normal) >= TEMPORAL_NORMAL_TOLERANCE;
+}
+
+/// 前フレームの放射輝度の再利用
+/// カメラは静止しているので、同じ画素に同じ面が見えていれば履歴をそのまま使える
+/// 再利用する画素は少数の新規サンプルだけを追加し、履歴と食い違う画素は描き直す
+class temporal_history {
+ public:
+  temporal_history(unsigned int w, unsigned int h)
+      : width(w), height(h),
+        radiance(size_t(w) * h, ZERO), sample_variance(size_t(w) * h, 0.0),
+        samples(size_t(w) * h, 0), gbuffer(size_t(w) * h) {}
+
+  /// 履歴を使ってフレームを描画
+  /// frame_class: 積分器の種類(RGB / スペクトラル)が変わったら履歴を破棄
+  /// light_intensity: 光源の強度(単一光源なので放射輝度は強度に比例する)
+  ///   光源が複数(環境光など)だと比例しないので、呼び出し側で履歴を破棄して描き直すこと
+  /// render_pass(spp_map): 画素毎のサンプル数でfbへ描画
+  template<typename F>
+  void render(frame_buffer &fb, const std::vector<gbuffer_sample> &g, int ns,
+              int frame_class, double light_intensity, F &&render_pass) {
+    const size_t n = size_t(width) * height;
+    bool usable = valid && frame_class == history_class && prev_intensity > 0.0;
+    double scale = usable ? light_intensity / prev_intensity : 0.0;
+    int fresh = std::min(ns, std::max(1, int(ceil(ns * TEMPORAL_FRESH_RATIO))));
+
+    /// 再利用できる画素の判定
+    std::vector<char> reuse(n, 0);
+    std::vector<int> spp_map(n, ns);
+    for (size_t p = 0; p < n; ++p) {
+      if (usable && samples[p] > 0 && same_surface(gbuffer[p], g[p])) {
+        reuse[p] = 1;
+        spp_map[p] = fresh;
+      }
+    }
+    render_pass(spp_map);
+
+    /// 新規サンプルが履歴と食い違う画素(影の移動など)は描き直す
+    std::vector<int> rejected(n, 0);
+    bool any_rejected = false;
+    for (size_t p = 0; p < n; ++p) {
+      if (!reuse[p]) continue;
+      double history_lum = luminance(radiance[p] * scale);
+      double var = sample_variance[p] * scale * scale;
+      double sigma = sqrt(var / fresh + var / samples[p]);
+      double diff = fabs(luminance(fb.radiance[p]) - history_lum);
+      // NaN同士の比較は成り立たないので否定形で判定
+      if (!(diff <= TEMPORAL_REJECT_SIGMA * sigma + TEMPORAL_REJECT_EPS)) {
+        reuse[p] = 0;
+        rejected[p] = ns;
+        any_rejected = true;
+      }
+    }
+    if (any_rejected) {
+      render_pass(rejected);
+    }
+
+    /// 履歴との合成
+    const double max_samples = TEMPORAL_MAX_HISTORY * ns;
+    for (size_t p = 0; p < n; ++p) {
+      if (reuse[p]) {
+        double history_n = samples[p];
+        color blended = (radiance[p] * scale * history_n + fb.radiance[p] * fresh) / (history_n + fresh);
+        sample_variance[p] *= scale * scale;
+        samples[p] = std::min(history_n + fresh, max_samples);
+        radiance[p] = blended;
+        fb.radiance[p] = blended;
+        fb.variance[p] = sample_variance[p] / samples[p];
+      } else {
+        radiance[p] = fb.radiance[p];
+        sample_variance[p] = fb.variance[p] * ns;
+        samples[p] = ns;
+      }
+      gbuffer[p] = g[p];
+    }
+
+    valid = true;
+    history_class = frame_class;
+    prev_intensity = light_intensity;
+    prev_ns = ns;
+  }
+
+  /// 時間予算の見積もり: 次のrenderで、sppに対する新規に追跡するサンプル数の比(cost)と合成後のサンプル数の比(gain)
+  /// 面の一致と食い違いの判定は描画まで分からないので、履歴のある画素は全て再利用できるとみなす
+  /// gainは画素毎の比の調和平均(表示上の分散 = 分散 / (spp x 比) の画像全体の平均が合うように)
+  void estimate(int frame_class, double &cost, double &gain) const {
+    cost = 1.0;
+    gain = 1.0;
+    if (!(valid && frame_class == history_class && prev_intensity > 0.0 && prev_ns > 0)) {
+      return;
+    }
+    const size_t n = size_t(width) * height;
+    double fresh_sum = 0.0, inv_gain_sum = 0.0;
+    for (size_t p = 0; p < n; ++p) {
+      if (samples[p] > 0) {
+        fresh_sum += TEMPORAL_FRESH_RATIO;
+        inv_gain_sum += 1.0 / std::min(samples[p] / prev_ns + TEMPORAL_FRESH_RATIO, double(TEMPORAL_MAX_HISTORY));
+      } else {
+        fresh_sum += 1.0;
+        inv_gain_sum += 1.0;
+      }
+    }
+    cost = fresh_sum / n;
+    gain = n / inv_gain_sum;
+  }
+
+  /// 履歴を破棄(履歴を使わずに描いたフレームの後)
+  void invalidate() {
+    valid = false;
+    history_class = -1;
+  }
+
+ public:
+  unsigned int width;
+  unsigned int height;
+  std::vector<color> radiance;
+  // 1サンプル当たりの輝度の分散
+  std::vector<double> sample_variance;
+  // 履歴に含まれる実効サンプル数
+  std::vector<double> samples;
+  std::vector<gbuffer_sample> gbuffer;
+  bool valid{false};
+  int history_class{-1};
+  double prev_intensity{0.0};
+  // 前のフレームのspp
+  int prev_ns{0};
+};
+
+#endif //FLUORSWITCH_SRC_RENDER_TEMPORAL_REUSE_H_
@@ -0,0 +1,156 @@
+#ifndef FLUORSWITCH_SRC_RENDER_TIME_BUDGET_H_
+#define FLUORSWITCH_SRC_RENDER_TIME_BUDGET_H_
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include "../utils/util_funcs.h"
+#include "frame_buffer.h"
+
+/// パイロットパスの計測結果
+struct pilot_record {
+  // 1フレーム全体を1sppで描画する秒数
+  double sec_per_spp{0.0};
+  // 1サンプル当たりの表示輝度の分散
+  double variance{0.0};
+};
+
+/// 描画パスのサンプルの配り方(パイロットの計測の換算に使う)
+enum class pilot_kind {
+  // 画素毎にspp_mapのサンプル(パストレーサー、ReSTIR、BDPT)
+  per_pixel,
+  // spp_mapの総数を連鎖で画像全体に配る(MLT)
+  whole_image,
+  // 光源側のパスを描画パス毎に画素数に依らない数だけ追跡する(SPPM)
+  per_pass,
+};
+
+/// パイロットパス
+/// PILOT_STRIDE間隔で間引いた画素にPILOT_PPSサンプルのspp_mapで、フレームと同じ積分器の描画パスを1回呼び、コストと分散を見積もる
+/// render_pass(fb, spp_map): 画素毎のサンプル数でfbへ描画
+template<typename F>
+pilot_record pilot_pass(unsigned int nx, unsigned int ny, pilot_kind kind, F &&render_pass) {
+  frame_buffer fb(nx, ny);
+  std::vector<int> spp_map(size_t(nx) * ny, 0);
+  std::vector<size_t> pixels;
+  for (unsigned int j = 0; j < ny; j += PILOT_STRIDE) {
+    for (unsigned int i = 0; i < nx; i += PILOT_STRIDE) {
+      spp_map[fb.index(i, j)] = PILOT_PPS;
+      pixels.push_back(fb.index(i, j));
+    }
+  }
+  const double traced = double(pixels.size()) * PILOT_PPS;
+  // 計測した画素の分散(平均値の分散)を1サンプル当たりに換算する画素毎のサンプル数
+  const double samples = kind == pilot_kind::whole_image ? traced / (double(nx) * ny) : PILOT_PPS;
+
+  auto start = std::chrono::system_clock::now();
+  render_pass(fb, spp_map);
+  auto end = std::chrono::system_clock::now();
+  double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() * 1e-6;
+
+  double variance_sum = 0.0;
+  for (size_t p : pixels) {
+    double mean = luminance(fb.radiance[p]);
+    double var = fb.variance[p] * samples;
+    // NaNを除外
+    if (!(mean == mean && var == var)) continue;
+    // ガンマ補正(sqrt)後の分散に換算: Var[sqrt(X)] ~ Var[X] / 4E[X]
+    variance_sum += var / (4.0 * ffmax(mean, 1e-4));
+  }
+
+  pilot_record pilot;
+  // SPPMはフォトンの追跡が描画パス数に比例し、間引いた画素数には比例しない
+  pilot.sec_per_spp = kind == pilot_kind::per_pass ? elapsed / PILOT_PPS : elapsed / traced * double(nx) * double(ny);
+  pilot.variance = variance_sum / double(pixels.size());
+  return pilot;
+}
+
+/// アニメーション全体の時間予算からフレーム毎のsppを決める
+/// 表示上のノイズ(分散/spp)が全フレームで揃うように spp_f ∝ 分散_f で配分し、
+/// 実際の描画時間でコスト見積もりを更新し続ける
+/// 時間方向の再利用がある場合は、ノイズを 分散/(spp x 実効サンプル数の比)、コストを 新規サンプル数の比 で見積もる
+class frame_budget_planner {
+ public:
+  frame_budget_planner(double budget_sec, int last_frame, int rgb_end_frame)
+      : budget(budget_sec), max_frame(last_frame), rgb_end(rgb_end_frame) {
+    start = std::chrono::system_clock::now();
+  }
+
+  /// フレームクラス(RGB / スペクトラル)の初期見積もり
+  void calibrate(bool spectral, const pilot_record &pilot) {
+    auto &k = classes[spectral];
+    k.sec_per_spp = pilot.sec_per_spp;
+    k.variance = pilot.variance;
+  }
+
+  /// フレームのsppを決定
+  /// reuse_cost: sppに対する新規に追跡するサンプル数の比、reuse_gain: sppに対する履歴と合成した後のサンプル数の比
+  int plan(int frame, const pilot_record &pilot, double reuse_cost = 1.0, double reuse_gain = 1.0) {
+    bool spectral = frame > rgb_end;
+    auto &k = classes[spectral];
+    // パイロットの分散と再利用の見積もりは常に最新を採用、コストは実測値が無いときのみ
+    k.variance = pilot.variance;
+    k.reuse_cost = reuse_cost;
+    k.reuse_gain = reuse_gain;
+    if (!k.measured) {
+      k.sec_per_spp = pilot.sec_per_spp;
+    }
+
+    // 残り時間からPNG出力などの固定費を差し引く
+    int remaining_frames = max_frame - frame + 1;
+    double remaining = budget - elapsed() - overhead_sec * remaining_frames;
+
+    // 残りフレームの (コスト * 分散) の総和(残りのフレームは同じクラスの最新の再利用の見積もりが続くとみなす)
+    double weighted_cost = 0.0;
+    for (int f = frame; f <= max_frame; ++f) {
+      const auto &c = classes[f > rgb_end];
+      weighted_cost += c.sec_per_spp * c.reuse_cost * c.variance / c.reuse_gain;
+    }
+
+    int spp = BUDGET_MAX_PPS;
+    if (weighted_cost > 0.0) {
+      spp = int(k.variance / k.reuse_gain * ffmax(remaining, 0.0) / weighted_cost);
+    }
+    spp = std::max(BUDGET_MIN_PPS, std::min(spp, BUDGET_MAX_PPS));
+#ifndef NDEBUG
+    std::cout << "\n[Budget] remaining: " << remaining << "(sec), spp: " << spp
+              << ", estimated: " << spp * k.sec_per_spp * k.reuse_cost << "(sec)" << std::endl;
+#endif
+    return spp;
+  }
+
+  /// 実際の描画結果で見積もりを更新(コストは履歴を使わずに全画素を描く場合に換算)
+  void record(int frame, int spp, double render_sec, double frame_sec) {
+    auto &k = classes[frame > rgb_end];
+    double measured = render_sec / (spp * k.reuse_cost);
+    k.sec_per_spp = k.measured ? (1.0 - BUDGET_EMA) * k.sec_per_spp + BUDGET_EMA * measured : measured;
+    k.measured = true;
+    double overhead = ffmax(frame_sec - render_sec, 0.0);
+    overhead_sec = (1.0 - BUDGET_EMA) * overhead_sec + BUDGET_EMA * overhead;
+  }
+
+  double elapsed() const {
+    auto now = std::chrono::system_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() * 0.001;
+  }
+
+ private:
+  struct frame_class {
+    double sec_per_spp{0.0};
+    double variance{0.0};
+    double reuse_cost{1.0};
+    double reuse_gain{1.0};
+    bool measured{false};
+  };
+
+  std::chrono::system_clock::time_point start;
+  double budget;
+  int max_frame;
+  int rgb_end;
+  double overhead_sec{0.0};
+  // [0]: RGB, [1]: スペクトラル
+  frame_class classes[2];
+};
+
+#endif //FLUORSWITCH_SRC_RENDER_TIME_BUDGET_H_
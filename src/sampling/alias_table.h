@@ -0,0 +1,78 @@
+#ifndef FLUORSWITCH_SRC_SAMPLING_ALIAS_TABLE_H_
+#define FLUORSWITCH_SRC_SAMPLING_ALIAS_TABLE_H_
+
+#include <algorithm>
+#include <vector>
+#include "../utils/util_funcs.h"
+
+/// 離散分布を定数時間でサンプリングする別名表 (Walker 1977 / Vose 1991)
+/// 各区画は自分の確率 prob と、残りを埋める別の要素 alias を持つ
+class alias_table {
+ public:
+  alias_table() = default;
+
+  /// 非負の重みから作る(合計が0なら一様)
+  explicit alias_table(const std::vector<double> &weights) {
+    const size_t n = weights.size();
+    bins.resize(n);
+    double sum = 0.0;
+    for (double w : weights) {
+      sum += w;
+    }
+    if (n == 0) {
+      return;
+    }
+    // 平均が1になるように正規化し、1未満と1以上に分ける
+    std::vector<size_t> small, large;
+    std::vector<double> scaled(n);
+    for (size_t i = 0; i < n; ++i) {
+      bins[i].pmf = sum > 0.0 ? weights[i] / sum : 1.0 / n;
+      scaled[i] = bins[i].pmf * n;
+      (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    // 1未満の区画の残りを1以上の要素で埋める
+    while (!small.empty() && !large.empty()) {
+      size_t s = small.back();
+      small.pop_back();
+      size_t l = large.back();
+      bins[s].prob = scaled[s];
+      bins[s].alias = l;
+      scaled[l] -= 1.0 - scaled[s];
+      if (scaled[l] < 1.0) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // 誤差で残ったものはそのまま
+    for (size_t i : small) bins[i].prob = 1.0;
+    for (size_t i : large) bins[i].prob = 1.0;
+  }
+
+  /// u in [0, 1) から要素を選ぶ(pmf: 選んだ要素の確率)
+  size_t sample(double u, double &pmf) const {
+    const size_t n = bins.size();
+    double scaled = u * n;
+    size_t i = std::min(size_t(scaled), n - 1);
+    size_t k = scaled - i < bins[i].prob ? i : bins[i].alias;
+    pmf = bins[k].pmf;
+    return k;
+  }
+
+  double pmf(size_t i) const {
+    return bins[i].pmf;
+  }
+
+  size_t size() const {
+    return bins.size();
+  }
+
+ private:
+  struct bin {
+    double prob{1.0};
+    size_t alias{0};
+    double pmf{0.0};
+  };
+  std::vector<bin> bins;
+};
+
+#endif //FLUORSWITCH_SRC_SAMPLING_ALIAS_TABLE_H_
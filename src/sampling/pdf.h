@@ -4,6 +4,8 @@
 #include "../utils/vec3.h"
 #include "../utils/util_funcs.h"
 #include "../utils/onb.h"
+#include "../utils/fast_math.h"
+
 class pdf {
  public:
   virtual ~pdf() {}
@@ -17,9 +19,10 @@ inline vec3 random_cosine_direction() {
   auto r2 = random_double();
   auto z = sqrt(1 - r2);
 
-  auto phi = 2 * M_PI * r1;
-  auto x = cos(phi) * sqrt(r2);
-  auto y = sin(phi) * sqrt(r2);
+  double sin_phi, cos_phi;
+  fast_sincos(2 * M_PI * r1, sin_phi, cos_phi);
+  auto x = cos_phi * sqrt(r2);
+  auto y = sin_phi * sqrt(r2);
 
   return vec3(x, y, z);
 }
@@ -29,9 +32,11 @@ inline vec3 random_to_sphere(double radius, double distance_squared) {
   auto r2 = random_double();
   auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
 
-  auto phi = 2 * M_PI * r1;
-  auto x = cos(phi) * sqrt(1 - z * z);
-  auto y = sin(phi) * sqrt(1 - z * z);
+  double sin_phi, cos_phi;
+  fast_sincos(2 * M_PI * r1, sin_phi, cos_phi);
+  auto sin_theta = sqrt(1 - z * z);
+  auto x = cos_phi * sin_theta;
+  auto y = sin_phi * sin_theta;
 
   return vec3(x, y, z);
 }
@@ -72,17 +77,18 @@ class hittable_pdf : public pdf {
 
 class mixture_pdf : public pdf {
  public:
-  mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1) {
+  // w0: p0を選ぶ確率
+  mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1, double w0 = 0.5) : weight(w0) {
     p[0] = p0;
     p[1] = p1;
   }
 
   double value(const vec3 &direction) const override {
-    return 0.5 * p[0]->value(direction) + 0.5 * p[1]->value(direction);
+    return weight * p[0]->value(direction) + (1.0 - weight) * p[1]->value(direction);
   }
 
   vec3 generate() const override {
-    if (random_double() < 0.5) {
+    if (random_double() < weight) {
       return p[0]->generate();
     } else {
       return p[1]->generate();
@@ -91,6 +97,7 @@ class mixture_pdf : public pdf {
 
  public:
   shared_ptr<pdf> p[2];
+  double weight;
 };
 
 #endif //FLUORSWITCH_SRC_SAMPLING_PDF_H_
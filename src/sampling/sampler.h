@@ -0,0 +1,372 @@
+#ifndef FLUORSWITCH_SRC_SAMPLING_SAMPLER_H_
+#define FLUORSWITCH_SRC_SAMPLING_SAMPLER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "../utils/util_funcs.h"
+
+/// 次元の割り当て
+/// ブロック0: 画素内の位置(2), レンズ(2)  ※時間などの5次元目以降は独立な乱数
+/// ブロック1 + b: b回目の反射(光源/BSDFの選択、方向の2次元、光源の選択など4次元まで)
+constexpr int SAMPLER_BLOCK_DIMENSIONS = 4;
+constexpr int SAMPLER_BLOCKS = 1 + SAMPLER_MAX_BOUNCE;
+/// ブルーノイズのタイルの一辺(2の累乗)
+constexpr int BLUE_NOISE_TILE = 64;
+
+inline uint32_t hash_u32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+  return hash_u32(seed ^ (v + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+  x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+  x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+/// ハッシュによるOwenスクランブル (Burley 2020)
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cU;
+  x ^= x * 0xb82f1e52U;
+  x ^= x * 0xc7afe638U;
+  x ^= x * 0x8d22f6e6U;
+  return reverse_bits(x);
+}
+
+inline double u32_to_unit(uint32_t x) {
+  return x * (1.0 / 4294967296.0);
+}
+
+/// Sobol列の最初の4次元 (Joe and Kuo 2008 の方向数)
+/// 方向数のXORを8bit毎の表にまとめ、32bitの番号を4回の参照で求める
+inline uint32_t sobol(uint32_t index, int dim) {
+  static const auto tables = [] {
+    // 次元1以降の原始多項式の次数s、係数a、初期値m
+    const int s[3] = {1, 2, 3};
+    const int a[3] = {0, 1, 1};
+    const uint32_t m[3][3] = {{1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+    uint32_t v[SAMPLER_BLOCK_DIMENSIONS][32];
+    for (int b = 0; b < 32; ++b) {
+      v[0][b] = 1U << (31 - b);
+    }
+    for (int d = 1; d < SAMPLER_BLOCK_DIMENSIONS; ++d) {
+      const int sd = s[d - 1];
+      for (int b = 0; b < 32; ++b) {
+        if (b < sd) {
+          v[d][b] = m[d - 1][b] << (31 - b);
+          continue;
+        }
+        v[d][b] = v[d][b - sd] ^ (v[d][b - sd] >> sd);
+        for (int k = 1; k < sd; ++k) {
+          v[d][b] ^= ((a[d - 1] >> (sd - 1 - k)) & 1) * v[d][b - k];
+        }
+      }
+    }
+    std::vector<uint32_t> t(SAMPLER_BLOCK_DIMENSIONS * 4 * 256, 0);
+    for (int d = 0; d < SAMPLER_BLOCK_DIMENSIONS; ++d) {
+      for (int byte = 0; byte < 4; ++byte) {
+        for (int x = 0; x < 256; ++x) {
+          uint32_t &e = t[(d * 4 + byte) * 256 + x];
+          for (int b = 0; b < 8; ++b) {
+            if (x & (1 << b)) e ^= v[d][byte * 8 + b];
+          }
+        }
+      }
+    }
+    return t;
+  }();
+  const uint32_t *t = &tables[dim * 4 * 256];
+  return t[index & 255] ^ t[256 + ((index >> 8) & 255)] ^ t[512 + ((index >> 16) & 255)] ^ t[768 + (index >> 24)];
+}
+
+/// 各桁の置換をそれより上の桁で決める(Owenスクランブル)基数baseの根基逆関数
+inline double scrambled_radical_inverse(uint32_t base, uint32_t index, uint32_t seed) {
+  const double inv_base = 1.0 / base;
+  double f = inv_base;
+  double result = 0.0;
+  uint32_t prefix = seed;
+  // 32bit相当の精度まで(上位の桁が0でも置換で0以外になる)
+  while (f > 1.0 / 4294967296.0) {
+    uint32_t digit = index % base;
+    index /= base;
+    result += ((digit + hash_u32(prefix)) % base) * f;
+    prefix = hash_combine(prefix, digit);
+    f *= inv_base;
+  }
+  return std::min(result, 1.0 - std::numeric_limits<double>::epsilon());
+}
+
+/// 先頭からn個の素数
+inline const std::vector<uint32_t> &primes() {
+  static const auto table = [] {
+    const int n = SAMPLER_BLOCKS * SAMPLER_BLOCK_DIMENSIONS;
+    std::vector<uint32_t> p;
+    for (uint32_t k = 2; int(p.size()) < n; ++k) {
+      bool prime = true;
+      for (uint32_t q : p) {
+        if (q * q > k) break;
+        if (k % q == 0) {
+          prime = false;
+          break;
+        }
+      }
+      if (prime) p.push_back(k);
+    }
+    return p;
+  }();
+  return table;
+}
+
+/// void-and-cluster法 (Ulichney 1993) によるブルーノイズのタイル(順位を[0,1)にした値)
+/// 固定の種で起動後に1回だけ作る
+inline const std::vector<double> &blue_noise_tile() {
+  static const auto tile = [] {
+    const int t = BLUE_NOISE_TILE;
+    const int n = t * t;
+    const double sigma = 1.5;
+    // トーラス上のガウス核
+    std::vector<double> kernel(n);
+    for (int y = 0; y < t; ++y) {
+      for (int x = 0; x < t; ++x) {
+        int dx = std::min(x, t - x), dy = std::min(y, t - y);
+        kernel[y * t + x] = exp(-(dx * dx + dy * dy) / (2.0 * sigma * sigma));
+      }
+    }
+    std::vector<char> on(n, 0);
+    std::vector<double> energy(n, 0.0);
+    auto splat = [&](int p, double sign) {
+      int px = p % t, py = p / t;
+      for (int y = 0; y < t; ++y) {
+        const double *row = &kernel[((y - py + t) & (t - 1)) * t];
+        for (int x = 0; x < t; ++x) {
+          energy[y * t + x] += sign * row[(x - px + t) & (t - 1)];
+        }
+      }
+    };
+    // 最も密な点 / 最も大きな空隙
+    auto tightest = [&] {
+      int best = -1;
+      for (int p = 0; p < n; ++p) {
+        if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+      }
+      return best;
+    };
+    auto largest_void = [&] {
+      int best = -1;
+      for (int p = 0; p < n; ++p) {
+        if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+      }
+      return best;
+    };
+
+    /// 初期パターン: 1割の点を置き、最も密な点を最も大きな空隙へ移せなくなるまで動かす
+    const int ones = n / 10;
+    uint32_t h = 1;
+    for (int placed = 0; placed < ones;) {
+      h = hash_u32(h + 1);
+      int p = int(h % n);
+      if (on[p]) continue;
+      on[p] = 1;
+      splat(p, 1.0);
+      ++placed;
+    }
+    for (int it = 0; it < n; ++it) {
+      int c = tightest();
+      on[c] = 0;
+      splat(c, -1.0);
+      int v = largest_void();
+      on[v] = 1;
+      splat(v, 1.0);
+      if (v == c) break;
+    }
+    const auto initial_on = on;
+    const auto initial_energy = energy;
+
+    std::vector<int> rank(n, 0);
+    // 初期パターンの点から密な順に取り除いて順位を下から付ける
+    for (int r = ones - 1; r >= 0; --r) {
+      int c = tightest();
+      on[c] = 0;
+      splat(c, -1.0);
+      rank[c] = r;
+    }
+    // 空隙を埋める順に順位を上へ付ける
+    on = initial_on;
+    energy = initial_energy;
+    for (int r = ones; r < n; ++r) {
+      int v = largest_void();
+      on[v] = 1;
+      splat(v, 1.0);
+      rank[v] = r;
+    }
+    std::vector<double> values(n);
+    for (int p = 0; p < n; ++p) {
+      values[p] = (rank[p] + 0.5) / n;
+    }
+    return values;
+  }();
+  return tile;
+}
+
+/// 描画パス毎の番号(フレームや時間方向の再利用の追加パスで列を変える)
+inline uint32_t next_sampler_pass() {
+  static std::atomic<uint32_t> pass{0};
+  return pass++;
+}
+
+/// 画素サンプラー
+/// random_doubleの差し替え先として、カメラ・レンズと反射毎の光源・BSDFの選択に決まった次元を割り当てる
+/// 割り当てを使い切った分、SAMPLER_MAX_BOUNCE以降の反射、同じ反射回数の2回目(分岐した後など)は独立な乱数
+class sampler : public random_stream {
+ public:
+  explicit sampler(uint32_t pass) : pass_id(pass), pass_seed(hash_u32(pass)) {}
+
+  /// 画素(i, j)のindex番目のサンプルを始める(カメラのブロック)
+  /// 独立な乱数もこのサンプルの種から始める(同じサンプルを複数の段階で扱う場合は段階毎にstreamを変える)
+  void start_sample(unsigned int i, unsigned int j, unsigned int index, uint32_t stream = 0) {
+    seed_random(pass_id, hash_combine(i, j), index, stream);
+    px = i;
+    py = j;
+    pixel_seed = hash_combine(pass_seed, hash_combine(i, j));
+    sample_index = index;
+    block = 0;
+    dimension = 0;
+    bounce = -1;
+    start_block();
+  }
+
+  void begin_bounce(int b) override {
+    if (b <= bounce || b >= SAMPLER_MAX_BOUNCE) {
+      dimension = SAMPLER_BLOCK_DIMENSIONS;
+      return;
+    }
+    bounce = b;
+    block = 1 + b;
+    dimension = 0;
+    start_block();
+  }
+
+  double next() override {
+    if (dimension >= SAMPLER_BLOCK_DIMENSIONS) {
+      return independent_random_double();
+    }
+    return sample(dimension++);
+  }
+
+ protected:
+  /// ブロック毎の準備(ブロック内の次元で共通の値を1回だけ求める)
+  virtual void start_block() {}
+  virtual double sample(int dim) = 0;
+
+ protected:
+  uint32_t pass_id;
+  uint32_t pass_seed;
+  uint32_t pixel_seed{0};
+  unsigned int px{0}, py{0};
+  uint32_t sample_index{0};
+  int block{0};
+
+ private:
+  int dimension{0};
+  int bounce{-1};
+};
+
+/// 独立な乱数(比較用)
+class independent_sampler : public sampler {
+ public:
+  using sampler::sampler;
+
+ protected:
+  double sample(int dim) override {
+    return independent_random_double();
+  }
+};
+
+/// Owenスクランブルを掛けたSobol列
+/// ブロック毎に4次元のSobol列を使い、サンプル番号をブロック毎にシャッフルしてブロック間の相関を消す (Burley 2020)
+class sobol_sampler : public sampler {
+ public:
+  using sampler::sampler;
+
+ protected:
+  void start_block() override {
+    seed = hash_combine(pixel_seed, block);
+    index = nested_uniform_scramble(sample_index, seed);
+  }
+
+  double sample(int dim) override {
+    return u32_to_unit(nested_uniform_scramble(sobol(index, dim), hash_combine(seed, dim + 1)));
+  }
+
+ private:
+  uint32_t seed{0};
+  uint32_t index{0};
+};
+
+/// 画素毎にOwenスクランブルを掛けたHalton列(次元毎に素数の基数)
+class halton_sampler : public sampler {
+ public:
+  using sampler::sampler;
+
+ protected:
+  double sample(int dim) override {
+    int d = block * SAMPLER_BLOCK_DIMENSIONS + dim;
+    return scrambled_radical_inverse(primes()[d], sample_index, hash_combine(pixel_seed, d));
+  }
+};
+
+/// 全画素で同じスクランブルのSobol列を、ブルーノイズのタイルで画素毎にずらす (Georgiev and Fajardo 2016)
+/// 画素間の誤差が高周波に集まり、同じsppでも見た目のノイズが減る
+class blue_noise_sampler : public sampler {
+ public:
+  using sampler::sampler;
+
+ protected:
+  void start_block() override {
+    seed = hash_combine(pass_seed, block);
+    index = nested_uniform_scramble(sample_index, seed);
+  }
+
+  double sample(int dim) override {
+    double x = u32_to_unit(nested_uniform_scramble(sobol(index, dim), hash_combine(seed, dim + 1)));
+    // 次元毎にタイルの位置を変える
+    uint32_t offset = hash_combine(seed, dim + SAMPLER_BLOCK_DIMENSIONS + 1);
+    unsigned int tx = (px + offset) & (BLUE_NOISE_TILE - 1);
+    unsigned int ty = (py + (offset >> 16)) & (BLUE_NOISE_TILE - 1);
+    x += blue_noise_tile()[ty * BLUE_NOISE_TILE + tx];
+    return x < 1.0 ? x : x - 1.0;
+  }
+
+ private:
+  uint32_t seed{0};
+  uint32_t index{0};
+};
+
+/// SAMPLER_TYPE毎の表示名
+constexpr const char *SAMPLER_NAMES[] = {"independent", "Sobol (Owen)", "Halton", "blue noise"};
+
+#if SAMPLER_TYPE == 1
+using pixel_sampler = sobol_sampler;
+#elif SAMPLER_TYPE == 2
+using pixel_sampler = halton_sampler;
+#elif SAMPLER_TYPE == 3
+using pixel_sampler = blue_noise_sampler;
+#else
+using pixel_sampler = independent_sampler;
+#endif
+
+#endif //FLUORSWITCH_SRC_SAMPLING_SAMPLER_H_
@@ -0,0 +1,342 @@
+#ifndef FLUORSWITCH_SRC_SAMPLING_SD_TREE_H_
+#define FLUORSWITCH_SRC_SAMPLING_SD_TREE_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "../utils/util_funcs.h"
+#include "../utils/aabb.h"
+#include "../utils/hittable.h"
+#include "pdf.h"
+
+/// 方向 <-> 正方形[0,1)^2 (等面積の円筒写像)
+inline void direction_to_square(const vec3 &d, double &u, double &v) {
+  vec3 w = unit_vector(d);
+  u = clamp((w.z() + 1.0) * 0.5, 0.0, 1.0 - 1e-9);
+  double phi = atan2(w.y(), w.x());
+  if (phi < 0.0) phi += 2 * M_PI;
+  v = clamp(phi / (2 * M_PI), 0.0, 1.0 - 1e-9);
+}
+
+inline vec3 square_to_direction(double u, double v) {
+  double cos_theta = 2.0 * u - 1.0;
+  double sin_theta = sqrt(ffmax(0.0, 1.0 - cos_theta * cos_theta));
+  double phi = 2 * M_PI * v;
+  return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+/// 方向の四分木 (D-tree)
+/// サンプリング用の和は前回の学習結果(描画中は読み取り専用)
+/// 学習用の和は全スレッドからアトミックに加算し、refineで次の木を作る
+class dtree {
+  struct quad_node {
+    int child[4]{-1, -1, -1, -1};
+    double sum[4]{0.0, 0.0, 0.0, 0.0};
+  };
+
+ public:
+  dtree() : nodes(1) { reset_building(); }
+
+  /// 構造とサンプリング用の和を引き継いだ複製(空間ノードの分割用)
+  std::unique_ptr<dtree> clone() const {
+    std::unique_ptr<dtree> d(new dtree());
+    d->nodes = nodes;
+    d->total = total;
+    d->theta = theta;
+    d->moment = moment;
+    d->reset_building();
+    return d;
+  }
+
+  bool trained() const { return total > 0.0; }
+
+  /// BSDF側のサンプリングでガイドを選ぶ確率
+  double selection_probability() const { return 1.0 / (1.0 + exp(-theta)); }
+
+  /// 立体角に対するpdf
+  double pdf(const vec3 &dir) const {
+    if (!trained()) {
+      return 1.0 / (4 * M_PI);
+    }
+    double u, v;
+    direction_to_square(dir, u, v);
+    double p = 1.0;
+    int node = 0;
+    while (true) {
+      const auto &n = nodes[node];
+      int q = quadrant(u, v);
+      double node_total = n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+      if (node_total <= 0.0) break;
+      p *= 4.0 * n.sum[q] / node_total;
+      if (n.child[q] < 0) break;
+      node = n.child[q];
+    }
+    return p / (4 * M_PI);
+  }
+
+  vec3 sample() const {
+    if (!trained()) {
+      return square_to_direction(random_double(), random_double());
+    }
+    double origin_u = 0.0, origin_v = 0.0, size = 1.0;
+    int node = 0;
+    while (true) {
+      const auto &n = nodes[node];
+      double node_total = n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+      if (node_total <= 0.0) break;
+      // 和に比例して象限を選ぶ
+      double x = random_double() * node_total;
+      int q = 0;
+      while (q < 3 && x >= n.sum[q]) {
+        x -= n.sum[q];
+        ++q;
+      }
+      size *= 0.5;
+      origin_u += (q & 1) ? size : 0.0;
+      origin_v += (q & 2) ? size : 0.0;
+      if (n.child[q] < 0) break;
+      node = n.child[q];
+    }
+    return square_to_direction(origin_u + size * random_double(), origin_v + size * random_double());
+  }
+
+  /// 入射放射輝度の推定値(1 / pdfで重み付け済み)を記録
+  void record(const vec3 &dir, double value) {
+    samples.fetch_add(1, std::memory_order_relaxed);
+    // NaN, INFを除外
+    if (!(value > 0.0 && value < INF)) return;
+    double u, v;
+    direction_to_square(dir, u, v);
+    int node = 0;
+    while (true) {
+      int q = quadrant(u, v);
+      if (nodes[node].child[q] < 0) {
+        atomic_add(building[node * 4 + q], value);
+        return;
+      }
+      node = nodes[node].child[q];
+    }
+  }
+
+  /// 選択確率の学習: 推定値の二次モーメントの勾配を記録
+  /// estimate: f cos L / pdf, dpdf: 選択確率に対する全体のpdfの微分
+  void record_selection(double estimate, double pdf_val, double dpdf) {
+    double g = -estimate * estimate * dpdf / pdf_val;
+    if (!(fabs(g) < INF)) return;
+    atomic_add(gradient, g);
+    gradient_count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// 学習結果から木を作り直す(描画していない間に呼ぶ)
+  /// エネルギーの割合が GUIDING_SPLIT_FRACTION を超える象限を分割し、少ない部分はまとめる
+  void refine() {
+    std::vector<double> subtree(nodes.size() * 4, 0.0);
+    double new_total = 0.0;
+    for (int q = 0; q < 4; ++q) {
+      new_total += building_sum(0, q, subtree);
+    }
+    /// 選択確率のロジットを勾配降下(Adam風に二次モーメントで正規化)
+    uint32_t count = gradient_count.load(std::memory_order_relaxed);
+    if (count > 0) {
+      double alpha = selection_probability();
+      double g = gradient.load(std::memory_order_relaxed) / count * alpha * (1.0 - alpha);
+      moment = 0.9 * moment + 0.1 * g * g;
+      theta = clamp(theta - GUIDING_LEARNING_RATE * g / (sqrt(moment) + 1e-12), -GUIDING_MAX_LOGIT, GUIDING_MAX_LOGIT);
+    }
+    if (new_total > 0.0) {
+      std::vector<quad_node> rebuilt(1);
+      double root[4];
+      for (int q = 0; q < 4; ++q) root[q] = subtree[q];
+      build(rebuilt, 0, 0, root, new_total, subtree, 1);
+      nodes.swap(rebuilt);
+      total = new_total;
+    }
+    reset_building();
+  }
+
+  uint32_t sample_count() const { return samples.load(std::memory_order_relaxed); }
+
+ private:
+  static int quadrant(double &u, double &v) {
+    int q = 0;
+    u *= 2.0;
+    v *= 2.0;
+    if (u >= 1.0) {
+      u -= 1.0;
+      q |= 1;
+    }
+    if (v >= 1.0) {
+      v -= 1.0;
+      q |= 2;
+    }
+    return q;
+  }
+
+  /// 学習用の和を部分木についてまとめる
+  double building_sum(int node, int q, std::vector<double> &subtree) const {
+    int c = nodes[node].child[q];
+    double s = 0.0;
+    if (c < 0) {
+      s = building[node * 4 + q].load(std::memory_order_relaxed);
+    } else {
+      for (int k = 0; k < 4; ++k) {
+        s += building_sum(c, k, subtree);
+      }
+    }
+    subtree[node * 4 + q] = s;
+    return s;
+  }
+
+  /// old_node: 同じ領域に対応する古いノード(無ければ-1、子のエネルギーは等分とみなす)
+  void build(std::vector<quad_node> &out, int index, int old_node, const double energy[4],
+             double all, const std::vector<double> &subtree, int depth) const {
+    for (int q = 0; q < 4; ++q) {
+      out[index].sum[q] = energy[q];
+      if (energy[q] <= GUIDING_SPLIT_FRACTION * all || depth >= GUIDING_MAX_DEPTH) continue;
+      int old_child = old_node >= 0 ? nodes[old_node].child[q] : -1;
+      double child_energy[4];
+      for (int k = 0; k < 4; ++k) {
+        child_energy[k] = old_child >= 0 ? subtree[old_child * 4 + k] : energy[q] * 0.25;
+      }
+      int c = int(out.size());
+      out.emplace_back();
+      out[index].child[q] = c;
+      build(out, c, old_child, child_energy, all, subtree, depth + 1);
+    }
+  }
+
+  void reset_building() {
+    building.reset(new std::atomic<double>[nodes.size() * 4]);
+    for (size_t i = 0; i < nodes.size() * 4; ++i) {
+      building[i].store(0.0, std::memory_order_relaxed);
+    }
+    samples.store(0, std::memory_order_relaxed);
+    gradient.store(0.0, std::memory_order_relaxed);
+    gradient_count.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+  std::vector<quad_node> nodes;
+  double total{0.0};
+  std::unique_ptr<std::atomic<double>[]> building;
+  std::atomic<uint32_t> samples{0};
+  // 選択確率のロジットと勾配
+  double theta{log(GUIDING_SAMPLE_FRACTION / (1.0 - GUIDING_SAMPLE_FRACTION))};
+  double moment{0.0};
+  std::atomic<double> gradient{0.0};
+  std::atomic<uint32_t> gradient_count{0};
+};
+
+/// D-treeに従う方向のpdf
+class guided_pdf : public pdf {
+ public:
+  explicit guided_pdf(const dtree *d) : tree(d) {}
+
+  double value(const vec3 &direction) const override {
+    return tree->pdf(direction);
+  }
+
+  vec3 generate() const override {
+    return tree->sample();
+  }
+
+ public:
+  const dtree *tree;
+};
+
+/// 空間の二分木 (S-tree) + 葉毎のD-tree (Müller et al. 2017)
+/// 描画中は構造を変えないので、記録はアトミック加算だけで描画スレッドを止めない
+class sd_tree {
+  struct spatial_node {
+    int axis{0};
+    int child[2]{-1, -1};
+    int leaf{-1};
+  };
+
+ public:
+  /// シーンの範囲で初期化
+  void reset(const aabb &box) {
+    bounds = box;
+    nodes.assign(1, spatial_node());
+    leaves.clear();
+    leaves.push_back(std::unique_ptr<dtree>(new dtree()));
+    nodes[0].leaf = 0;
+  }
+
+  /// 点pの学習済みD-tree(未学習ならnullptr)
+  dtree *guide(const point3 &p) const {
+    dtree *d = find(p);
+    return d != nullptr && d->trained() ? d : nullptr;
+  }
+
+  void record(const point3 &p, const vec3 &dir, double value) {
+    dtree *d = find(p);
+    if (d != nullptr) {
+      d->record(dir, value);
+    }
+  }
+
+  /// 1回の学習の終わり(フレーム毎に描画スレッドの外で呼ぶ)
+  /// 記録数の多い空間ノードを分割し、全D-treeを作り直す
+  void refine() {
+    if (nodes.empty()) {
+      return;
+    }
+    const size_t n = nodes.size();
+    for (size_t i = 0; i < n; ++i) {
+      if (nodes[i].leaf < 0 || leaves.size() >= GUIDING_MAX_SPATIAL_LEAVES) continue;
+      const auto &d = leaves[nodes[i].leaf];
+      if (d->sample_count() < GUIDING_SPATIAL_THRESHOLD) continue;
+      // 子は親のD-tree(学習中の記録を含めて作り直したもの)を引き継ぐ
+      d->refine();
+      int axis = nodes[i].axis;
+      for (int k = 0; k < 2; ++k) {
+        spatial_node c;
+        c.axis = (axis + 1) % 3;
+        if (k == 0) {
+          c.leaf = nodes[i].leaf;
+        } else {
+          c.leaf = int(leaves.size());
+          leaves.push_back(leaves[nodes[i].leaf]->clone());
+        }
+        nodes[i].child[k] = int(nodes.size());
+        nodes.push_back(c);
+      }
+      nodes[i].leaf = -1;
+    }
+    for (auto &d : leaves) {
+      d->refine();
+    }
+  }
+
+ private:
+  dtree *find(const point3 &p) const {
+    if (nodes.empty()) {
+      return nullptr;
+    }
+    vec3 lo = bounds.min(), hi = bounds.max();
+    int node = 0;
+    while (nodes[node].leaf < 0) {
+      const auto &n = nodes[node];
+      double mid = 0.5 * (lo[n.axis] + hi[n.axis]);
+      if (p[n.axis] < mid) {
+        hi[n.axis] = mid;
+        node = n.child[0];
+      } else {
+        lo[n.axis] = mid;
+        node = n.child[1];
+      }
+    }
+    return leaves[nodes[node].leaf].get();
+  }
+
+ private:
+  aabb bounds;
+  std::vector<spatial_node> nodes;
+  std::vector<std::unique_ptr<dtree>> leaves;
+};
+
+sd_tree RGB_PATH_GUIDE;
+sd_tree SPECTRAL_PATH_GUIDE;
+
+#endif //FLUORSWITCH_SRC_SAMPLING_SD_TREE_H_
@@ -0,0 +1,143 @@
+#ifndef FLUORSWITCH_SRC_SAMPLING_SPHERICAL_SAMPLING_H_
+#define FLUORSWITCH_SRC_SAMPLING_SPHERICAL_SAMPLING_H_
+
+#include "../utils/vec3.h"
+#include "../utils/util_funcs.h"
+#include "../utils/aabb.h"
+
+/// これより小さい立体角は数値誤差が大きいので、面積で一様にサンプリングする
+constexpr double MIN_SPHERICAL_SAMPLE_AREA = 3e-4;
+
+inline double safe_sqrt(double x) {
+  return sqrt(x > 0.0 ? x : 0.0);
+}
+
+inline double safe_asin(double x) {
+  return asin(clamp(x, -1.0, 1.0));
+}
+
+/// 2つの単位ベクトルのなす角(近い・反対向きでも精度が落ちない形)
+inline double angle_between(const vec3 &v1, const vec3 &v2) {
+  if (dot(v1, v2) < 0.0) {
+    return M_PI - 2.0 * safe_asin((v1 + v2).length() * 0.5);
+  }
+  return 2.0 * safe_asin((v2 - v1).length() * 0.5);
+}
+
+/// 点oから見た長方形(角s、辺ex, ey)の球面長方形 (Ureña et al. 2013)
+/// 立体角上で一様に長方形の点を返す
+class spherical_rectangle {
+ public:
+  spherical_rectangle(const point3 &origin, const point3 &s, const vec3 &ex, const vec3 &ey) : o(origin) {
+    double ex_len = ex.length();
+    double ey_len = ey.length();
+    x = ex / ex_len;
+    y = ey / ey_len;
+    z = cross(x, y);
+    // 長方形が負のz側になる座標系
+    vec3 d = s - o;
+    z0 = dot(d, z);
+    if (z0 > 0.0) {
+      z = -z;
+      z0 = -z0;
+    }
+    x0 = dot(d, x);
+    y0 = dot(d, y);
+    x1 = x0 + ex_len;
+    y1 = y0 + ey_len;
+    if (z0 > -1e-12) {
+      // 長方形の平面上では見えない
+      return;
+    }
+    // 4辺を通る平面の法線
+    vec3 n0 = unit_vector(vec3(0, z0, -y0));
+    vec3 n1 = unit_vector(vec3(-z0, 0, x1));
+    vec3 n2 = unit_vector(vec3(0, -z0, y1));
+    vec3 n3 = unit_vector(vec3(z0, 0, -x0));
+    // 内角
+    double g0 = acos(clamp(-dot(n0, n1), -1.0, 1.0));
+    double g1 = acos(clamp(-dot(n1, n2), -1.0, 1.0));
+    double g2 = acos(clamp(-dot(n2, n3), -1.0, 1.0));
+    double g3 = acos(clamp(-dot(n3, n0), -1.0, 1.0));
+    b0 = n0.z();
+    b1 = n2.z();
+    k = 2 * M_PI - g2 - g3;
+    solid_angle = ffmax(g0 + g1 - k, 0.0);
+  }
+
+  /// 立体角が MIN_SPHERICAL_SAMPLE_AREA 以上の場合だけ使う
+  point3 sample(double u, double v) const {
+    // 立体角がuの割合になるx
+    double au = u * solid_angle + k;
+    double fu = (cos(au) * b0 - b1) / sin(au);
+    double cu = clamp((fu > 0.0 ? 1.0 : -1.0) / sqrt(fu * fu + b0 * b0), -1.0, 1.0);
+    double xu = clamp(-(cu * z0) / ffmax(safe_sqrt(1.0 - cu * cu), 1e-12), x0, x1);
+    // xでの縦の線分上で立体角が一様になるy
+    double dd = xu * xu + z0 * z0;
+    double h0 = y0 / sqrt(dd + y0 * y0);
+    double h1 = y1 / sqrt(dd + y1 * y1);
+    double hv = h0 + v * (h1 - h0);
+    double hv2 = hv * hv;
+    double yv = hv2 < 1.0 - 1e-6 ? clamp(hv * sqrt(dd) / sqrt(1.0 - hv2), y0, y1) : y1;
+    return o + xu * x + yv * y + z0 * z;
+  }
+
+ public:
+  double solid_angle{0.0};
+
+ private:
+  point3 o;
+  vec3 x, y, z;
+  double x0, y0, x1, y1, z0;
+  double b0{0.0}, b1{0.0}, k{0.0};
+};
+
+/// 点oから見た三角形の球面三角形 (Arvo 1995)
+/// 立体角上で一様に方向を返す
+class spherical_triangle {
+ public:
+  spherical_triangle(const point3 &o, const point3 &p0, const point3 &p1, const point3 &p2)
+      : a(unit_vector(p0 - o)), b(unit_vector(p1 - o)), c(unit_vector(p2 - o)) {
+    vec3 n_ab = cross(a, b), n_bc = cross(b, c), n_ca = cross(c, a);
+    if (n_ab.squared_length() <= 0.0 || n_bc.squared_length() <= 0.0 || n_ca.squared_length() <= 0.0) {
+      return;
+    }
+    n_ab = unit_vector(n_ab);
+    n_bc = unit_vector(n_bc);
+    n_ca = unit_vector(n_ca);
+    // 頂点の角
+    alpha = angle_between(n_ab, -n_ca);
+    double beta = angle_between(n_bc, -n_ab);
+    double gamma = angle_between(n_ca, -n_bc);
+    solid_angle = ffmax(alpha + beta + gamma - M_PI, 0.0);
+  }
+
+  /// 立体角が MIN_SPHERICAL_SAMPLE_AREA 以上の場合だけ使う
+  vec3 sample(double u0, double u1) const {
+    // 面積がu0の割合になる部分三角形の頂点c'を求める
+    double area_pi = M_PI + u0 * solid_angle;
+    double cos_alpha = cos(alpha), sin_alpha = sin(alpha);
+    double sin_phi = sin(area_pi) * cos_alpha - cos(area_pi) * sin_alpha;
+    double cos_phi = cos(area_pi) * cos_alpha + sin(area_pi) * sin_alpha;
+    double k1 = cos_phi + cos_alpha;
+    double k2 = sin_phi - sin_alpha * dot(a, b);
+    double cos_bp = (k2 + (k2 * cos_phi - k1 * sin_phi) * cos_alpha) / ((k2 * sin_phi + k1 * cos_phi) * sin_alpha);
+    // NaNは頂点cとして扱う
+    cos_bp = cos_bp == cos_bp ? clamp(cos_bp, -1.0, 1.0) : dot(a, c);
+    double sin_bp = safe_sqrt(1.0 - cos_bp * cos_bp);
+    vec3 cp = cos_bp * a + sin_bp * unit_vector(c - dot(c, a) * a);
+    // 頂点bとc'を結ぶ弧の上で一様に
+    double cos_theta = 1.0 - u1 * (1.0 - dot(cp, b));
+    double sin_theta = safe_sqrt(1.0 - cos_theta * cos_theta);
+    return cos_theta * b + sin_theta * unit_vector(cp - dot(cp, b) * b);
+  }
+
+ public:
+  double solid_angle{0.0};
+
+ private:
+  vec3 a, b, c;
+  double alpha{0.0};
+};
+
+#endif //FLUORSWITCH_SRC_SAMPLING_SPHERICAL_SAMPLING_H_
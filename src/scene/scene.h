@@ -7,10 +7,21 @@
 #include "../objects/cornell_box.h"
 #include "../objects/sphere.h"
 #include "../objects/geometry.h"
+#include "../objects/environment_light.h"
 #include "../utils/hittable_list.h"
 #include "../utils/bvh.h"
+#include "../utils/light_bvh.h"
 #include "../utils/util_funcs.h"
 
+/// トップレベルのオブジェクトにIDを付ける
+/// シーンの構築順は毎フレーム同じなので、IDはフレーム間で一致する
+template<typename mat>
+inline void assign_object_ids(hittable_list<mat> &world) {
+  for (size_t i = 0; i < world.objects.size(); ++i) {
+    world.objects[i]->id = static_cast<int>(i) + 1;
+  }
+}
+
 // t = [0, 1]
 inline double spectral_sphere_x(double t) {
   return SPHERE_SPECTRAL_START_X * (1 - t) + SPHERE_SPECTRAL_END_X * t;
@@ -24,16 +35,26 @@ auto black_mat = make_shared<spectral_lambertian>(black_spectra);
 // NEED FIX
 auto fluo_mat = make_shared<fluorescent_material>(black_spectra);
 
-inline hittable_list<spectral_material> construct_spectral_scene(int frame, int max_frame) {
-  hittable_list<spectral_material> world;
-  /// アニメーションパラメータ
-  double move_t = (double) (frame - RGB_END_FRAME) / (double) (max_frame - RGB_END_FRAME); // [0, 1];
+/// UVライトの強度 [0, 1]
+inline double spectral_light_t(int frame) {
   double uv_t = 1.0;
   if (frame < UV_LIGHT_ON_FRAME) {
     uv_t = (double) (frame - RGB_END_FRAME) / (double) (UV_LIGHT_ON_FRAME - RGB_END_FRAME);
   }
+  return uv_t;
+}
+
+/// UVライト(フレーム毎の強度)
+inline shared_ptr<spectral_material> uv_light_material(int frame) {
+  return make_shared<spectral_diffuse_light>(uv_spectra * spectral_light_t(frame));
+}
+
+inline hittable_list<spectral_material> construct_spectral_scene(int frame, int max_frame) {
+  hittable_list<spectral_material> world;
+  /// アニメーションパラメータ
+  double move_t = (double) (frame - RGB_END_FRAME) / (double) (max_frame - RGB_END_FRAME); // [0, 1];
   double x_t = spectral_sphere_x(move_t);
-  auto uv_light_mat = make_shared<spectral_diffuse_light>(uv_spectra * uv_t);
+  auto uv_light_mat = uv_light_material(frame);
 
   /// コーネルボックス
   cornell_box<spectral_material> cb = cornell_box<spectral_material>(555, LIGHT_WIDTH, red_mat, red_mat, white_mat, white_mat, blue_mat, uv_light_mat);
@@ -42,14 +63,46 @@ inline hittable_list<spectral_material> construct_spectral_scene(int frame, int
   world.add(make_shared<sphere<spectral_material>>(vec3(x_t, SPHERE_RADIUS, SPHERE_Z), SPHERE_RADIUS, fluo_mat));
   /// 蛍光スイッチ
   world.add(make_shared<box<spectral_material>>(vec3(545, SPHERE_RADIUS - 10, SPHERE_Z - 50), vec3(555, SPHERE_RADIUS + 10, SPHERE_Z + 50), black_mat));
+  assign_object_ids(world);
   return world;
 }
 
-inline shared_ptr<hittable_list<spectral_material>> construct_spectral_light_sampler() {
-  auto lights = make_shared<hittable_list<spectral_material>>();
-  /// 光源サンプル用
-  lights->add(make_shared<xz_rect<spectral_material>>(202.5, 352.5, 202.5, 352.5, 554, shared_ptr<spectral_material>()));
+/// 光源のリストを光源BVHひとつにまとめる
+template<typename mat>
+inline shared_ptr<hittable_list<mat>> build_light_sampler(const shared_ptr<hittable_list<mat>> &lights) {
+#if USE_LIGHT_BVH
+  return make_shared<hittable_list<mat>>(make_shared<light_bvh<mat>>(*lights));
+#else
   return lights;
+#endif
+}
+
+/// 光源サンプル用(シーンの発光面と同じ形状・向き・フレームの発光、サンプルした点の発光をrec.mat_ptrで評価できる)
+inline shared_ptr<hittable_list<spectral_material>> construct_spectral_light_sampler(int frame) {
+  auto lights = make_shared<hittable_list<spectral_material>>();
+  lights->add(make_shared<flip_face<spectral_material>>(
+      make_shared<xz_rect<spectral_material>>(202.5, 352.5, 202.5, 352.5, 554, uv_light_material(frame))));
+  return build_light_sampler(lights);
+}
+
+/// 環境光(RGBフレームだけ、全フレームで同じ画像を共有する)
+/// ワールドと光源のリストに同じインスタンスを加える
+inline shared_ptr<environment_light<material>> rgb_environment() {
+#if USE_ENVIRONMENT_LIGHT
+  static shared_ptr<environment_light<material>> env = [] {
+    auto map = make_shared<environment_map>(ENVIRONMENT_MAP, ENVIRONMENT_SCALE);
+    if (!map->valid()) {
+      return shared_ptr<environment_light<material>>();
+    }
+    // コーネルボックスの中心
+    point3 center(277.5, 277.5, 277.5);
+    return make_shared<environment_light<material>>(map, center, ENVIRONMENT_RADIUS,
+                                                    make_shared<environment_emitter>(map));
+  }();
+  return env;
+#else
+  return nullptr;
+#endif
 }
 
 /// マテリアル設定
@@ -67,13 +120,28 @@ inline double rgb_sphere_x(double t, bool light_on) {
   }
 }
 
+/// 光源の強度 [1, 0]
+inline double rgb_light_t(int frame, int max_frame) {
+  double light_t = 1;
+  if (RGB_LIGHT_OFF_FRAME <= frame) {
+    double move_t = (double) (frame - RGB_LIGHT_OFF_FRAME) / (double) (max_frame - RGB_LIGHT_OFF_FRAME); // [0, 1]
+    light_t = ffmax((1 - move_t), 0.06);
+    light_t = light_t * light_t * light_t * light_t * light_t; // [1, 0] easeInQuint
+  }
+  return light_t;
+}
+
+/// 光源(フレーム毎の強度)
+inline shared_ptr<material> rgb_light_material(int frame, int max_frame) {
+  return make_shared<diffuse_light>(D65_LIGHT * rgb_light_t(frame, max_frame));
+}
+
 inline hittable_list<material> construct_scene(int frame, int max_frame) {
   /// シーンデータ
   hittable_list<material> world;
 
   /// アニメーションパラメータ
   double move_t = 0;
-  double light_t = 1;
   bool light_on = true;
   /// 移動する球
   if (RGB_STOP_FRAME < frame && frame < RGB_LIGHT_OFF_FRAME) {
@@ -81,12 +149,10 @@ inline hittable_list<material> construct_scene(int frame, int max_frame) {
   } else if (RGB_LIGHT_OFF_FRAME <= frame) {
     light_on = false;
     move_t = (double) (frame - RGB_LIGHT_OFF_FRAME) / (double) (max_frame - RGB_LIGHT_OFF_FRAME); // [0, 1]
-    light_t = ffmax((1 - move_t), 0.06);
-    light_t = light_t * light_t * light_t * light_t * light_t; // [1, 0] easeInQuint
   }
 
   /// 光源設定
-  auto rgb_light_mat = make_shared<diffuse_light>(D65_LIGHT * light_t);
+  auto rgb_light_mat = rgb_light_material(frame, max_frame);
   cornell_box<material> cb = cornell_box<material>(555, LIGHT_WIDTH, rgb_red_mat, rgb_red_mat, rgb_white_mat, rgb_white_mat, rgb_blue_mat, rgb_light_mat);
   world.add(make_shared<hittable_list<material>>(cb));
 
@@ -94,14 +160,23 @@ inline hittable_list<material> construct_scene(int frame, int max_frame) {
   world.add(make_shared<sphere<material>>(vec3(x_t, SPHERE_RADIUS, SPHERE_Z), SPHERE_RADIUS, rgb_black_mat));
   /// 蛍光スイッチ
   world.add(make_shared<box<material>>(vec3(545, SPHERE_RADIUS - 10, SPHERE_Z - 50), vec3(555, SPHERE_RADIUS + 10, SPHERE_Z + 50), rgb_black_mat));
+  /// 環境光
+  if (auto env = rgb_environment()) {
+    world.add(env);
+  }
+  assign_object_ids(world);
   return world;
 }
 
-inline shared_ptr<hittable_list<material>> construct_light_sampler() {
+/// 光源サンプル用(シーンの発光面と同じ形状・向き・フレームの発光、サンプルした点の発光をrec.mat_ptrで評価できる)
+inline shared_ptr<hittable_list<material>> construct_light_sampler(int frame, int max_frame) {
   auto lights = make_shared<hittable_list<material>>();
-  /// 光源サンプル用
-  lights->add(make_shared<xz_rect<material>>(202.5, 352.5, 202.5, 352.5, 554, shared_ptr<material>()));
-  return lights;
+  lights->add(make_shared<flip_face<material>>(
+      make_shared<xz_rect<material>>(202.5, 352.5, 202.5, 352.5, 554, rgb_light_material(frame, max_frame))));
+  if (auto env = rgb_environment()) {
+    lights->add(env);
+  }
+  return build_light_sampler(lights);
 }
 
 /// OBJモデル用
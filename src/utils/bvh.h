@@ -1,10 +1,798 @@
 #ifndef FLUORSWITCH_SRC_UTILS_BVH_H_
 #define FLUORSWITCH_SRC_UTILS_BVH_H_
 
+#include <omp.h>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <vector>
 #include "hittable.h"
 #include "hittable_list.h"
-#include "../objects/geometry.h"
+
+// 木の深さの上限(辿るときのスタックの段数 - 1)
+constexpr int BVH_MAX_DEPTH = 63;
+
+/// 構築用の要素(範囲と重心は最初に一度だけ計算する)
+struct bvh_build_item {
+  aabb box;
+  point3 centroid;
+  size_t index;
+};
+
+/// 表面積
+inline double surface_area(const aabb &box) {
+  vec3 d = box.max() - box.min();
+  return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+/// 木の品質
+struct bvh_stats {
+  // SAHコスト(根の表面積で正規化した、ランダムなレイ1本あたりの期待コスト)
+  double sah_cost{0.0};
+  size_t interior_nodes{0};
+  size_t leaves{0};
+  size_t primitives{0};
+  int max_depth{0};
+  // 葉の深さの合計
+  size_t leaf_depth_sum{0};
+  // 葉のプリミティブ数毎の葉の数
+  std::vector<size_t> leaf_sizes = std::vector<size_t>(BVH_MAX_LEAF_SIZE + 1, 0);
+  // 構築にかかった時間(秒)と使ったスレッド数
+  double build_seconds{0.0};
+  int build_threads{1};
+
+  double average_leaf_depth() const {
+    return leaves > 0 ? double(leaf_depth_sum) / double(leaves) : 0.0;
+  }
+  double average_leaf_size() const {
+    return leaves > 0 ? double(primitives) / double(leaves) : 0.0;
+  }
+
+  void add_leaf(const aabb &b, size_t count, int depth) {
+    ++leaves;
+    primitives += count;
+    max_depth = std::max(max_depth, depth);
+    leaf_depth_sum += size_t(depth);
+    sah_cost += surface_area(b) * double(count);
+    if (count < leaf_sizes.size()) {
+      ++leaf_sizes[count];
+    }
+  }
+
+  /// 別のタスクで作った部分木の品質を加える
+  void merge(const bvh_stats &s) {
+    sah_cost += s.sah_cost;
+    interior_nodes += s.interior_nodes;
+    leaves += s.leaves;
+    primitives += s.primitives;
+    max_depth = std::max(max_depth, s.max_depth);
+    leaf_depth_sum += s.leaf_depth_sum;
+    for (size_t k = 0; k < leaf_sizes.size() && k < s.leaf_sizes.size(); ++k) {
+      leaf_sizes[k] += s.leaf_sizes[k];
+    }
+  }
+};
+
+inline void print_bvh_stats(std::ostream &out, const bvh_stats &s) {
+  out << "BVH: " << s.primitives << " primitives, " << s.interior_nodes << " interior nodes, "
+      << s.leaves << " leaves" << std::endl;
+  out << "  build: " << s.build_seconds * 1000.0 << " ms (" << (BVH_BUILDER == 1 ? "LBVH" : "binned SAH")
+      << ", " << s.build_threads << " threads)" << std::endl;
+  out << "  SAH cost: " << s.sah_cost << std::endl;
+  out << "  depth: max " << s.max_depth << ", average leaf " << s.average_leaf_depth() << std::endl;
+  out << "  leaf size: average " << s.average_leaf_size() << " (";
+  for (size_t k = 1; k < s.leaf_sizes.size(); ++k) {
+    out << (k > 1 ? ", " : "") << k << ": " << s.leaf_sizes[k];
+  }
+  out << ")" << std::endl;
+}
+
+/// 構築に使うスレッド数
+inline int bvh_build_threads() {
+  return BVH_BUILD_THREADS > 0 ? BVH_BUILD_THREADS : omp_get_max_threads();
+}
+
+/// n個の要素を分ける塊の数(BVH_PARALLEL_MIN_SIZE個より小さくはしない)
+inline int bvh_chunk_count(size_t n) {
+  size_t threads = size_t(omp_get_num_threads());
+  return int(std::max<size_t>(1, std::min<size_t>(n / BVH_PARALLEL_MIN_SIZE, 4 * threads)));
+}
+
+/// [start, end)をchunks個の塊に分け、f(塊の番号, 先頭, 末尾)をタスクで並列に呼んで終わるのを待つ
+/// 構築の並列領域の中(タスクの中)から呼ぶ
+template<typename F>
+inline void bvh_for_chunks(size_t start, size_t end, int chunks, F &&f) {
+  const size_t n = end - start;
+  for (int c = 0; c < chunks; ++c) {
+    size_t b = start + n * size_t(c) / size_t(chunks);
+    size_t e = start + n * size_t(c + 1) / size_t(chunks);
+    #pragma omp task default(shared) firstprivate(c, b, e) if(chunks > 1)
+    f(c, b, e);
+  }
+  #pragma omp taskwait
+}
+
+/// items[start, end)の範囲と重心の範囲
+inline void bvh_bounds(const std::vector<bvh_build_item> &items, size_t start, size_t end,
+                       aabb &bounds, aabb &centroids) {
+  auto range = [&](size_t b, size_t e, aabb &bb, aabb &cb) {
+    bb = items[b].box;
+    cb = aabb(items[b].centroid, items[b].centroid);
+    for (size_t i = b + 1; i < e; ++i) {
+      bb = surrounding_box(bb, items[i].box);
+      cb = surrounding_box(cb, aabb(items[i].centroid, items[i].centroid));
+    }
+  };
+  const int chunks = bvh_chunk_count(end - start);
+  if (chunks == 1) {
+    range(start, end, bounds, centroids);
+    return;
+  }
+  std::vector<aabb> chunk_bounds(chunks), chunk_centroids(chunks);
+  bvh_for_chunks(start, end, chunks, [&](int c, size_t b, size_t e) {
+    range(b, e, chunk_bounds[c], chunk_centroids[c]);
+  });
+  bounds = chunk_bounds[0];
+  centroids = chunk_centroids[0];
+  for (int c = 1; c < chunks; ++c) {
+    bounds = surrounding_box(bounds, chunk_bounds[c]);
+    centroids = surrounding_box(centroids, chunk_centroids[c]);
+  }
+}
+
+/// 重心の軸axisでのビンの番号
+inline int bvh_bin_index(const bvh_build_item &item, int axis, double lo, double scale) {
+  return std::min(int((item.centroid[axis] - lo) * scale), BVH_BINS - 1);
+}
+
+/// 軸毎のビン(範囲とプリミティブ数)
+struct bvh_bins {
+  aabb box[3][BVH_BINS];
+  size_t count[3][BVH_BINS] = {};
+
+  void add(int axis, int b, const aabb &item_box) {
+    box[axis][b] = count[axis][b] == 0 ? item_box : surrounding_box(box[axis][b], item_box);
+    ++count[axis][b];
+  }
+
+  /// 別の塊で数えたビンを加える(範囲の和なので加える順で結果は変わらない)
+  void merge(const bvh_bins &o) {
+    for (int axis = 0; axis < 3; ++axis) {
+      for (int b = 0; b < BVH_BINS; ++b) {
+        if (o.count[axis][b] == 0) continue;
+        box[axis][b] = count[axis][b] == 0 ? o.box[axis][b] : surrounding_box(box[axis][b], o.box[axis][b]);
+        count[axis][b] += o.count[axis][b];
+      }
+    }
+  }
+};
+
+/// items[start, end)の重心を軸毎にBVH_BINS個のビンに分け、SAHが最小の境界を探す
+/// 見つかれば分割のコスト(プリミティブとの交差判定を1とする)、分けられなければINFを返す
+/// 大きな範囲は塊毎のビンをタスクで並列に数えてからまとめる
+inline double bvh_find_split(const std::vector<bvh_build_item> &items, size_t start, size_t end,
+                             const aabb &box, const aabb &centroids, int &best_axis, int &best_bin) {
+  const double area = surface_area(box);
+  double best_cost = INF;
+  best_axis = -1;
+  best_bin = 0;
+  if (end - start < 2 || area <= 0.0) {
+    return best_cost;
+  }
+  double lo[3], scale[3];
+  bool valid[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    lo[axis] = centroids.min()[axis];
+    double hi = centroids.max()[axis];
+    valid[axis] = hi > lo[axis];
+    scale[axis] = valid[axis] ? BVH_BINS / (hi - lo[axis]) : 0.0;
+  }
+  auto fill = [&](size_t b, size_t e, bvh_bins &bins) {
+    for (int axis = 0; axis < 3; ++axis) {
+      if (!valid[axis]) continue;
+      for (size_t i = b; i < e; ++i) {
+        bins.add(axis, bvh_bin_index(items[i], axis, lo[axis], scale[axis]), items[i].box);
+      }
+    }
+  };
+  bvh_bins bins;
+  const int chunks = bvh_chunk_count(end - start);
+  if (chunks == 1) {
+    fill(start, end, bins);
+  } else {
+    std::vector<bvh_bins> chunk_bins(chunks);
+    bvh_for_chunks(start, end, chunks, [&](int c, size_t b, size_t e) {
+      fill(b, e, chunk_bins[c]);
+    });
+    for (int c = 0; c < chunks; ++c) {
+      bins.merge(chunk_bins[c]);
+    }
+  }
+  for (int axis = 0; axis < 3; ++axis) {
+    if (!valid[axis]) continue;
+    const aabb *bin_box = bins.box[axis];
+    const size_t *bin_count = bins.count[axis];
+    // 右側(境界より後ろのビン)の表面積と個数
+    double right_area[BVH_BINS];
+    size_t right_count[BVH_BINS];
+    aabb acc;
+    size_t count = 0;
+    for (int b = BVH_BINS - 1; b > 0; --b) {
+      if (bin_count[b] > 0) {
+        acc = count == 0 ? bin_box[b] : surrounding_box(acc, bin_box[b]);
+        count += bin_count[b];
+      }
+      right_area[b - 1] = count > 0 ? surface_area(acc) : 0.0;
+      right_count[b - 1] = count;
+    }
+    count = 0;
+    for (int b = 0; b < BVH_BINS - 1; ++b) {
+      if (bin_count[b] > 0) {
+        acc = count == 0 ? bin_box[b] : surrounding_box(acc, bin_box[b]);
+        count += bin_count[b];
+      }
+      if (count == 0 || right_count[b] == 0) continue;
+      double cost = BVH_TRAVERSAL_COST
+          + (surface_area(acc) * double(count) + right_area[b] * double(right_count[b])) / area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+  return best_cost;
+}
+
+/// 深さ優先の順に並べたBVHのノード(32バイト)
+/// 左の子は直後のノードなので、内部ノードは右の子の番号だけを持つ
+struct alignas(32) linear_bvh_node {
+  // [0]: 最小, [1]: 最大 (floatへ外側に丸める)
+  float bounds[2][3];
+  // 葉: primsの先頭, 内部ノード: 右の子の番号
+  uint32_t offset;
+  // 葉のプリミティブ数(0なら内部ノード)
+  uint16_t count;
+  // 分割した軸
+  uint8_t axis;
+  uint8_t pad;
+};
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must be 32 bytes");
+
+/// 方向の逆数と符号を前もって計算したレイ(ノード毎の割り算をなくす)
+struct bvh_ray {
+  explicit bvh_ray(const ray &r) : origin(r.origin()) {
+    for (int i = 0; i < 3; ++i) {
+      inv_dir[i] = 1.0 / r.direction()[i];
+      neg[i] = inv_dir[i] < 0.0 ? 1 : 0;
+    }
+  }
+
+  /// ノードの範囲との交差
+  /// 厚みのない範囲(軸に平行な三角形の葉)でt0 == t1になるので、aabb::hitと違って等しい場合は当たりにする
+  inline bool hit(const linear_bvh_node &n, double t_min, double t_max) const {
+    for (int i = 0; i < 3; ++i) {
+      double t0 = (n.bounds[neg[i]][i] - origin[i]) * inv_dir[i];
+      double t1 = (n.bounds[1 - neg[i]][i] - origin[i]) * inv_dir[i];
+      t_min = ffmax(t0, t_min);
+      t_max = ffmin(t1, t_max);
+      if (t_max < t_min) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  point3 origin;
+  double inv_dir[3];
+  int neg[3];
+};
+
+/// 子をW個まで持つBVHのノード(2分木を畳んで作る)
+/// 子の範囲を軸毎にW個並べ(SoA)、全部の子とのスラブ判定をひとつのSIMDのループで行う
+template<int W>
+struct alignas(64) wide_bvh_node {
+  // 子の範囲(空きの子は lo = +inf, hi = -inf で当たらない)
+  float lo[3][W];
+  float hi[3][W];
+  // 内部ノード: 子ノードの番号, 葉: primsの先頭
+  uint32_t child[W];
+  // 葉のプリミティブ数(0なら内部ノード)
+  uint16_t count[W];
+};
+
+/// floatで辿るためのレイ
+/// 原点の丸め誤差を範囲の近い面は遠くに、遠い面は近くに寄せて吸収し、当たるべき子を落とさないようにする
+struct wide_bvh_ray {
+  explicit wide_bvh_ray(const ray &r, float scene_extent) {
+    for (int i = 0; i < 3; ++i) {
+      double d = r.direction()[i];
+      double o = r.origin()[i];
+      neg[i] = d < 0.0 ? 1 : 0;
+      inv_dir[i] = float(1.0 / d);
+      float slack = float((fabs(o) + scene_extent) * 0x1p-21);
+      near_origin[i] = float(o) + (neg[i] ? -slack : slack);
+      far_origin[i] = float(o) - (neg[i] ? -slack : slack);
+    }
+  }
+
+  float near_origin[3];
+  float far_origin[3];
+  float inv_dir[3];
+  int neg[3];
+};
+
+template<int W>
+class wide_bvh {
+ public:
+  /// 2分木を畳む(子の中で表面積の最も大きい内部ノードを開いてW個まで増やす)
+  void collapse(const std::vector<linear_bvh_node> &binary) {
+    nodes.clear();
+    extent = 0.0f;
+    if (binary.empty()) {
+      return;
+    }
+    for (int i = 0; i < 3; ++i) {
+      extent = std::max(extent, std::max(fabsf(binary[0].bounds[0][i]), fabsf(binary[0].bounds[1][i])));
+    }
+    collapse(binary, 0);
+  }
+
+  /// [t_min, t_max]で当たる葉を近い順に辿り、leaf(offset, count, t_max)を呼ぶ
+  /// leafは当たればtrueを返してt_maxを縮める。any_hitなら最初に当たった時点で終える
+  template<typename F>
+  bool traverse(const ray &r, double t_min, double t_max, bool any_hit, F &&leaf) const {
+    if (nodes.empty()) {
+      return false;
+    }
+    const wide_bvh_ray wr(r, extent);
+    struct entry {
+      uint32_t child;
+      uint16_t count;
+      float t;
+    };
+    entry stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = entry{0, 0, -std::numeric_limits<float>::infinity()};
+    bool hit_anything = false;
+    float tf_max = round_up(t_max);
+    const float tf_min = round_down(t_min);
+    while (top > 0) {
+      const entry e = stack[--top];
+      // 積んだ後に近くで当たっていれば飛ばす
+      if (e.t > tf_max) continue;
+      if (e.count > 0) {
+        if (leaf(e.child, e.count, t_max)) {
+          hit_anything = true;
+          if (any_hit) return true;
+          tf_max = round_up(t_max);
+        }
+        continue;
+      }
+      const wide_bvh_node<W> &n = nodes[e.child];
+      float t_near[W];
+      int hit[W];
+      hit_lanes(n, wr, tf_min, tf_max, t_near, hit);
+      // 当たった子を遠い順に積む(近い子が先に取り出される)
+      entry found[W];
+      int m = 0;
+      for (int k = 0; k < W; ++k) {
+        if (!hit[k]) continue;
+        entry c{n.child[k], n.count[k], t_near[k]};
+        int j = m++;
+        while (j > 0 && found[j - 1].t < c.t) {
+          found[j] = found[j - 1];
+          --j;
+        }
+        found[j] = c;
+      }
+      for (int k = 0; k < m; ++k) {
+        stack[top++] = found[k];
+      }
+    }
+    return hit_anything;
+  }
+
+  size_t node_count() const {
+    return nodes.size();
+  }
+
+ private:
+  /// 全部の子とのスラブ判定(t_near: 入る距離, hit: 当たったか)
+  static inline void hit_lanes(const wide_bvh_node<W> &n, const wide_bvh_ray &wr, float t_min, float t_max,
+                               float *t_near, int *hit) {
+    const float *near_x = wr.neg[0] ? n.hi[0] : n.lo[0], *far_x = wr.neg[0] ? n.lo[0] : n.hi[0];
+    const float *near_y = wr.neg[1] ? n.hi[1] : n.lo[1], *far_y = wr.neg[1] ? n.lo[1] : n.hi[1];
+    const float *near_z = wr.neg[2] ? n.hi[2] : n.lo[2], *far_z = wr.neg[2] ? n.lo[2] : n.hi[2];
+    // 掛け算の丸め誤差の分だけ区間を広げる
+    const float grow = 1.0f + 0x1p-21f, shrink = 1.0f - 0x1p-21f;
+#pragma omp simd
+    for (int k = 0; k < W; ++k) {
+      float t0 = (near_x[k] - wr.near_origin[0]) * wr.inv_dir[0] * shrink;
+      float t1 = (far_x[k] - wr.far_origin[0]) * wr.inv_dir[0] * grow;
+      // NaN(面上の原点と軸に平行な方向)は比較が偽になるので無視される
+      float tn = t0 > t_min ? t0 : t_min;
+      float tf = t1 < t_max ? t1 : t_max;
+      t0 = (near_y[k] - wr.near_origin[1]) * wr.inv_dir[1] * shrink;
+      t1 = (far_y[k] - wr.far_origin[1]) * wr.inv_dir[1] * grow;
+      tn = t0 > tn ? t0 : tn;
+      tf = t1 < tf ? t1 : tf;
+      t0 = (near_z[k] - wr.near_origin[2]) * wr.inv_dir[2] * shrink;
+      t1 = (far_z[k] - wr.far_origin[2]) * wr.inv_dir[2] * grow;
+      tn = t0 > tn ? t0 : tn;
+      tf = t1 < tf ? t1 : tf;
+      t_near[k] = tn;
+      hit[k] = tn <= tf ? 1 : 0;
+    }
+  }
+
+  uint32_t collapse(const std::vector<linear_bvh_node> &binary, uint32_t k) {
+    auto w = uint32_t(nodes.size());
+    nodes.emplace_back();
+    uint32_t kids[W];
+    int m = 0;
+    if (binary[k].count > 0) {
+      kids[m++] = k;
+    } else {
+      kids[m++] = k + 1;
+      kids[m++] = binary[k].offset;
+    }
+    while (m < W) {
+      int open = -1;
+      float best_area = -1.0f;
+      for (int i = 0; i < m; ++i) {
+        const linear_bvh_node &c = binary[kids[i]];
+        if (c.count > 0) continue;
+        float a = area(c);
+        if (a > best_area) {
+          best_area = a;
+          open = i;
+        }
+      }
+      if (open < 0) break;
+      uint32_t c = kids[open];
+      kids[open] = c + 1;
+      kids[m++] = binary[c].offset;
+    }
+    wide_bvh_node<W> n{};
+    for (int i = 0; i < W; ++i) {
+      for (int a = 0; a < 3; ++a) {
+        n.lo[a][i] = i < m ? binary[kids[i]].bounds[0][a] : std::numeric_limits<float>::infinity();
+        n.hi[a][i] = i < m ? binary[kids[i]].bounds[1][a] : -std::numeric_limits<float>::infinity();
+      }
+      n.child[i] = 0;
+      n.count[i] = 0;
+    }
+    for (int i = 0; i < m; ++i) {
+      const linear_bvh_node &c = binary[kids[i]];
+      if (c.count > 0) {
+        n.child[i] = c.offset;
+        n.count[i] = c.count;
+      } else {
+        n.child[i] = collapse(binary, kids[i]);
+      }
+    }
+    nodes[w] = n;
+    return w;
+  }
+
+  static float area(const linear_bvh_node &n) {
+    float dx = n.bounds[1][0] - n.bounds[0][0];
+    float dy = n.bounds[1][1] - n.bounds[0][1];
+    float dz = n.bounds[1][2] - n.bounds[0][2];
+    return dx * dy + dy * dz + dz * dx;
+  }
+
+  static float round_up(double t) {
+    float f = float(t);
+    return double(f) < t ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+  }
+
+  static float round_down(double t) {
+    float f = float(t);
+    return double(f) > t ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+  }
+
+  // 2分木の深さの上限64で、1段にW - 1個ずつ積み残す
+  static constexpr int STACK_SIZE = 64 * (W - 1) + 1;
+
+  std::vector<wide_bvh_node<W>> nodes;
+  // 根の座標の絶対値の最大(原点の丸め誤差の見積もりに使う)
+  float extent{0.0f};
+};
+
+/// 範囲のノード(floatにしても元の範囲を含むように外側へ丸める)
+inline linear_bvh_node bvh_make_node(const aabb &b) {
+  linear_bvh_node n{};
+  for (int i = 0; i < 3; ++i) {
+    float lo = float(b.min()[i]), hi = float(b.max()[i]);
+    if (double(lo) > b.min()[i]) lo = std::nextafter(lo, -std::numeric_limits<float>::infinity());
+    if (double(hi) < b.max()[i]) hi = std::nextafter(hi, std::numeric_limits<float>::infinity());
+    n.bounds[0][i] = lo;
+    n.bounds[1][i] = hi;
+  }
+  return n;
+}
+
+/// 構築中の部分木
+/// 大きな範囲は分割だけを決めて子を別のタスクで作り(children)、小さな範囲は1つのタスクで深さ優先の配列に並べる(nodes)
+/// 葉のoffsetは並べ替えたitemsでの位置、nodesの内部ノードのoffsetはnodesでの番号
+struct bvh_subtree {
+  aabb box;
+  // 子を持つ場合の分割したノード
+  linear_bvh_node node{};
+  std::unique_ptr<bvh_subtree> children[2];
+  std::vector<linear_bvh_node> nodes;
+  bvh_stats stats;
+};
+
+/// 部分木を深さ優先の順につなげる(右の子の番号をずらす)
+inline void bvh_flatten(const bvh_subtree &t, std::vector<linear_bvh_node> &nodes, bvh_stats &stats) {
+  stats.merge(t.stats);
+  if (t.children[0]) {
+    auto k = nodes.size();
+    nodes.push_back(t.node);
+    bvh_flatten(*t.children[0], nodes, stats);
+    nodes[k].offset = uint32_t(nodes.size());
+    bvh_flatten(*t.children[1], nodes, stats);
+    return;
+  }
+  auto base = uint32_t(nodes.size());
+  for (linear_bvh_node n : t.nodes) {
+    if (n.count == 0) n.offset += base;
+    nodes.push_back(n);
+  }
+}
+
+/// 最も長い軸
+inline int bvh_longest_axis(const aabb &b) {
+  vec3 extent = b.max() - b.min();
+  return extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+}
+
+/// 分けるより交差判定を全部した方が安ければ葉にする
+inline bool bvh_is_leaf(size_t n, double split_cost, int depth) {
+  return n == 1 || (n <= BVH_MAX_LEAF_SIZE && double(n) <= split_cost) || depth >= BVH_MAX_DEPTH;
+}
+
+/// 見つけた分割でitems[start, end)を並べ替え、境界の位置を返す(重心が分けられなければ半分に分ける)
+inline size_t bvh_partition(std::vector<bvh_build_item> &items, size_t start, size_t end,
+                            const aabb &centroids, int &best_axis, int best_bin) {
+  if (best_axis < 0) {
+    best_axis = bvh_longest_axis(centroids);
+    return start + (end - start) / 2;
+  }
+  double lo = centroids.min()[best_axis], hi = centroids.max()[best_axis];
+  double scale = BVH_BINS / (hi - lo);
+  auto it = std::partition(items.begin() + start, items.begin() + end, [&](const bvh_build_item &item) {
+    return bvh_bin_index(item, best_axis, lo, scale) <= best_bin;
+  });
+  return size_t(it - items.begin());
+}
+
+/// items[start, end)からSAHでノードを作ってout.nodesへ深さ優先に並べ、その番号を返す
+inline uint32_t bvh_build_sah_serial(std::vector<bvh_build_item> &items, size_t start, size_t end, int depth,
+                                     bvh_subtree &out) {
+  const size_t n = end - start;
+  aabb bounds, centroids;
+  bvh_bounds(items, start, end, bounds, centroids);
+  auto k = uint32_t(out.nodes.size());
+  out.nodes.push_back(bvh_make_node(bounds));
+  if (k == 0) {
+    out.box = bounds;
+  }
+  int best_axis, best_bin;
+  double best_cost = bvh_find_split(items, start, end, bounds, centroids, best_axis, best_bin);
+  if (bvh_is_leaf(n, best_cost, depth)) {
+    out.nodes[k].offset = uint32_t(start);
+    out.nodes[k].count = uint16_t(n);
+    out.stats.add_leaf(bounds, n, depth);
+    return k;
+  }
+  size_t mid = bvh_partition(items, start, end, centroids, best_axis, best_bin);
+  ++out.stats.interior_nodes;
+  out.stats.sah_cost += BVH_TRAVERSAL_COST * surface_area(bounds);
+  bvh_build_sah_serial(items, start, mid, depth + 1, out);
+  uint32_t right = bvh_build_sah_serial(items, mid, end, depth + 1, out);
+  out.nodes[k].offset = right;
+  out.nodes[k].axis = uint8_t(best_axis);
+  return k;
+}
+
+/// items[start, end)の部分木をSAHで作る
+/// BVH_PARALLEL_MIN_SIZEより大きな範囲はビン分けを塊に分担し、左の子を別のタスクで作る
+inline void bvh_build_sah(std::vector<bvh_build_item> &items, size_t start, size_t end, int depth, bvh_subtree &out) {
+  const size_t n = end - start;
+  if (n <= BVH_PARALLEL_MIN_SIZE) {
+    bvh_build_sah_serial(items, start, end, depth, out);
+    return;
+  }
+  aabb bounds, centroids;
+  bvh_bounds(items, start, end, bounds, centroids);
+  int best_axis, best_bin;
+  double best_cost = bvh_find_split(items, start, end, bounds, centroids, best_axis, best_bin);
+  if (bvh_is_leaf(n, best_cost, depth)) {
+    bvh_build_sah_serial(items, start, end, depth, out);
+    return;
+  }
+  size_t mid = bvh_partition(items, start, end, centroids, best_axis, best_bin);
+  out.box = bounds;
+  out.node = bvh_make_node(bounds);
+  out.node.axis = uint8_t(best_axis);
+  out.stats.interior_nodes = 1;
+  out.stats.sah_cost = BVH_TRAVERSAL_COST * surface_area(bounds);
+  bvh_subtree *left = (out.children[0] = std::make_unique<bvh_subtree>()).get();
+  bvh_subtree *right = (out.children[1] = std::make_unique<bvh_subtree>()).get();
+  #pragma omp task default(shared) firstprivate(left, start, mid, depth)
+  bvh_build_sah(items, start, mid, depth + 1, *left);
+  bvh_build_sah(items, mid, end, depth + 1, *right);
+  #pragma omp taskwait
+}
+
+/// 10bitの値のビットの間に0を2つずつ挟む
+inline uint32_t bvh_expand_bits(uint32_t v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+/// [0, 1]^3の点の30bitのMorton符号(上位からx, y, zの順にビットを交互に並べる)
+inline uint32_t bvh_morton_code(const vec3 &p) {
+  auto quantize = [](double v) { return uint32_t(std::min(std::max(v * 1024.0, 0.0), 1023.0)); };
+  return (bvh_expand_bits(quantize(p.x())) << 2) | (bvh_expand_bits(quantize(p.y())) << 1)
+      | bvh_expand_bits(quantize(p.z()));
+}
+
+/// 上位32bitの値で安定に並べ替える(8bitずつの基数ソート、塊毎の数え上げと書き込みをタスクで分担する)
+inline void bvh_radix_sort(std::vector<uint64_t> &keys) {
+  const size_t n = keys.size();
+  const int chunks = bvh_chunk_count(n);
+  std::vector<uint64_t> tmp(n);
+  std::vector<std::array<size_t, 256>> offsets(chunks);
+  for (int shift = 32; shift < 64; shift += 8) {
+    bvh_for_chunks(0, n, chunks, [&](int c, size_t b, size_t e) {
+      offsets[c].fill(0);
+      for (size_t i = b; i < e; ++i) {
+        ++offsets[c][(keys[i] >> shift) & 0xFF];
+      }
+    });
+    // 桁の値毎に、前の塊の個数を足した書き込み先の先頭にする
+    size_t sum = 0;
+    for (int d = 0; d < 256; ++d) {
+      for (int c = 0; c < chunks; ++c) {
+        size_t count = offsets[c][d];
+        offsets[c][d] = sum;
+        sum += count;
+      }
+    }
+    bvh_for_chunks(0, n, chunks, [&](int c, size_t b, size_t e) {
+      for (size_t i = b; i < e; ++i) {
+        tmp[offsets[c][(keys[i] >> shift) & 0xFF]++] = keys[i];
+      }
+    });
+    keys.swap(tmp);
+  }
+}
+
+/// 並べた符号の[start, end)を、符号の異なる最上位のビットで分ける(全部同じ符号なら半分に分ける)
+/// axisはそのビットの軸(同じ符号なら-1)
+inline size_t bvh_morton_split(const std::vector<uint32_t> &codes, size_t start, size_t end, int &axis) {
+  uint32_t diff = codes[start] ^ codes[end - 1];
+  if (diff == 0) {
+    axis = -1;
+    return start + (end - start) / 2;
+  }
+  int bit = 31;
+  while (!(diff & (1u << bit))) --bit;
+  axis = 2 - bit % 3;
+  auto it = std::partition_point(codes.begin() + start, codes.begin() + end, [bit](uint32_t c) {
+    return (c & (1u << bit)) == 0;
+  });
+  return size_t(it - codes.begin());
+}
+
+/// Morton符号の順に並べたitems[start, end)からノードを作ってout.nodesへ深さ優先に並べ、その番号を返す
+/// 範囲は子から求めるので、ノードは子を作った後に埋める
+inline uint32_t bvh_build_morton_serial(const std::vector<bvh_build_item> &items, const std::vector<uint32_t> &codes,
+                                        size_t start, size_t end, int depth, bvh_subtree &out, aabb &bounds) {
+  const size_t n = end - start;
+  auto k = uint32_t(out.nodes.size());
+  out.nodes.emplace_back();
+  if (n <= BVH_MAX_LEAF_SIZE || depth >= BVH_MAX_DEPTH) {
+    bounds = items[start].box;
+    for (size_t i = start + 1; i < end; ++i) {
+      bounds = surrounding_box(bounds, items[i].box);
+    }
+    out.nodes[k] = bvh_make_node(bounds);
+    out.nodes[k].offset = uint32_t(start);
+    out.nodes[k].count = uint16_t(n);
+    out.stats.add_leaf(bounds, n, depth);
+    return k;
+  }
+  int axis;
+  size_t mid = bvh_morton_split(codes, start, end, axis);
+  aabb left_box, right_box;
+  bvh_build_morton_serial(items, codes, start, mid, depth + 1, out, left_box);
+  uint32_t right = bvh_build_morton_serial(items, codes, mid, end, depth + 1, out, right_box);
+  bounds = surrounding_box(left_box, right_box);
+  out.nodes[k] = bvh_make_node(bounds);
+  out.nodes[k].offset = right;
+  out.nodes[k].axis = uint8_t(axis >= 0 ? axis : bvh_longest_axis(bounds));
+  ++out.stats.interior_nodes;
+  out.stats.sah_cost += BVH_TRAVERSAL_COST * surface_area(bounds);
+  return k;
+}
+
+/// Morton符号の順に並べたitems[start, end)の部分木を作る(BVH_PARALLEL_MIN_SIZEより大きな範囲は左の子を別のタスクで作る)
+inline void bvh_build_morton(const std::vector<bvh_build_item> &items, const std::vector<uint32_t> &codes,
+                             size_t start, size_t end, int depth, bvh_subtree &out) {
+  if (end - start <= BVH_PARALLEL_MIN_SIZE || depth >= BVH_MAX_DEPTH) {
+    bvh_build_morton_serial(items, codes, start, end, depth, out, out.box);
+    return;
+  }
+  int axis;
+  size_t mid = bvh_morton_split(codes, start, end, axis);
+  bvh_subtree *left = (out.children[0] = std::make_unique<bvh_subtree>()).get();
+  bvh_subtree *right = (out.children[1] = std::make_unique<bvh_subtree>()).get();
+  #pragma omp task default(shared) firstprivate(left, start, mid, depth)
+  bvh_build_morton(items, codes, start, mid, depth + 1, *left);
+  bvh_build_morton(items, codes, mid, end, depth + 1, *right);
+  #pragma omp taskwait
+  out.box = surrounding_box(left->box, right->box);
+  out.node = bvh_make_node(out.box);
+  out.node.axis = uint8_t(axis >= 0 ? axis : bvh_longest_axis(out.box));
+  out.stats.interior_nodes = 1;
+  out.stats.sah_cost = BVH_TRAVERSAL_COST * surface_area(out.box);
+}
+
+/// 重心のMorton符号でitemsを並べ替え、符号のビットで上から分けるLBVH
+/// 分割を探さないのでSAHより速く作れるが、木の品質(SAHコスト)は落ちる
+inline void bvh_build_lbvh(std::vector<bvh_build_item> &items, bvh_subtree &out) {
+  const size_t n = items.size();
+  aabb bounds, centroids;
+  bvh_bounds(items, 0, n, bounds, centroids);
+  const vec3 lo = centroids.min();
+  vec3 scale = centroids.max() - centroids.min();
+  for (int a = 0; a < 3; ++a) {
+    scale[a] = scale[a] > 0.0 ? 1.0 / scale[a] : 0.0;
+  }
+  const int chunks = bvh_chunk_count(n);
+  // 上位32bitに符号、下位32bitに元の位置を入れて並べる
+  std::vector<uint64_t> keys(n);
+  bvh_for_chunks(0, n, chunks, [&](int, size_t b, size_t e) {
+    for (size_t i = b; i < e; ++i) {
+      uint32_t code = bvh_morton_code((items[i].centroid - lo) * scale);
+      keys[i] = (uint64_t(code) << 32) | uint64_t(i);
+    }
+  });
+  bvh_radix_sort(keys);
+  std::vector<bvh_build_item> sorted(n);
+  std::vector<uint32_t> codes(n);
+  bvh_for_chunks(0, n, chunks, [&](int, size_t b, size_t e) {
+    for (size_t i = b; i < e; ++i) {
+      sorted[i] = items[keys[i] & 0xFFFFFFFFu];
+      codes[i] = uint32_t(keys[i] >> 32);
+    }
+  });
+  items.swap(sorted);
+  bvh_build_morton(items, codes, 0, n, 0, out);
+}
+
+/// 重心を軸毎にBVH_BINS個のビンに分け、SAHが最小の境界で分割するBVH
+/// ノードは配列に深さ優先の順で並べ、再帰や仮想呼び出しなしに小さなスタックで辿る
+/// 葉はBVH_MAX_LEAF_SIZE個までのプリミティブを持つ
+/// 構築はBVH_BUILD_THREADSのスレッドのタスクで並列に行う(BVH_BUILDERが1ならSAHの代わりにLBVHで作る)
+/// BVH_WIDTHが2より大きければ、畳んだBVH_WIDTH分木を辿る
+/// レイの束は2分木を束のまま辿り、箱に当たるレイが減ったら部分木を1本ずつ辿る
+// OBJモデル(geometry.h、三角形のBVHを持つのでこちらからはincludeしない)
+template<typename mat>
+class geometry;
 
 template<typename mat>
 class bvh_node : public hittable<mat> {
@@ -13,42 +801,41 @@ class bvh_node : public hittable<mat> {
   bvh_node(const hittable_list<mat> &list, double time0, double time1)
       : bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
   bvh_node(const shared_ptr<geometry<mat>> &obj, double t0, double t1)
-      : bvh_node(obj->tris, 0, obj->tris.size(), t0, t1) {}
+      : bvh_node(std::vector<shared_ptr<hittable<mat>>>(obj->tris.begin(), obj->tris.end()), 0, obj->tris.size(), t0, t1) {}
 
   bvh_node(const std::vector<shared_ptr<hittable<mat>>> &src_objects, size_t start, size_t end, double t0, double t1);
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void intersect_packet(ray_packet &packet, hit_record<mat> *recs) const override;
   bool bounding_box(double t0, double t1, aabb &box) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override;
+
+  size_t node_count() const {
+    return nodes.size();
+  }
+
+ private:
+  /// 2分木の番号rootの部分木を1本のレイで辿る
+  bool intersect_subtree(uint32_t root, const ray &r, double t_min, double t_max, hit_record<mat> &rec) const;
+
+  // 辿るときのスタックの深さ
+  static constexpr int STACK_SIZE = BVH_MAX_DEPTH + 1;
 
  public:
-  // 子ノード
-  shared_ptr<hittable<mat>> left;
-  shared_ptr<hittable<mat>> right;
   aabb box;
-};
+  // 木の品質
+  bvh_stats stats;
 
-template<typename mat>
-inline bool box_compare(const shared_ptr<hittable<mat>> a, const shared_ptr<hittable<mat>> b, int axis) {
-  aabb box_a;
-  aabb box_b;
-  if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b)) {
-    std::cerr << "No bounding box in bvh_node constructor\n";
-  }
-  return box_a.min().e[axis] < box_b.min().e[axis];
-}
-
-template<typename mat>
-bool box_x_compare(const shared_ptr<hittable<mat>> a, const shared_ptr<hittable<mat>> b) {
-  return box_compare(a, b, 0);
-}
-template<typename mat>
-bool box_y_compare(const shared_ptr<hittable<mat>> a, const shared_ptr<hittable<mat>> b) {
-  return box_compare(a, b, 1);
-}
-template<typename mat>
-bool box_z_compare(const shared_ptr<hittable<mat>> a, const shared_ptr<hittable<mat>> b) {
-  return box_compare(a, b, 2);
-}
+ private:
+  std::vector<linear_bvh_node> nodes;
+#if BVH_WIDTH > 2
+  wide_bvh<BVH_WIDTH> wide;
+#endif
+  // 葉から参照するプリミティブ(葉の順に並べた側の配列)
+  std::vector<const hittable<mat> *> prims;
+  // プリミティブの所有権
+  std::vector<shared_ptr<hittable<mat>>> holder;
+};
 
 template<typename mat>
 bvh_node<mat>::bvh_node(const std::vector<shared_ptr<hittable<mat>>> &src_objects,
@@ -56,45 +843,45 @@ bvh_node<mat>::bvh_node(const std::vector<shared_ptr<hittable<mat>>> &src_object
                         size_t end,
                         double t0,
                         double t1) {
-
-  auto objects = src_objects;
-  // チェックする軸をX,Y,Zからランダムで選択
-  int axis = int(3 * drand48());
-  auto comparator = (axis == 0) ? box_x_compare<mat>
-                                : (axis == 1) ? box_y_compare<mat>
-                                              : box_z_compare<mat>;
-
-  size_t object_span = end - start;
-
-  // オブジェクト１個の場合
-  if (object_span == 1) {
-    left = right = objects[start];
-  }
-    // オブジェクト２個の場合
-  else if (object_span == 2) {
-    if (comparator(objects[start], objects[start + 1])) {
-      left = objects[start];
-      right = objects[start + 1];
-    } else {
-      left = objects[start + 1];
-      right = objects[start];
+  auto start_time = std::chrono::steady_clock::now();
+  const int threads = bvh_build_threads();
+  const size_t n = end - start;
+  holder.assign(src_objects.begin() + start, src_objects.begin() + end);
+  std::vector<bvh_build_item> items(n);
+  #pragma omp parallel for schedule(static) num_threads(threads)
+  for (size_t i = 0; i < n; ++i) {
+    aabb b;
+    if (!holder[i]->bounding_box(t0, t1, b)) {
+      std::cerr << "No bounding box in bvh_node constructor\n";
     }
+    items[i] = bvh_build_item{b, 0.5 * (b.min() + b.max()), i};
   }
-    // オブジェクト３個以上
-  else {
-    std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
-    auto mid = start + object_span / 2;
-    left = make_shared<bvh_node>(objects, start, mid, t0, t1);
-    right = make_shared<bvh_node>(objects, mid, end, t0, t1);
+  if (items.empty()) {
+    return;
   }
-
-  aabb box_left, box_right;
-  // AABBの設定
-  if (!left->bounding_box(t0, t1, box_left) || !right->bounding_box(t0, t1, box_right)) {
-    std::cerr << "No bounding box in bvh_node constructor\n";
+  bvh_subtree root;
+  #pragma omp parallel num_threads(threads)
+  #pragma omp single
+  {
+#if BVH_BUILDER == 1
+    bvh_build_lbvh(items, root);
+#else
+    bvh_build_sah(items, 0, n, 0, root);
+#endif
   }
-  box = surrounding_box(box_left, box_right);
+  box = root.box;
+  bvh_flatten(root, nodes, stats);
+  stats.sah_cost /= surface_area(box);
+  // 葉はitemsの並びを参照する
+  prims.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    prims[i] = holder[items[i].index].get();
+  }
+#if BVH_WIDTH > 2
+  wide.collapse(nodes);
+#endif
+  stats.build_threads = threads;
+  stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
 }
 
 template<typename mat>
@@ -104,13 +891,163 @@ bool bvh_node<mat>::bounding_box(double t0, double t1, aabb &output_box) const {
 }
 
 template<typename mat>
-bool bvh_node<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
-  if (!box.hit(r, t_min, t_max)) {
+bool bvh_node<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+#if BVH_WIDTH > 2
+  bool hit_wide = wide.traverse(r, t_min, t_max, false, [&](uint32_t offset, uint16_t count, double &t) {
+    bool hit_leaf = false;
+    for (uint32_t i = offset; i < offset + count; ++i) {
+      if (prims[i]->intersect(r, t_min, t, rec)) {
+        hit_leaf = true;
+        t = rec.t;
+      }
+    }
+    return hit_leaf;
+  });
+  if (hit_wide && this->id != 0) rec.obj_id = this->id;
+  return hit_wide;
+#else
+  bool hit_binary = intersect_subtree(0, r, t_min, t_max, rec);
+  if (hit_binary && this->id != 0) rec.obj_id = this->id;
+  return hit_binary;
+#endif
+}
+
+template<typename mat>
+bool bvh_node<mat>::intersect_subtree(uint32_t root, const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+  if (nodes.empty()) {
+    return false;
+  }
+  const bvh_ray br(r);
+  uint32_t stack[STACK_SIZE];
+  int top = 0;
+  uint32_t k = root;
+  bool hit_anything = false;
+  while (true) {
+    const linear_bvh_node &n = nodes[k];
+    if (br.hit(n, t_min, t_max)) {
+      if (n.count > 0) {
+        for (uint32_t i = n.offset; i < n.offset + n.count; ++i) {
+          if (prims[i]->intersect(r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+          }
+        }
+      } else {
+        // レイの向きで近い方の子を先に辿り、遠い方を積む
+        if (br.neg[n.axis]) {
+          stack[top++] = k + 1;
+          k = n.offset;
+        } else {
+          stack[top++] = n.offset;
+          k = k + 1;
+        }
+        continue;
+      }
+    }
+    if (top == 0) break;
+    k = stack[--top];
+  }
+  return hit_anything;
+}
+
+template<typename mat>
+void bvh_node<mat>::intersect_packet(ray_packet &packet, hit_record<mat> *recs) const {
+  if (nodes.empty() || packet.size == 0) {
+    return;
+  }
+  const int n_rays = packet.size;
+  std::vector<double> t_before(packet.t_max.begin(), packet.t_max.begin() + n_rays);
+  std::vector<int> mask(n_rays), saved(packet.active.begin(), packet.active.begin() + n_rays);
+  // 箱に当たるレイがこれより少なければ、その部分木は1本ずつ辿る
+  const int min_active = std::max(1, int(RAY_PACKET_MIN_COHERENCE * packet.active_count()));
+  uint32_t stack[STACK_SIZE];
+  int top = 0;
+  uint32_t k = 0;
+  while (true) {
+    const linear_bvh_node &n = nodes[k];
+    const double lo[3] = {n.bounds[0][0], n.bounds[0][1], n.bounds[0][2]};
+    const double hi[3] = {n.bounds[1][0], n.bounds[1][1], n.bounds[1][2]};
+    // 束全体の区間で外れることが分かれば、レイ毎の判定をしない
+    int count = packet.may_hit(lo, hi) ? packet.hit_box(lo, hi, mask.data()) : 0;
+    if (count > 0 && count < min_active) {
+      // 束がまとまりを失ったので、当たったレイだけ1本ずつ辿る
+      for (int i = 0; i < n_rays; ++i) {
+        if (mask[i] && intersect_subtree(k, packet.rays[i], packet.t_min, packet.t_max[i], recs[i])) {
+          packet.t_max[i] = recs[i].t;
+        }
+      }
+    } else if (count > 0 && n.count > 0) {
+      // 葉は箱に当たったレイだけを形状の束の判定にかける
+      for (int i = 0; i < n_rays; ++i) packet.active[i] = mask[i];
+      for (uint32_t i = n.offset; i < n.offset + n.count; ++i) {
+        prims[i]->intersect_packet(packet, recs);
+      }
+      for (int i = 0; i < n_rays; ++i) packet.active[i] = saved[i];
+    } else if (count > 0) {
+      // 束の向き(符号がそろっていなければ最初のレイの向き)で近い方の子を先に辿る
+      if (packet.neg[n.axis]) {
+        stack[top++] = k + 1;
+        k = n.offset;
+      } else {
+        stack[top++] = n.offset;
+        k = k + 1;
+      }
+      continue;
+    }
+    if (top == 0) break;
+    k = stack[--top];
+  }
+  if (this->id != 0) {
+    for (int i = 0; i < n_rays; ++i) {
+      if (packet.t_max[i] < t_before[i]) recs[i].obj_id = this->id;
+    }
+  }
+}
+
+template<typename mat>
+bool bvh_node<mat>::occluded(const ray &r, double t_min, double t_max) const {
+#if BVH_WIDTH > 2
+  return wide.traverse(r, t_min, t_max, true, [&](uint32_t offset, uint16_t count, double &t) {
+    for (uint32_t i = offset; i < offset + count; ++i) {
+      if (prims[i]->occluded(r, t_min, t)) {
+        return true;
+      }
+    }
     return false;
+  });
+#else
+  if (nodes.empty()) {
+    return false;
+  }
+  const bvh_ray br(r);
+  uint32_t stack[STACK_SIZE];
+  int top = 0;
+  uint32_t k = 0;
+  while (true) {
+    const linear_bvh_node &n = nodes[k];
+    if (br.hit(n, t_min, t_max)) {
+      if (n.count > 0) {
+        for (uint32_t i = n.offset; i < n.offset + n.count; ++i) {
+          if (prims[i]->occluded(r, t_min, t_max)) {
+            return true;
+          }
+        }
+      } else {
+        if (br.neg[n.axis]) {
+          stack[top++] = k + 1;
+          k = n.offset;
+        } else {
+          stack[top++] = n.offset;
+          k = k + 1;
+        }
+        continue;
+      }
+    }
+    if (top == 0) break;
+    k = stack[--top];
   }
-  bool hit_left = left->hit(r, t_min, t_max, rec);
-  bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
-  return hit_left || hit_right;
+  return false;
+#endif
 }
 
 #endif //FLUORSWITCH_SRC_UTILS_BVH_H_
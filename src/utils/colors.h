@@ -7,4 +7,8 @@ static const color ZERO(0, 0, 0);
 static const color WHITE(0.8, 0.8, 0.8);
 static const color CYAN(0, 1, 1);
 static const color MAGENTA(1, 0, 1);
+
+inline double luminance(const color &c) {
+  return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
 #endif //RAY_SRC_UTILS_COLORS_H_
@@ -0,0 +1,182 @@
+#ifndef FLUORSWITCH_SRC_UTILS_FAST_MATH_H_
+#define FLUORSWITCH_SRC_UTILS_FAST_MATH_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "util_funcs.h"
+
+/// サンプリング・UV・媒質の距離・Fresnel項用の数学関数の多項式近似
+/// 分岐を使わない(選択だけ)ので、まとめて計算する版(*_n)はOpenMPのsimdでベクトル化される
+/// (描画全体が1つの翻訳単位なのでインライン展開の上限に掛からないよう常に展開する)
+/// 誤差の上限(標準ライブラリとの差、tests/fast_math_test.cppで確かめる):
+///   approx_sincos: 絶対誤差 1e-11 (|x| < 1e5)
+///   approx_atan2:  絶対誤差 1e-10
+///   approx_log:    絶対誤差 1e-12 (正の正規化数、0以下は-INF)
+///   pow5:          相対誤差 1e-15
+constexpr double APPROX_SINCOS_ERROR = 1e-11;
+constexpr double APPROX_ATAN2_ERROR = 1e-10;
+constexpr double APPROX_LOG_ERROR = 1e-12;
+constexpr double POW5_ERROR = 1e-15;
+
+#if defined(__GNUC__)
+#define FAST_MATH_INLINE inline __attribute__((always_inline))
+#else
+#define FAST_MATH_INLINE inline
+#endif
+
+// 1.5 x 2^52 を足すと小数部が丸められる(|x| < 2^51)
+constexpr double ROUND_MAGIC = 6755399441055744.0;
+
+FAST_MATH_INLINE uint64_t double_bits(double x) {
+  uint64_t b;
+  std::memcpy(&b, &x, sizeof(b));
+  return b;
+}
+
+FAST_MATH_INLINE double bits_double(uint64_t b) {
+  double x;
+  std::memcpy(&x, &b, sizeof(x));
+  return x;
+}
+
+/// mの立っているビットをa、それ以外をbから選ぶ(整数の条件で分岐せずに選ぶ)
+FAST_MATH_INLINE double blend(uint64_t m, double a, double b) {
+  return bits_double((double_bits(a) & m) | (double_bits(b) & ~m));
+}
+
+/// 符号をflipのビット63に合わせて反転
+FAST_MATH_INLINE double flip_sign(double x, uint64_t flip) {
+  return bits_double(double_bits(x) ^ (flip & 0x8000000000000000ULL));
+}
+
+/// sin, cos (π/2毎の象限に分けて[-π/4, π/4]の多項式)
+FAST_MATH_INLINE void approx_sincos(double x, double &s, double &c) {
+  // 象限 k = round(x / (π/2))、π/2を3つに分けて引く (Cody-Waite)
+  double k_magic = x * (2.0 * M_1_PI) + ROUND_MAGIC;
+  uint64_t q = double_bits(k_magic);
+  double k = k_magic - ROUND_MAGIC;
+  double r = x - k * 1.57079632673412561417e+00;
+  r -= k * 6.07710050630396597660e-11;
+  r -= k * 2.02226624879595063154e-21;
+  double r2 = r * r;
+  // Taylor展開(|r| <= π/4 で打ち切り誤差 1e-11 以下)
+  double ps = r * (1.0 + r2 * (-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040 + r2 * (1.0 / 362880
+      + r2 * (-1.0 / 39916800 + r2 * (1.0 / 6227020800.0)))))));
+  double pc = 1.0 + r2 * (-0.5 + r2 * (1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320
+      + r2 * (-1.0 / 3628800 + r2 * (1.0 / 479001600.0))))));
+  // 象限毎の入れ替えと符号
+  uint64_t swap = uint64_t(0) - (q & 1);
+  s = flip_sign(blend(swap, pc, ps), q << 62);
+  c = flip_sign(blend(swap, ps, pc), (q + 1) << 62);
+}
+
+/// atan2 (atan(t)を|t| <= tan(π/8)に縮めて多項式)
+FAST_MATH_INLINE double approx_atan2(double y, double x) {
+  double ax = fabs(x);
+  double ay = fabs(y);
+  double mx = std::max(ax, ay);
+  double mn = std::min(ax, ay);
+  // 原点では0 (割り算は条件の外に出してベクトル化できるようにする)
+  double a = mn / (mx > 0.0 ? mx : 1.0);
+  // tan(π/8)より大きければ atan(a) = π/4 + atan((a - 1) / (a + 1))
+  bool big = a > 0.41421356237309503;
+  double t = (big ? a - 1.0 : a) / (big ? a + 1.0 : 1.0);
+  double t2 = t * t;
+  double p = t * (1.0 + t2 * (-1.0 / 3 + t2 * (1.0 / 5 + t2 * (-1.0 / 7 + t2 * (1.0 / 9 + t2 * (-1.0 / 11
+      + t2 * (1.0 / 13 + t2 * (-1.0 / 15 + t2 * (1.0 / 17 + t2 * (-1.0 / 19 + t2 * (1.0 / 21)))))))))));
+  double r = p + (big ? M_PI_4 : 0.0);
+  r = ay > ax ? M_PI_2 - r : r;
+  r = x < 0.0 ? M_PI - r : r;
+  return flip_sign(r, double_bits(y));
+}
+
+/// 自然対数 (x = m 2^e, m in [√2/2, √2) に分けて log(m) = 2 atanh((m - 1) / (m + 1)))
+FAST_MATH_INLINE double approx_log(double x) {
+  uint64_t b = double_bits(x);
+  // 指数部を2^52の仮数部に入れて浮動小数点数にする(64bit整数の変換はSSE2でベクトル化できない)
+  double e = bits_double(0x4330000000000000ULL | ((b >> 52) & 0x7ff)) - (4503599627370496.0 + 1023.0);
+  double m = bits_double((b & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+  bool big = m > M_SQRT2;
+  m = big ? m * 0.5 : m;
+  double de = e + (big ? 1.0 : 0.0);
+  double s = (m - 1.0) / (m + 1.0);
+  double s2 = s * s;
+  double p = 2.0 * s * (1.0 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 * (1.0 / 9 + s2 * (1.0 / 11
+      + s2 * (1.0 / 13)))))));
+  double r = de * M_LN2 + p;
+  return x > 0.0 ? r : -INF;
+}
+
+/// x^5 (Schlick近似のFresnel項)
+FAST_MATH_INLINE double pow5(double x) {
+  double x2 = x * x;
+  return x2 * x2 * x;
+}
+
+/// まとめて計算する版
+inline void approx_sincos_n(const double *x, double *s, double *c, size_t n) {
+#pragma omp simd
+  for (size_t i = 0; i < n; ++i) {
+    approx_sincos(x[i], s[i], c[i]);
+  }
+}
+
+inline void approx_atan2_n(const double *y, const double *x, double *out, size_t n) {
+#pragma omp simd
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = approx_atan2(y[i], x[i]);
+  }
+}
+
+inline void approx_log_n(const double *x, double *out, size_t n) {
+#pragma omp simd
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = approx_log(x[i]);
+  }
+}
+
+inline void pow5_n(const double *x, double *out, size_t n) {
+#pragma omp simd
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = pow5(x[i]);
+  }
+}
+
+/// ビルド毎(USE_FAST_MATH)に近似と標準ライブラリを切り替える
+inline void fast_sincos(double x, double &s, double &c) {
+#if USE_FAST_MATH
+  approx_sincos(x, s, c);
+#else
+  s = sin(x);
+  c = cos(x);
+#endif
+}
+
+inline double fast_atan2(double y, double x) {
+#if USE_FAST_MATH
+  return approx_atan2(y, x);
+#else
+  return atan2(y, x);
+#endif
+}
+
+/// acos(x) = atan2(√(1 - x^2), x)
+inline double fast_acos(double x) {
+#if USE_FAST_MATH
+  return approx_atan2(sqrt(std::max(1.0 - x * x, 0.0)), x);
+#else
+  return acos(x);
+#endif
+}
+
+inline double fast_log(double x) {
+#if USE_FAST_MATH
+  return approx_log(x);
+#else
+  return log(x);
+#endif
+}
+
+#endif //FLUORSWITCH_SRC_UTILS_FAST_MATH_H_
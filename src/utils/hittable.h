@@ -6,9 +6,13 @@
 
 #include "util_funcs.h"
 #include "aabb.h"
+#include "ray_packet.h"
 
 class material;
 
+template<typename mat>
+class hittable;
+
 template<typename mat>
 struct hit_record {
   double t;
@@ -18,6 +22,14 @@ struct hit_record {
   double u;
   double v;
   bool front_face;
+  // オブジェクトID(フレーム間で同じ物体を識別する)
+  int obj_id{0};
+  // 属性(位置・法線・UV・マテリアル)をまだ求めていない交差の形状(属性を求めた後はnullptr)
+  const hittable<mat> *prim{nullptr};
+  // 変換(translate, rotate_y, flip_face)がprimの場合の内側の形状(外側の変換のsurfaceから順に取り出す)
+  static constexpr int max_inner = 4;
+  const hittable<mat> *inner[max_inner]{};
+  int inner_count{0};
 
   inline void set_face_normal(const ray &r, const vec3 &outward_normal) {
     front_face = dot(r.direction(), outward_normal) < 0;
@@ -25,11 +37,101 @@ struct hit_record {
   }
 };
 
+/// 光源BVH用の光源の範囲 (Conty Estevez & Kulla 2018)
+/// 位置の範囲・法線の向きの円錐(軸から theta_o)・法線から発光までの広がり theta_e・放射束
+struct light_bounds {
+  aabb box;
+  vec3 axis{0, 0, 1};
+  double theta_o{0.0};
+  double theta_e{M_PI / 2};
+  double phi{0.0};
+  // 両面から発光する(軸と逆向きも含む)
+  bool two_sided{false};
+};
+
+/// 放射束の見積もりに使う発光の輝度
+/// 光源のリストには形状だけ、または発光しない物体をサンプリングのために加えることがあるので、その場合は1とみなす
+template<typename mat>
+inline double emission_scale(const shared_ptr<mat> &m) {
+  double l = m ? m->emitted_luminance() : 0.0;
+  return l > 0.0 ? l : 1.0;
+}
+
 template<typename mat>
 class hittable {
  public:
-  virtual bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const = 0;
+  /// 最も近い交差を探し、その交差点の属性を求める
+  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+    if (!intersect(r, t_min, t_max, rec)) {
+      return false;
+    }
+    resolve(r, rec);
+    return true;
+  }
+
+  /// 最も近い交差だけを探す: 交差した場合だけrec.t, prim, obj_idと形状毎の座標(rec.u, rec.v)を書き込む
+  /// 法線・UV・マテリアルは最後に残った交差についてresolveで1回だけ求める
+  virtual bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const = 0;
+
+  /// intersectが書き込んだrec.t, rec.u, rec.vから交差点の属性を求める(primとして記録した形状だけが呼ばれる)
+  virtual void surface(const ray &r, hit_record<mat> &rec) const {}
+
+  /// レイの束の最も近い交差を探す: activeなレイ毎にintersectと同じく、交差した場合だけrecs[k]とpacket.t_max[k]を書き換える
+  /// 既定は1本ずつintersectを呼ぶ(束のままSIMDで判定できる形状とBVHで上書きする)
+  virtual void intersect_packet(ray_packet &packet, hit_record<mat> *recs) const {
+    for (int k = 0; k < packet.size; ++k) {
+      if (packet.active[k] && intersect(packet.rays[k], packet.t_min, packet.t_max[k], recs[k])) {
+        packet.t_max[k] = recs[k].t;
+      }
+    }
+  }
+
+  /// 属性を求めていない交差の属性を求める
+  static void resolve(const ray &r, hit_record<mat> &rec) {
+    if (rec.prim) {
+      const hittable<mat> *prim = rec.prim;
+      rec.prim = nullptr;
+      prim->surface(r, rec);
+    }
+  }
+
+ protected:
+  /// 変換の内側の物体との交差(変換後のレイr): 交差した内側の形状を積み、この変換をprimとする
+  /// 属性は変換のsurfaceでresolve_innerを呼んで求める(積めない深さでは属性をここで求め、rec.primはnullptrになる)
+  bool intersect_inner(const hittable<mat> &inner, const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+    // 内側で交差すれば、それまでの交差の形状は使わないので積み直す
+    int count = rec.inner_count;
+    rec.inner_count = 0;
+    if (!inner.intersect(r, t_min, t_max, rec)) {
+      rec.inner_count = count;
+      return false;
+    }
+    if (rec.prim != nullptr && rec.inner_count < hit_record<mat>::max_inner) {
+      rec.inner[rec.inner_count++] = rec.prim;
+      rec.prim = this;
+    } else {
+      resolve(r, rec);
+    }
+    return true;
+  }
+
+  /// intersect_innerで積んだ内側の形状の属性を、変換後のレイrで求める
+  static void resolve_inner(const ray &r, hit_record<mat> &rec) {
+    rec.prim = rec.inner[--rec.inner_count];
+    resolve(r, rec);
+  }
+
+ public:
+
   virtual bool bounding_box(double t0, double t1, aabb &box) const = 0;
+
+  /// 遮蔽判定: (t_min, t_max)に交差があるか(最初に見つかった交差で終了し、法線・UV・マテリアルは求めない)
+  /// シャドウレイ・可視判定用(既定はhitを使うので、形状毎に交差点の属性を求めない実装で上書きする)
+  virtual bool occluded(const ray &r, double t_min, double t_max) const {
+    hit_record<mat> rec;
+    return hit(r, t_min, t_max, rec);
+  }
+
   virtual double pdf_value(const point3 &o, const vec3 &v) const {
     return 0.0;
   }
@@ -37,6 +139,43 @@ class hittable {
   virtual vec3 random(const vec3 &o) const {
     return X_UP;
   }
+
+  /// 光源としてのサンプリング: 点oから見た光源上の点、その点の法線(o側)、立体角測度のpdfを1回で求める
+  /// 点への方向は rec.p - o (rec.t = 1)、rec.mat_ptrで発光を評価できる(形状だけの光源ではnullptr)
+  /// 既定はrandomとhit, pdf_valueの組み合わせ(形状毎に交差判定をしない実装で上書きする)
+  virtual bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const {
+    vec3 dir = random(o);
+    if (!hit(ray(o, dir), 0.001, INF, rec)) {
+      return false;
+    }
+    rec.t = 1;
+    pdf_w = pdf_value(o, dir);
+    return pdf_w > 0.0;
+  }
+
+  /// 光源上の既知の点rec.pを点oからサンプリングする立体角測度のpdf(MIS用、交差判定をしない)
+  virtual double light_pdf(const point3 &o, const hit_record<mat> &rec) const {
+    return pdf_value(o, rec.p - o);
+  }
+
+  /// 光源上の既知の点rec.pを点oから見た交差として、法線(o側)・マテリアル・UVを求める(点が光源に無ければfalse)
+  /// 既定は点の前後だけの交差判定(光源のリストに対して呼び、シーン全体とは交差判定しない)
+  virtual bool light_record(const point3 &o, hit_record<mat> &rec) const {
+    if (!hit(ray(o, rec.p - o), 1.0 - 1e-3, 1.0 + 1e-3, rec)) {
+      return false;
+    }
+    rec.t = 1;
+    return true;
+  }
+
+  /// 光源BVH用の範囲(範囲を持たない光源はfalse、光源BVHの外で別にサンプリングする)
+  virtual bool emission_bounds(light_bounds &b) const {
+    return false;
+  }
+
+ public:
+  // 0以外の場合、複合オブジェクトは子の交差にこのIDを付ける
+  int id{0};
 };
 
 template<typename mat>
@@ -44,27 +183,54 @@ class translate : public hittable<mat> {
  public:
   translate(shared_ptr<hittable<mat>> p, const vec3 &displacement) : ptr(p), offset(displacement) {}
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void surface(const ray &r, hit_record<mat> &rec) const override;
   bool bounding_box(double time0, double time1, aabb &output_box) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override {
+    return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+  }
+  bool emission_bounds(light_bounds &b) const override {
+    if (!ptr->emission_bounds(b)) {
+      return false;
+    }
+    b.box = aabb(b.box.min() + offset, b.box.max() + offset);
+    return true;
+  }
 
  public:
   shared_ptr<hittable<mat>> ptr;
   vec3 offset;
+
+ private:
+  /// 移動前の座標系で求めた属性を戻す
+  void to_world(const ray &moved_r, hit_record<mat> &rec) const {
+    rec.p += offset;
+    rec.set_face_normal(moved_r, rec.normal);
+  }
 };
 
 template<typename mat>
-bool translate<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+bool translate<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
   ray moved_r(r.origin() - offset, r.direction(), r.time());
-  if (!ptr->hit(moved_r, t_min, t_max, rec)) {
+  if (!this->intersect_inner(*ptr, moved_r, t_min, t_max, rec)) {
     return false;
   }
-
-  rec.p += offset;
-  rec.set_face_normal(moved_r, rec.normal);
+  if (rec.prim == nullptr) {
+    to_world(moved_r, rec);
+  }
+  if (this->id != 0) rec.obj_id = this->id;
 
   return true;
 }
 
+/// 属性は移動前の座標系で求める
+template<typename mat>
+void translate<mat>::surface(const ray &r, hit_record<mat> &rec) const {
+  ray moved_r(r.origin() - offset, r.direction(), r.time());
+  this->resolve_inner(moved_r, rec);
+  to_world(moved_r, rec);
+}
+
 template<typename mat>
 bool translate<mat>::bounding_box(double time0, double time1, aabb &output_box) const {
   if (!ptr->bounding_box(time0, time1, output_box)) {
@@ -80,11 +246,17 @@ class rotate_y : public hittable<mat> {
  public:
   rotate_y(shared_ptr<hittable<mat>> p, double angle);
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void surface(const ray &r, hit_record<mat> &rec) const override;
   bool bounding_box(double t0, double t1, aabb &box) const override {
     box = bbox;
     return has_box;
   }
+  bool occluded(const ray &r, double t_min, double t_max) const override;
+
+ private:
+  ray to_object(const ray &r) const;
+  void to_world(const ray &rotated_r, hit_record<mat> &rec) const;
 
  public:
   shared_ptr<hittable<mat>> ptr;
@@ -127,8 +299,9 @@ rotate_y<mat>::rotate_y(shared_ptr<hittable<mat>> p, double angle) : ptr(p) {
   bbox = aabb(min, max);
 }
 
+/// レイを回転前の物体の座標系へ
 template<typename mat>
-bool rotate_y<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+ray rotate_y<mat>::to_object(const ray &r) const {
   auto origin = r.origin();
   auto direction = r.direction();
 
@@ -138,12 +311,35 @@ bool rotate_y<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat
   direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
   direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-  ray rotated_r(origin, direction, r.time());
+  return ray(origin, direction, r.time());
+}
 
-  if (!ptr->hit(rotated_r, t_min, t_max, rec)) {
+template<typename mat>
+bool rotate_y<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
+  ray rotated_r = to_object(r);
+
+  if (!this->intersect_inner(*ptr, rotated_r, t_min, t_max, rec)) {
     return false;
   }
+  if (rec.prim == nullptr) {
+    to_world(rotated_r, rec);
+  }
+  if (this->id != 0) rec.obj_id = this->id;
 
+  return true;
+}
+
+/// 属性は回転前の座標系で求める
+template<typename mat>
+void rotate_y<mat>::surface(const ray &r, hit_record<mat> &rec) const {
+  ray rotated_r = to_object(r);
+  this->resolve_inner(rotated_r, rec);
+  to_world(rotated_r, rec);
+}
+
+/// 回転前の座標系で求めた属性を戻す
+template<typename mat>
+void rotate_y<mat>::to_world(const ray &rotated_r, hit_record<mat> &rec) const {
   auto p = rec.p;
   auto normal = rec.normal;
 
@@ -155,8 +351,11 @@ bool rotate_y<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat
 
   rec.p = p;
   rec.set_face_normal(rotated_r, normal);
+}
 
-  return true;
+template<typename mat>
+bool rotate_y<mat>::occluded(const ray &r, double t_min, double t_max) const {
+  return ptr->occluded(to_object(r), t_min, t_max);
 }
 
 template<typename mat>
@@ -164,19 +363,71 @@ class flip_face : public hittable<mat> {
  public:
   flip_face(shared_ptr<hittable<mat>> p) : ptr(p) {}
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override {
-    if (!ptr->hit(r, t_min, t_max, rec)) {
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override {
+    if (!this->intersect_inner(*ptr, r, t_min, t_max, rec)) {
       return false;
     }
+    if (rec.prim == nullptr) {
+      rec.front_face = !rec.front_face;
+    }
+    if (this->id != 0) rec.obj_id = this->id;
+    return true;
+  }
 
+  void surface(const ray &r, hit_record<mat> &rec) const override {
+    this->resolve_inner(r, rec);
     rec.front_face = !rec.front_face;
-    return true;
   }
 
   bool bounding_box(double t0, double t1, aabb &box) const override {
     return ptr->bounding_box(t0, t1, box);
   }
 
+  bool occluded(const ray &r, double t_min, double t_max) const override {
+    return ptr->occluded(r, t_min, t_max);
+  }
+
+  double pdf_value(const point3 &o, const vec3 &v) const override {
+    return ptr->pdf_value(o, v);
+  }
+
+  vec3 random(const vec3 &o) const override {
+    return ptr->random(o);
+  }
+
+  bool emission_bounds(light_bounds &b) const override {
+    if (!ptr->emission_bounds(b)) {
+      return false;
+    }
+    // 片面の光源は裏側から発光する
+    if (!b.two_sided) {
+      b.axis = -b.axis;
+    }
+    return true;
+  }
+
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override {
+    if (!ptr->sample_light(o, rec, pdf_w)) {
+      return false;
+    }
+    rec.front_face = !rec.front_face;
+    if (this->id != 0) rec.obj_id = this->id;
+    return true;
+  }
+
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override {
+    return ptr->light_pdf(o, rec);
+  }
+
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override {
+    if (!ptr->light_record(o, rec)) {
+      return false;
+    }
+    rec.front_face = !rec.front_face;
+    if (this->id != 0) rec.obj_id = this->id;
+    return true;
+  }
+
  public:
   shared_ptr<hittable<mat>> ptr;
 };
@@ -26,32 +26,66 @@ class hittable_list : public hittable<mat> {
     }
   }
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override;
+  void intersect_packet(ray_packet &packet, hit_record<mat> *recs) const override;
   bool bounding_box(double t0, double t1, aabb &box) const override;
+  bool occluded(const ray &r, double t_min, double t_max) const override;
   double pdf_value(const point3 &o, const vec3 &v) const override;
   vec3 random(const vec3 &o) const override;
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override;
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override;
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override;
 
  public:
   std::vector<shared_ptr<hittable<mat>>> objects;
 };
 
 template<typename mat>
-bool hittable_list<mat>::hit(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
-  hit_record<mat> temp_rec;
+bool hittable_list<mat>::intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const {
   bool hit_anything = false;
   double closest_so_far = t_max;
 
+  // intersectは交差した場合だけrecを書き換えるので、より近い交差で上書きしていく
   for (const auto &object: objects) {
-    if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+    if (object->intersect(r, t_min, closest_so_far, rec)) {
       hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
+      closest_so_far = rec.t;
     }
   }
 
+  if (hit_anything && this->id != 0) rec.obj_id = this->id;
   return hit_anything;
 }
 
+template<typename mat>
+void hittable_list<mat>::intersect_packet(ray_packet &packet, hit_record<mat> *recs) const {
+  if (this->id == 0) {
+    for (const auto &object: objects) {
+      object->intersect_packet(packet, recs);
+    }
+    return;
+  }
+  // このリストの中で交差したレイ(距離が縮んだレイ)にIDを付ける
+  std::vector<double> t_before(packet.t_max.begin(), packet.t_max.begin() + packet.size);
+  for (const auto &object: objects) {
+    object->intersect_packet(packet, recs);
+  }
+  for (int k = 0; k < packet.size; ++k) {
+    if (packet.t_max[k] < t_before[k]) recs[k].obj_id = this->id;
+  }
+}
+
+/// 最も近い交差を探さず、どれか1つに当たれば終了
+template<typename mat>
+bool hittable_list<mat>::occluded(const ray &r, double t_min, double t_max) const {
+  for (const auto &object: objects) {
+    if (object->occluded(r, t_min, t_max)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 template<typename mat>
 bool hittable_list<mat>::bounding_box(double t0, double t1, aabb &box) const {
   // リストが空の場合、リターン
@@ -89,4 +123,39 @@ vec3 hittable_list<mat>::random(const vec3 &o) const {
   auto int_size = static_cast<int>(objects.size());
   return objects[random_int(0, int_size - 1)]->random(o);
 }
+
+template<typename mat>
+bool hittable_list<mat>::sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const {
+  if (objects.empty()) {
+    return false;
+  }
+  auto int_size = static_cast<int>(objects.size());
+  if (!objects[random_int(0, int_size - 1)]->sample_light(o, rec, pdf_w)) {
+    return false;
+  }
+  // 他の光源が同じ点を含む場合も数える(pdf_valueと同じ混合)
+  pdf_w = int_size == 1 ? pdf_w : light_pdf(o, rec);
+  return pdf_w > 0.0;
+}
+
+template<typename mat>
+double hittable_list<mat>::light_pdf(const point3 &o, const hit_record<mat> &rec) const {
+  auto weight = 1.0 / objects.size();
+  auto sum = 0.0;
+
+  for (const auto &object: objects) {
+    sum += weight * object->light_pdf(o, rec);
+  }
+  return sum;
+}
+
+template<typename mat>
+bool hittable_list<mat>::light_record(const point3 &o, hit_record<mat> &rec) const {
+  for (const auto &object: objects) {
+    if (object->light_record(o, rec)) {
+      return true;
+    }
+  }
+  return false;
+}
 #endif //RAY_UTILS_HITTABLE_LIST_H_
@@ -0,0 +1,369 @@
+#ifndef FLUORSWITCH_SRC_UTILS_LIGHT_BVH_H_
+#define FLUORSWITCH_SRC_UTILS_LIGHT_BVH_H_
+
+#include <algorithm>
+#include <vector>
+#include "hittable.h"
+#include "hittable_list.h"
+#include "fast_math.h"
+
+/// 2つの向きの円錐(軸, 開き角)を含む円錐
+inline void union_cone(const vec3 &wa, double ta, const vec3 &wb, double tb, vec3 &w, double &t) {
+  double td = fast_acos(clamp(dot(wa, wb), -1.0, 1.0));
+  if (std::min(td + tb, M_PI) <= ta) {
+    w = wa;
+    t = ta;
+    return;
+  }
+  if (std::min(td + ta, M_PI) <= tb) {
+    w = wb;
+    t = tb;
+    return;
+  }
+  double to = 0.5 * (ta + td + tb);
+  vec3 wr = cross(wa, wb);
+  if (to >= M_PI || wr.squared_length() == 0.0) {
+    w = wa;
+    t = M_PI;
+    return;
+  }
+  // waをwrの周りに to - ta だけ回す(Rodriguesの回転公式)
+  vec3 k = unit_vector(wr);
+  double s, c;
+  fast_sincos(to - ta, s, c);
+  w = unit_vector(wa * c + cross(k, wa) * s + k * dot(k, wa) * (1.0 - c));
+  t = to;
+}
+
+inline light_bounds union_bounds(const light_bounds &a, const light_bounds &b) {
+  if (a.phi <= 0.0) return b;
+  if (b.phi <= 0.0) return a;
+  light_bounds u;
+  u.box = surrounding_box(a.box, b.box);
+  union_cone(a.axis, a.theta_o, b.axis, b.theta_o, u.axis, u.theta_o);
+  u.theta_e = std::max(a.theta_e, b.theta_e);
+  u.phi = a.phi + b.phi;
+  u.two_sided = a.two_sided || b.two_sided;
+  return u;
+}
+
+/// 点pから見た範囲内の光源の寄与の上限の見積もり: 放射束 x 向きの項 / 距離^2
+/// 箱が見込む角度と法線の円錐の分だけ、軸とpへの方向のなす角を小さく見積もる
+inline double light_importance(const light_bounds &b, const point3 &p) {
+  point3 pc = 0.5 * (b.box.min() + b.box.max());
+  vec3 d = p - pc;
+  double dist2 = d.squared_length();
+  // 箱の外接球
+  double r2 = 0.25 * (b.box.max() - b.box.min()).squared_length();
+  double cos_w = dist2 > 0.0 ? dot(b.axis, d) / sqrt(dist2) : 1.0;
+  if (b.two_sided) {
+    cos_w = fabs(cos_w);
+  }
+  double theta_w = fast_acos(clamp(cos_w, -1.0, 1.0));
+  double theta_b = dist2 <= r2 ? M_PI : fast_acos(sqrt(1.0 - r2 / dist2));
+  double theta = std::max(0.0, theta_w - b.theta_o - theta_b);
+  if (theta >= b.theta_e) {
+    return 0.0;
+  }
+  // 箱の中の点で発散しないように距離は外接球の半径以上とする
+  return b.phi * cos(theta) / std::max(dist2, r2);
+}
+
+/// 光源BVH (Conty Estevez & Kulla 2018, "Importance Sampling of Many Lights with Adaptive Tree Splitting")
+/// 点毎に子ノードの寄与の見積もりに比例して降りることで光源を選び、選ぶ確率は根からの経路だけで求める
+/// 範囲を持たない光源(環境光)は光源BVH全体と同じ確率で別に選ぶ
+/// 光源のリスト(hittable_list)の代わりに、リストの唯一の要素として使う
+template<typename mat>
+class light_bvh : public hittable<mat> {
+ public:
+  explicit light_bvh(const hittable_list<mat> &list) {
+    std::vector<build_item> items;
+    for (const auto &light : list.objects) {
+      light_bounds b;
+      if (!light->emission_bounds(b)) {
+        infinite.push_back(light.get());
+        continue;
+      }
+      if (b.phi <= 0.0) {
+        continue;
+      }
+      // 光源のpdfと同じ許容誤差で点と方向が範囲に入るように広げる
+      double pad = 1e-4 * (1.0 + (b.box.max() - b.box.min()).length());
+      b.box = aabb(b.box.min() - vec3(pad, pad, pad), b.box.max() + vec3(pad, pad, pad));
+      items.push_back(build_item{int(lights.size()), b});
+      lights.push_back(light.get());
+    }
+    holder = list.objects;
+    if (!items.empty()) {
+      nodes.reserve(2 * items.size() - 1);
+      build(items, 0, items.size());
+    }
+    // 範囲を持つ光源全体をひとつの範囲を持たない光源と同じに扱う
+    if (!infinite.empty()) {
+      p_infinite = double(infinite.size()) / double(infinite.size() + (nodes.empty() ? 0 : 1));
+    }
+  }
+
+  bool intersect(const ray &r, double t_min, double t_max, hit_record<mat> &rec) const override {
+    return false;
+  }
+
+  bool bounding_box(double t0, double t1, aabb &box) const override {
+    if (nodes.empty()) {
+      return false;
+    }
+    box = nodes[0].bounds.box;
+    return true;
+  }
+
+  double pdf_value(const point3 &o, const vec3 &v) const override {
+    double sum = 0.0;
+    for (const auto *light : infinite) {
+      sum += p_infinite / infinite.size() * light->pdf_value(o, v);
+    }
+    ray r(o, v);
+    if (!nodes.empty() && nodes[0].bounds.box.hit(r, 0.001, INF)) {
+      sum += pdf_node(0, 1.0 - p_infinite, o, [&](const aabb &box) { return box.hit(r, 0.001, INF); },
+                      [&](const hittable<mat> *light) { return light->pdf_value(o, v); });
+    }
+    return sum;
+  }
+
+  vec3 random(const vec3 &o) const override {
+    double pmf;
+    const hittable<mat> *light = pick(o, random_double(), pmf);
+    return light != nullptr ? light->random(o) : X_UP;
+  }
+
+  bool sample_light(const point3 &o, hit_record<mat> &rec, double &pdf_w) const override {
+    double pmf;
+    const hittable<mat> *light = pick(o, random_double(), pmf);
+    if (light == nullptr || !light->sample_light(o, rec, pdf_w)) {
+      return false;
+    }
+    // 他の光源が同じ点を含む場合も数える(pdf_valueと同じ混合)
+    pdf_w = infinite.size() + lights.size() == 1 ? pdf_w : light_pdf(o, rec);
+    return pdf_w > 0.0;
+  }
+
+  double light_pdf(const point3 &o, const hit_record<mat> &rec) const override {
+    double sum = 0.0;
+    for (const auto *light : infinite) {
+      sum += p_infinite / infinite.size() * light->light_pdf(o, rec);
+    }
+    if (!nodes.empty() && contains(nodes[0].bounds.box, rec.p)) {
+      sum += pdf_node(0, 1.0 - p_infinite, o, [&](const aabb &box) { return contains(box, rec.p); },
+                      [&](const hittable<mat> *light) { return light->light_pdf(o, rec); });
+    }
+    return sum;
+  }
+
+  bool light_record(const point3 &o, hit_record<mat> &rec) const override {
+    if (!nodes.empty() && record_node(0, o, rec)) {
+      return true;
+    }
+    for (const auto *light : infinite) {
+      if (light->light_record(o, rec)) return true;
+    }
+    return false;
+  }
+
+  size_t light_count() const {
+    return lights.size() + infinite.size();
+  }
+
+  size_t node_count() const {
+    return nodes.size();
+  }
+
+ private:
+  struct node {
+    light_bounds bounds;
+    // 葉: lightsの番号、内部ノード: 2番目の子の番号(1番目の子は直後)
+    int index;
+    bool leaf;
+  };
+
+  struct build_item {
+    int light;
+    light_bounds bounds;
+  };
+
+  /// 子を選ぶ確率(どちらも寄与が無いと見積もられた場合は半々)
+  double left_probability(int k, const point3 &o) const {
+    double i0 = light_importance(nodes[k + 1].bounds, o);
+    double i1 = light_importance(nodes[nodes[k].index].bounds, o);
+    return i0 + i1 > 0.0 ? i0 / (i0 + i1) : 0.5;
+  }
+
+  /// u in [0, 1) で光源を選ぶ(pmf: 選んだ確率)
+  const hittable<mat> *pick(const point3 &o, double u, double &pmf) const {
+    if (u < p_infinite) {
+      size_t k = std::min(size_t(u / p_infinite * infinite.size()), infinite.size() - 1);
+      pmf = p_infinite / infinite.size();
+      return infinite[k];
+    }
+    if (nodes.empty()) {
+      return nullptr;
+    }
+    // 選んだ区間の中での位置を次の選択に使い回す
+    u = std::min((u - p_infinite) / (1.0 - p_infinite), ONE_MINUS_EPSILON);
+    pmf = 1.0 - p_infinite;
+    int k = 0;
+    while (!nodes[k].leaf) {
+      double p0 = left_probability(k, o);
+      if (u < p0) {
+        u = std::min(u / p0, ONE_MINUS_EPSILON);
+        pmf *= p0;
+        k = k + 1;
+      } else {
+        u = std::min((u - p0) / (1.0 - p0), ONE_MINUS_EPSILON);
+        pmf *= 1.0 - p0;
+        k = nodes[k].index;
+      }
+    }
+    return lights[nodes[k].index];
+  }
+
+  /// 範囲の条件を満たす子だけを降り、葉の光源のpdfを選ぶ確率で重み付けして足す
+  template<typename Inside, typename Pdf>
+  double pdf_node(int k, double prob, const point3 &o, const Inside &inside, const Pdf &light_pdf) const {
+    const node &n = nodes[k];
+    if (n.leaf) {
+      return prob * light_pdf(lights[n.index]);
+    }
+    double p0 = left_probability(k, o);
+    double sum = 0.0;
+    if (p0 > 0.0 && inside(nodes[k + 1].bounds.box)) {
+      sum += pdf_node(k + 1, prob * p0, o, inside, light_pdf);
+    }
+    if (p0 < 1.0 && inside(nodes[n.index].bounds.box)) {
+      sum += pdf_node(n.index, prob * (1.0 - p0), o, inside, light_pdf);
+    }
+    return sum;
+  }
+
+  /// 点rec.pを含む範囲の子だけを降り、その点を含む光源の属性を求める
+  bool record_node(int k, const point3 &o, hit_record<mat> &rec) const {
+    const node &n = nodes[k];
+    if (!contains(n.bounds.box, rec.p)) {
+      return false;
+    }
+    if (n.leaf) {
+      return lights[n.index]->light_record(o, rec);
+    }
+    return record_node(k + 1, o, rec) || record_node(n.index, o, rec);
+  }
+
+  static bool contains(const aabb &box, const point3 &p) {
+    for (int a = 0; a < 3; ++a) {
+      if (p[a] < box.min()[a] || box.max()[a] < p[a]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// 向きの円錐の広がりの測度
+  static double cone_measure(const light_bounds &b) {
+    double theta_w = std::min(b.theta_o + b.theta_e, M_PI);
+    double sin_o, cos_o;
+    fast_sincos(b.theta_o, sin_o, cos_o);
+    return 2 * M_PI * (1 - cos_o)
+        + M_PI / 2 * (2 * theta_w * sin_o - cos(b.theta_o - 2 * theta_w) - 2 * b.theta_o * sin_o + cos_o);
+  }
+
+  static double surface_area(const aabb &box) {
+    vec3 d = box.max() - box.min();
+    return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+  }
+
+  /// 分割のコスト: 放射束 x 向きの広がり x 表面積 (SAOH)
+  static double split_cost(const light_bounds &b, double kr) {
+    return b.phi <= 0.0 ? 0.0 : kr * b.phi * cone_measure(b) * surface_area(b.box);
+  }
+
+  /// [start, end)の光源からノードを作り、その番号を返す
+  int build(std::vector<build_item> &items, size_t start, size_t end) {
+    int k = int(nodes.size());
+    nodes.push_back(node());
+    if (end - start == 1) {
+      nodes[k] = node{items[start].bounds, items[start].light, true};
+      return k;
+    }
+
+    light_bounds bounds;
+    aabb centroids(centroid(items[start].bounds), centroid(items[start].bounds));
+    for (size_t i = start; i < end; ++i) {
+      bounds = union_bounds(bounds, items[i].bounds);
+      centroids = surrounding_box(centroids, aabb(centroid(items[i].bounds), centroid(items[i].bounds)));
+    }
+
+    /// 重心を軸毎にビンに分け、SAOHが最小の境界で分割する
+    vec3 extent = bounds.box.max() - bounds.box.min();
+    double max_extent = std::max(std::max(extent.x(), extent.y()), extent.z());
+    double best_cost = INF;
+    int best_axis = -1, best_bin = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      double lo = centroids.min()[axis], hi = centroids.max()[axis];
+      if (hi <= lo || extent[axis] <= 0.0) continue;
+      light_bounds bins[LIGHT_BVH_BINS];
+      for (size_t i = start; i < end; ++i) {
+        auto &bin = bins[bin_index(items[i].bounds, axis, lo, hi)];
+        bin = union_bounds(bin, items[i].bounds);
+      }
+      // 細長い範囲を長い軸で分けやすくする
+      double kr = max_extent / extent[axis];
+      for (int s = 0; s < LIGHT_BVH_BINS - 1; ++s) {
+        light_bounds left, right;
+        for (int b = 0; b <= s; ++b) left = union_bounds(left, bins[b]);
+        for (int b = s + 1; b < LIGHT_BVH_BINS; ++b) right = union_bounds(right, bins[b]);
+        if (left.phi <= 0.0 || right.phi <= 0.0) continue;
+        double cost = split_cost(left, kr) + split_cost(right, kr);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_bin = s;
+        }
+      }
+    }
+
+    size_t mid;
+    if (best_axis < 0) {
+      // 重心が分けられない場合は半分に分ける
+      mid = start + (end - start) / 2;
+    } else {
+      double lo = centroids.min()[best_axis], hi = centroids.max()[best_axis];
+      auto it = std::partition(items.begin() + start, items.begin() + end, [&](const build_item &item) {
+        return bin_index(item.bounds, best_axis, lo, hi) <= best_bin;
+      });
+      mid = size_t(it - items.begin());
+    }
+
+    build(items, start, mid);
+    int right = build(items, mid, end);
+    nodes[k] = node{bounds, right, false};
+    return k;
+  }
+
+  static point3 centroid(const light_bounds &b) {
+    return 0.5 * (b.box.min() + b.box.max());
+  }
+
+  static int bin_index(const light_bounds &b, int axis, double lo, double hi) {
+    return std::min(int(LIGHT_BVH_BINS * (centroid(b)[axis] - lo) / (hi - lo)), LIGHT_BVH_BINS - 1);
+  }
+
+ private:
+  // 範囲を持つ光源(葉から参照)
+  std::vector<const hittable<mat> *> lights;
+  // 範囲を持たない光源
+  std::vector<const hittable<mat> *> infinite;
+  double p_infinite{0.0};
+  // 深さ優先の順に並べたノード
+  std::vector<node> nodes;
+  // 光源の所有権
+  std::vector<shared_ptr<hittable<mat>>> holder;
+};
+
+#endif //FLUORSWITCH_SRC_UTILS_LIGHT_BVH_H_
@@ -0,0 +1,27 @@
+#ifndef FLUORSWITCH_SRC_UTILS_RADIANCE_TRAITS_H_
+#define FLUORSWITCH_SRC_UTILS_RADIANCE_TRAITS_H_
+
+#include "util_funcs.h"
+#include "spectral_distribution.h"
+
+/// 放射輝度の型(RGB / スペクトル)を成分単位で扱う
+template<typename T>
+struct radiance_traits;
+
+template<>
+struct radiance_traits<color> {
+  static size_t channels() { return 3; }
+  static color zero() { return ZERO; }
+  static double get(const color &c, size_t k) { return c[k]; }
+  static void set(color &c, size_t k, double value) { c[k] = value; }
+};
+
+template<>
+struct radiance_traits<spectral_distribution> {
+  static size_t channels() { return full_wavelength_size; }
+  static spectral_distribution zero() { return zero_spectra; }
+  static double get(const spectral_distribution &s, size_t k) { return s.get_intensity(k); }
+  static void set(spectral_distribution &s, size_t k, double value) { s.set_intensity(k, value); }
+};
+
+#endif //FLUORSWITCH_SRC_UTILS_RADIANCE_TRAITS_H_
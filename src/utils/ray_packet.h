@@ -0,0 +1,136 @@
+#ifndef FLUORSWITCH_SRC_UTILS_RAY_PACKET_H_
+#define FLUORSWITCH_SRC_UTILS_RAY_PACKET_H_
+
+#include <vector>
+#include "util_funcs.h"
+
+/// 近いレイ(画面のタイルのカメラレイ)の束
+/// 形状は成分毎の配列(SoA)をSIMDのループで判定し、BVHは束全体の区間演算で箱を丸ごと外す
+struct ray_packet {
+  explicit ray_packet(int capacity)
+      : rays(capacity), t_max(capacity), active(capacity),
+        ox(capacity), oy(capacity), oz(capacity),
+        dx(capacity), dy(capacity), dz(capacity),
+        ix(capacity), iy(capacity), iz(capacity) {}
+
+  void clear() {
+    size = 0;
+  }
+
+  void add(const ray &r) {
+    rays[size] = r;
+    t_max[size] = INF;
+    active[size] = 1;
+    ox[size] = r.origin().x();
+    oy[size] = r.origin().y();
+    oz[size] = r.origin().z();
+    dx[size] = r.direction().x();
+    dy[size] = r.direction().y();
+    dz[size] = r.direction().z();
+    ix[size] = 1.0 / dx[size];
+    iy[size] = 1.0 / dy[size];
+    iz[size] = 1.0 / dz[size];
+    ++size;
+  }
+
+  /// 加え終えたら、方向の符号がそろっているかと原点・方向の逆数の範囲を求める
+  void finalize() {
+    same_octant = size > 0;
+    const double *o[3] = {ox.data(), oy.data(), oz.data()};
+    const double *inv[3] = {ix.data(), iy.data(), iz.data()};
+    for (int a = 0; a < 3; ++a) {
+      neg[a] = size > 0 && inv[a][0] < 0.0 ? 1 : 0;
+      o_lo[a] = inv_lo[a] = INF;
+      o_hi[a] = inv_hi[a] = -INF;
+      for (int k = 0; k < size; ++k) {
+        o_lo[a] = ffmin(o_lo[a], o[a][k]);
+        o_hi[a] = ffmax(o_hi[a], o[a][k]);
+        inv_lo[a] = ffmin(inv_lo[a], inv[a][k]);
+        inv_hi[a] = ffmax(inv_hi[a], inv[a][k]);
+      }
+      // 軸に平行なレイがあると区間が無限になるので、束ごとの判定はしない
+      if (!std::isfinite(inv_lo[a]) || !std::isfinite(inv_hi[a]) || (inv_lo[a] < 0.0) != (inv_hi[a] < 0.0)) {
+        same_octant = false;
+      }
+    }
+  }
+
+  /// 区間演算で、束のどのレイも範囲[lo, hi]に当たらないことが分かればfalse(方向の符号がそろっている場合だけ)
+  bool may_hit(const double lo[3], const double hi[3]) const {
+    if (!same_octant) {
+      return true;
+    }
+    double t_near = t_min, t_far = INF;
+    for (int a = 0; a < 3; ++a) {
+      double nb = neg[a] ? hi[a] : lo[a];
+      double fb = neg[a] ? lo[a] : hi[a];
+      t_near = ffmax(t_near, interval_lower(nb - o_hi[a], nb - o_lo[a], inv_lo[a], inv_hi[a]));
+      t_far = ffmin(t_far, interval_upper(fb - o_hi[a], fb - o_lo[a], inv_lo[a], inv_hi[a]));
+    }
+    // 丸め誤差で当たるレイを外さないように少し広げる
+    return t_near <= t_far + 1e-9 * (fabs(t_far) + 1.0);
+  }
+
+  /// activeなレイ毎の範囲[lo, hi]との交差(mask[k]: [t_min, t_max[k]]で当たるか)、当たったレイの数を返す
+  int hit_box(const double lo[3], const double hi[3], int *mask) const {
+    int count = 0;
+    const double tn0 = t_min;
+#pragma omp simd reduction(+:count)
+    for (int k = 0; k < size; ++k) {
+      double t0 = ((ix[k] < 0.0 ? hi[0] : lo[0]) - ox[k]) * ix[k];
+      double t1 = ((ix[k] < 0.0 ? lo[0] : hi[0]) - ox[k]) * ix[k];
+      // NaN(面上の原点と軸に平行な方向)は比較が偽になるので無視される
+      double tn = t0 > tn0 ? t0 : tn0;
+      double tf = t1 < t_max[k] ? t1 : t_max[k];
+      t0 = ((iy[k] < 0.0 ? hi[1] : lo[1]) - oy[k]) * iy[k];
+      t1 = ((iy[k] < 0.0 ? lo[1] : hi[1]) - oy[k]) * iy[k];
+      tn = t0 > tn ? t0 : tn;
+      tf = t1 < tf ? t1 : tf;
+      t0 = ((iz[k] < 0.0 ? hi[2] : lo[2]) - oz[k]) * iz[k];
+      t1 = ((iz[k] < 0.0 ? lo[2] : hi[2]) - oz[k]) * iz[k];
+      tn = t0 > tn ? t0 : tn;
+      tf = t1 < tf ? t1 : tf;
+      mask[k] = active[k] && tn <= tf ? 1 : 0;
+      count += mask[k];
+    }
+    return count;
+  }
+
+  int active_count() const {
+    int count = 0;
+    for (int k = 0; k < size; ++k) {
+      count += active[k];
+    }
+    return count;
+  }
+
+ private:
+  /// [a0, a1] x [b0, b1] の下限と上限
+  static double interval_lower(double a0, double a1, double b0, double b1) {
+    return ffmin(ffmin(a0 * b0, a0 * b1), ffmin(a1 * b0, a1 * b1));
+  }
+  static double interval_upper(double a0, double a1, double b0, double b1) {
+    return ffmax(ffmax(a0 * b0, a0 * b1), ffmax(a1 * b0, a1 * b1));
+  }
+
+ public:
+  int size{0};
+  double t_min{0.001};
+  std::vector<ray> rays;
+  // レイ毎の最も近い交差までの距離(形状が交差した場合だけ縮める)
+  std::vector<double> t_max;
+  // 判定の対象か(BVHの葉では箱に当たったレイだけを立てる)
+  std::vector<int> active;
+  // 原点・方向・方向の逆数(SoA)
+  std::vector<double> ox, oy, oz;
+  std::vector<double> dx, dy, dz;
+  std::vector<double> ix, iy, iz;
+  // 全てのレイの方向の符号がそろっているか(区間演算で判定できるか)
+  bool same_octant{false};
+  int neg[3]{0, 0, 0};
+  // 原点と方向の逆数の範囲
+  double o_lo[3], o_hi[3];
+  double inv_lo[3], inv_hi[3];
+};
+
+#endif //FLUORSWITCH_SRC_UTILS_RAY_PACKET_H_
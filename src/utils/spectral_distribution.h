@@ -26,6 +26,10 @@ class spectral_distribution {
     return intensities[index];
   }
 
+  inline void set_intensity(const size_t index, const double intensity) {
+    intensities[index] = intensity;
+  }
+
   inline size_t size() const {
     return wavelengths.size();
   }
@@ -1,7 +1,9 @@
 #ifndef FLUORSWITCH_SRC_UTILS_UTIL_FUNCS_H_
 #define FLUORSWITCH_SRC_UTILS_UTIL_FUNCS_H_
 
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -11,6 +13,8 @@ using std::make_shared;
 using std::sqrt;
 
 constexpr double INF = std::numeric_limits<double>::infinity();
+// [0, 1)の一様乱数の最大値
+constexpr double ONE_MINUS_EPSILON = 1.0 - std::numeric_limits<double>::epsilon() * 0.5;
 constexpr long LIMIT_SEC = 599;
 
 inline double degrees_to_radians(double degrees) {
@@ -24,9 +28,92 @@ inline double clamp(double x, double min, double max) {
   return x;
 }
 
+/// 乱数列の差し替え先(PSSMLTの主標本空間、低食い違い量列のサンプラーなど)
+class random_stream {
+ public:
+  virtual ~random_stream() = default;
+  virtual double next() = 0;
+  /// パスの反射回数毎に次元をまとめて割り当てる列への通知(既定は何もしない)
+  virtual void begin_bounce(int /*bounce*/) {}
+};
+
+// スレッド毎の差し替え先(nullptrなら通常の乱数)
+inline random_stream *&current_random_stream() {
+  thread_local random_stream *stream = nullptr;
+  return stream;
+}
+
+/// PCG32 (O'Neill 2014)
+/// 状態はスレッド毎に持ち、(描画パス, 画素, サンプル番号, 用途)の組から種を決める
+/// スレッド数や画素の割り振り順に依らず同じ乱数列になる(グローバルなrand()のロックも無い)
+class pcg32 {
+ public:
+  pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+  void seed(uint64_t init_state, uint64_t sequence) {
+    state = 0;
+    inc = (sequence << 1) | 1;
+    next_u32();
+    state += init_state;
+    next_u32();
+  }
+
+  uint32_t next_u32() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    auto xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+    auto rot = uint32_t(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+
+  // [0,1)
+  double next_double() {
+    return next_u32() * (1.0 / 4294967296.0);
+  }
+
+ private:
+  uint64_t state;
+  uint64_t inc;
+};
+
+// 64bitの値の撹拌(splitmix64の出力関数)
+inline uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// スレッド毎の乱数
+inline pcg32 &thread_rng() {
+  thread_local pcg32 rng;
+  return rng;
+}
+
+// このスレッドの乱数列を(pass, pixel, sample, stream)で決める
+inline void seed_random(uint32_t pass, uint32_t pixel = 0, uint32_t sample = 0, uint32_t stream = 0) {
+  uint64_t key = (uint64_t(pass) << 32) | pixel;
+  uint64_t sequence = (uint64_t(sample) << 32) | stream;
+  thread_rng().seed(mix64(key + 0x9e3779b97f4a7c15ULL), mix64(sequence ^ mix64(key)));
+}
+
+// 差し替え先を通さない[0,1)の乱数
+inline double independent_random_double() {
+  return thread_rng().next_double();
+}
+
 // [0,1)の値をランダムで返す
 inline double random_double() {
-  return rand() / (RAND_MAX + 1.0);
+  if (random_stream *stream = current_random_stream()) {
+    return stream->next();
+  }
+  return independent_random_double();
+}
+
+// 反射回数bounceの乱数を使い始める(差し替え先が無ければ何もしない)
+inline void begin_bounce(int bounce) {
+  if (random_stream *stream = current_random_stream()) {
+    stream->begin_bounce(bounce);
+  }
 }
 
 // [min,max)のdoubleをランダムで返す
@@ -39,6 +126,27 @@ inline int random_int(int min, int max) {
   return static_cast<int>(random_double(min, max + 1));
 }
 
+// 浮動小数点のアトミック加算(CASループ)
+inline void atomic_add(std::atomic<double> &target, double value) {
+  double old = target.load(std::memory_order_relaxed);
+  while (!target.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+}
+
+// 固定小数点(小数部32ビット)のアトミック加算
+// 整数の加算は順序に依らないので、スレッド数やスケジュールが変わっても和はビット単位で同じになる
+constexpr double FIXED_POINT_SCALE = 4294967296.0;
+inline void atomic_add_fixed(std::atomic<int64_t> &target, double value) {
+  // 表せない値(NaN, 整数部の桁あふれ)は飽和させる
+  double v = value * FIXED_POINT_SCALE;
+  const double limit = 9.2e18;
+  v = v < limit ? (v > -limit ? v : -limit) : (v == v ? limit : 0.0);
+  target.fetch_add(std::llround(v), std::memory_order_relaxed);
+}
+
+inline double fixed_to_double(int64_t value) {
+  return double(value) / FIXED_POINT_SCALE;
+}
+
 // プログラムタイマー
 inline void program_timer() {
 #ifndef NDEBUG
@@ -73,6 +181,140 @@ inline void program_timer() {
 #define SPECTRAL_MAX_RAY_DEPTH 50 // 8
 #define CHANNEL_NUM 3
 
+// 時間予算プランナー
+#define USE_TIME_BUDGET 1
+#define BUDGET_MARGIN_SEC 15 // 制限時間に対する安全マージン
+#define BUDGET_MIN_PPS 1
+#define BUDGET_MAX_PPS 256
+#define BUDGET_EMA 0.5 // コスト見積もりの更新率
+#define PILOT_STRIDE 8 // パイロットパスの画素間隔
+#define PILOT_PPS 4
+
+// 再構成フィルタ(0: ボックス, 1: ガウシアン, 2: Mitchell, 3: Blackman-Harris)
+#define FILM_FILTER 0 // デノイザーと分散の推定は画素毎に独立なサンプルを前提にしているので既定はボックス
+#define FILM_FILTER_RADIUS 1.5 // ボックス以外の半径(画素)
+#define FILM_GAUSSIAN_ALPHA 2.0
+#define FILM_FILTER_TABLE_SIZE 16 // フィルタの表の一辺(1/4の範囲)
+
+// デノイザー
+#define USE_DENOISER 1
+#define DENOISE_ITERATIONS 5
+#define DENOISE_SIGMA_LUM 4.0
+#define DENOISE_SIGMA_NORMAL 128.0
+#define DENOISE_SIGMA_DEPTH 0.1
+#define DENOISE_SIGMA_ALBEDO 0.1
+#define DENOISE_ALBEDO_EPS 0.01
+
+// 時間方向のサンプル再利用
+#define USE_TEMPORAL_REUSE 1
+#define TEMPORAL_FRESH_RATIO 0.125 // 再利用する画素に追加する新規サンプルの割合
+#define TEMPORAL_MAX_HISTORY 8 // 履歴の上限(フレーム数相当)
+#define TEMPORAL_DEPTH_TOLERANCE 0.01
+#define TEMPORAL_NORMAL_TOLERANCE 0.99
+#define TEMPORAL_REJECT_SIGMA 4.0 // 新規サンプルと履歴の差の許容幅(標準偏差)
+#define TEMPORAL_REJECT_EPS 0.01
+
+// 放射輝度キャッシュ
+#define USE_RADIANCE_CACHE 0 // 偏りがあり、参照する値がスレッドのスケジュールに依る(スレッド数に依らず同じ画像にならない)ので既定はオフ
+#define CACHE_RGB_CAPACITY (1 << 18) // セル数(2の累乗)
+#define CACHE_SPECTRAL_CAPACITY (1 << 16)
+#define CACHE_CELL_SIZE 8.0 // セルの一辺
+#define CACHE_MIN_BOUNCE 1 // このバウンス以降の拡散面でキャッシュを参照
+#define CACHE_MIN_SAMPLES 32 // 参照に必要なサンプル数
+#define CACHE_MAX_PROBE 8 // 線形探索の上限
+
+// ReSTIRによる直接光
+// RGBフレームだけに対応する: integrator_traitsは蛍光項をBSDF(cos / π)として扱い、
+// 既存のスペクトラルのパストレーサー(混合pdfで重み付け)と同じ蛍光にならないので、スペクトラルフレームには使わない
+#define USE_RESTIR_DI_RGB 1
+#define RESTIR_CANDIDATES 8 // 画素毎の光源候補数
+#define RESTIR_TEMPORAL_M_CAP 20 // 前のサンプルから引き継ぐ候補数の上限(RESTIR_CANDIDATESの倍数)
+#define RESTIR_SPATIAL_NEIGHBORS 3
+#define RESTIR_SPATIAL_RADIUS 16 // 近傍画素の探索半径
+#define RESTIR_NORMAL_THRESHOLD 0.9
+#define RESTIR_DEPTH_THRESHOLD 0.1
+
+// パスガイディング(SD-tree)
+#define USE_PATH_GUIDING 0 // 単純なシーンでは同じ時間での誤差がむしろ増えるので既定はオフ
+#define GUIDING_SAMPLE_FRACTION 0.5 // BSDF側のサンプリングでガイドを選ぶ確率(初期値、空間ノード毎に学習)
+#define GUIDING_LEARNING_RATE 0.5 // 選択確率のロジットの学習率
+#define GUIDING_MAX_LOGIT 4.0
+#define GUIDING_SPATIAL_THRESHOLD 4000 // 空間ノードを分割する1フレームの記録数
+#define GUIDING_MAX_SPATIAL_LEAVES 4096
+#define GUIDING_SPLIT_FRACTION 0.01 // 方向ノードを分割するエネルギーの割合
+#define GUIDING_MAX_DEPTH 16 // 方向の四分木の最大深さ
+
+// スペクトラル・フォトンマッピング(SPPM)
+#define USE_PHOTON_MAPPING 0
+#define PHOTON_MAPPING_START_FRAME UV_LIGHT_ON_FRAME // このフレーム以降のスペクトラルフレームで使う
+#define PHOTONS_PER_PIXEL 0.25 // 描画パス毎のフォトン数(画素数に対する割合、コストを解像度に比例させる)
+#define PHOTON_MAX_DEPTH 16
+#define PHOTON_CHUNK_SIZE 256 // フォトンを貯める単位(番号順に連結する)
+#define PHOTON_INITIAL_RADIUS 8.0
+#define PHOTON_ALPHA 0.7 // 半径の縮小率
+#define PHOTON_NORMAL_THRESHOLD 0.5 // 収集するフォトンの法線の一致度
+
+// Primary Sample Space MLT
+#define USE_MLT 0
+#define MLT_LIGHT_THRESHOLD 0.3 // UVライトの強度がこれ以下のスペクトラルフレーム(蛍光が暗い)で使う
+#define MLT_BOOTSTRAP_PER_PIXEL 0.25 // 明るさの正規化に使うパス数(画素数に対する割合)
+#define MLT_CHAINS 64 // 連鎖の数(偶数、スレッド数に依らず固定して結果を変えない)
+#define MLT_LARGE_STEP_PROB 0.3
+#define MLT_SIGMA 0.01 // 小さな変異の標準偏差
+
+// 双方向パストレーシング
+#define USE_BDPT_RGB 0 // BDPT_MAX_DEPTHより長いパスを落とすので、閉じたシーンはRGB_MAX_RAY_DEPTHのパストレーサーより暗くなる
+#define USE_BDPT_SPECTRAL 0 // 蛍光をBSDF(cos / π)として扱うため既存のパストレーサーより暗くなる
+#define BDPT_MAX_DEPTH 8 // パスの最大反射回数(接続方法の数は二乗で増える)
+#if USE_BDPT_RGB && USE_RESTIR_DI_RGB
+#error "USE_BDPT_RGB and USE_RESTIR_DI_RGB select different RGB integrators; enable only one"
+#endif
+
+// 効率を考慮したロシアンルーレットと分岐(既存のパストレーサー用)
+#define USE_ADRRS 0 // 単純なシーンでは分岐で増える時間ほど誤差が減らないので既定はオフ
+#define ADRRS_TILE 16 // 統計をまとめる画面領域の大きさ(画素)
+#define ADRRS_MIN_SAMPLES 16 // 統計を使い始める領域 x 反射回数毎の記録数
+#define ADRRS_MIN_FACTOR 0.05 // 生き残る確率の下限
+#define ADRRS_MAX_SPLIT 8 // カメラからのパス1本当たりの分岐数の上限
+#define ADRRS_DUMP 0 // フレーム毎に領域毎の判断を表示
+
+// サンプラー(画素・レンズ・反射毎の乱数の次元の割り当て)
+#define SAMPLER_TYPE 1 // 0: 独立な乱数, 1: Sobol(Owenスクランブル), 2: Halton, 3: ブルーノイズで画素毎にずらしたSobol
+#define SAMPLER_MAX_BOUNCE 20 // これ以降の反射は独立な乱数(BDPTの光源側の部分パスを含む)
+
+// 環境光(HDR画像、開いたシーン用)
+#define USE_ENVIRONMENT_LIGHT 0 // コーネルボックスの正面以外は閉じているので既定はオフ
+#define ENVIRONMENT_MAP "./assets/hdr/environment.hdr"
+#define ENVIRONMENT_SCALE 1.0 // 画像の放射輝度の倍率
+#define ENVIRONMENT_RADIUS 1e6 // 環境光を置く球の半径(シーンに比べて十分大きく)
+
+// BVH(ビン分割のSAHかMorton符号のLBVHで、タスクで並列に構築する)
+#define BVH_BUILDER 0 // 0: ビン分割のSAH, 1: LBVH(SAHより速く作れるが木の品質は落ちる)
+#define BVH_BUILD_THREADS 0 // 構築に使うスレッド数(0: 使える全てのコア)
+#define BVH_PARALLEL_MIN_SIZE 4096 // これより多いプリミティブの範囲は、ビン分けを塊に分担し子を別のタスクで作る
+#define BVH_BINS 16 // 分割を探す軸毎のビンの数
+#define BVH_MAX_LEAF_SIZE 4 // 葉に入れるプリミティブの最大数
+#define BVH_TRAVERSAL_COST 1.0 // ノードを辿るコスト(プリミティブとの交差判定を1とする)
+#define BVH_WIDTH 4 // 辿るときのノードの子の数(2: 2分木のまま, 4: SSE, 8: AVX2の幅で子の範囲をまとめて判定する、8はCMakeのFLUORSWITCH_AVX2をONにしてビルドする)
+
+// レイの束(カメラレイを画面のタイル毎にまとめて最初の交差まで辿る)
+#define USE_RAY_PACKETS 1
+#define RAY_PACKET_TILE_SIZE 8 // タイルの1辺の画素数(8: 8x8, 16: 16x16のレイの束)
+#define RAY_PACKET_MIN_COHERENCE 0.25 // BVHの箱に当たるレイがこの割合を下回ったら1本ずつ辿る
+
+// 光源BVH(光源の選択とpdfの評価を点毎の寄与の見積もりに比例させる)
+#define USE_LIGHT_BVH 1
+#define LIGHT_BVH_BINS 12 // SAOHで分割を探す軸毎のビンの数
+
+// 数学関数の近似(サンプリング・球のUV・媒質の距離・Fresnel項、誤差の上限はfast_math.h)
+#ifndef USE_FAST_MATH
+#ifdef NDEBUG
+#define USE_FAST_MATH 1 // リリースビルドは多項式近似
+#else
+#define USE_FAST_MATH 0 // デバッグビルドは標準ライブラリ(近似はfast_math_testで標準ライブラリと比べて検査する)
+#endif
+#endif
+
 // シーン用の情報
 #define SPHERE_RADIUS 55
 #define LIGHT_WIDTH 150
@@ -152,12 +152,23 @@ inline vec3 unit_vector(vec3 v) {
   return v / v.length();
 }
 
+/// 同心円写像 (Shirley and Chiu 1997)
+/// 棄却法と違って乱数を常に2つだけ使うので、サンプラーの次元の割り当てがずれない
 inline vec3 random_in_unit_disk() {
-  while (true) {
-    auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-    if (p.squared_length() >= 1) continue;
-    return p;
+  double a = random_double(-1, 1);
+  double b = random_double(-1, 1);
+  if (a == 0.0 && b == 0.0) {
+    return vec3(0, 0, 0);
+  }
+  double r, theta;
+  if (fabs(a) > fabs(b)) {
+    r = a;
+    theta = M_PI * 0.25 * (b / a);
+  } else {
+    r = b;
+    theta = M_PI * 0.5 - M_PI * 0.25 * (a / b);
   }
+  return vec3(r * cos(theta), r * sin(theta), 0);
 }
 
 inline vec3 random_in_unit_sphere() {
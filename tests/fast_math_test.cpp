@@ -0,0 +1,124 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../src/utils/fast_math.h"
+
+/// 数学関数の近似(fast_math.h)の検査
+/// ビルドの種類(USE_FAST_MATH)に依らず近似そのものを標準ライブラリと比べる
+/// 引数に--benchmarkを付けると速度も表示する
+
+/// 近似の誤差が上限以内かを標準ライブラリと比べる
+bool check_error_bounds(std::ostream &out) {
+  const size_t n = 1 << 16;
+  std::vector<double> x(n), y(n), r0(n), r1(n);
+  double err_sincos = 0.0, err_atan2 = 0.0, err_log = 0.0, err_pow5 = 0.0;
+  // sin, cos: [-8π, 8π] と [-1e5, 1e5]
+  for (size_t i = 0; i < n; ++i) {
+    double u = (i + 0.5) / n;
+    x[i] = i % 2 ? (2.0 * u - 1.0) * 8.0 * M_PI : (2.0 * u - 1.0) * 1e5;
+  }
+  approx_sincos_n(x.data(), r0.data(), r1.data(), n);
+  for (size_t i = 0; i < n; ++i) {
+    double s, c;
+    approx_sincos(x[i], s, c);
+    err_sincos = std::max(err_sincos, std::max(fabs(s - sin(x[i])), fabs(c - cos(x[i]))));
+    err_sincos = std::max(err_sincos, std::max(fabs(r0[i] - sin(x[i])), fabs(r1[i] - cos(x[i]))));
+  }
+  // atan2: 単位円上の全周と原点付近・遠方
+  for (size_t i = 0; i < n; ++i) {
+    double phi = (i + 0.5) / n * 2.0 * M_PI;
+    double len = std::ldexp(1.0, int(i % 64) - 32);
+    y[i] = len * sin(phi);
+    x[i] = len * cos(phi);
+  }
+  approx_atan2_n(y.data(), x.data(), r0.data(), n);
+  for (size_t i = 0; i < n; ++i) {
+    err_atan2 = std::max(err_atan2, fabs(approx_atan2(y[i], x[i]) - atan2(y[i], x[i])));
+    err_atan2 = std::max(err_atan2, fabs(r0[i] - atan2(y[i], x[i])));
+  }
+  // log: (0, 1] の一様な乱数の範囲と [1e-300, 1e300]
+  for (size_t i = 0; i < n; ++i) {
+    double u = (i + 0.5) / n;
+    x[i] = i % 2 ? u : std::pow(10.0, 600.0 * u - 300.0);
+  }
+  approx_log_n(x.data(), r0.data(), n);
+  for (size_t i = 0; i < n; ++i) {
+    err_log = std::max(err_log, fabs(approx_log(x[i]) - log(x[i])));
+    err_log = std::max(err_log, fabs(r0[i] - log(x[i])));
+  }
+  bool zero_ok = approx_log(0.0) == -INF;
+  // pow5: [0, 1]
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = (i + 0.5) / n;
+  }
+  pow5_n(x.data(), r0.data(), n);
+  for (size_t i = 0; i < n; ++i) {
+    double p = std::pow(x[i], 5);
+    err_pow5 = std::max(err_pow5, fabs(pow5(x[i]) - p) / p);
+    err_pow5 = std::max(err_pow5, fabs(r0[i] - p) / p);
+  }
+
+  out << "fast math error: sincos " << err_sincos << ", atan2 " << err_atan2 << ", log " << err_log
+      << ", pow5 " << err_pow5 << std::endl;
+  if (err_sincos > APPROX_SINCOS_ERROR || err_atan2 > APPROX_ATAN2_ERROR || err_log > APPROX_LOG_ERROR
+      || !zero_ok || err_pow5 > POW5_ERROR) {
+    std::cerr << "fast math: error exceeds the bound" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/// 1回当たりの時間(ns)を標準ライブラリ・近似・まとめて計算する近似で比べる
+void benchmark(std::ostream &out) {
+  const size_t n = 1 << 20;
+  std::vector<double> x(n), y(n), phi(n), r0(n), r1(n);
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = random_double(1e-6, 1.0);
+    y[i] = random_double(-1.0, 1.0);
+    phi[i] = 2 * M_PI * random_double();
+  }
+  double sink = 0.0;
+  auto time_ns = [&](auto &&body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    auto end = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i += 4096) sink += r0[i] + r1[i];
+    return std::chrono::duration<double, std::nano>(end - start).count() / n;
+  };
+  auto row = [&](const char *name, double libm, double scalar, double batch) {
+    out << "  " << std::setw(7) << std::left << name << std::right << std::fixed << std::setprecision(2)
+        << " libm " << libm << "ns, approx " << scalar << "ns, batch " << batch << "ns" << std::endl;
+  };
+
+  out << "[fast math benchmark] " << n << " values" << std::endl;
+  row("sincos",
+      time_ns([&] { for (size_t i = 0; i < n; ++i) { r0[i] = sin(phi[i]); r1[i] = cos(phi[i]); }}),
+      time_ns([&] { for (size_t i = 0; i < n; ++i) approx_sincos(phi[i], r0[i], r1[i]); }),
+      time_ns([&] { approx_sincos_n(phi.data(), r0.data(), r1.data(), n); }));
+  row("atan2",
+      time_ns([&] { for (size_t i = 0; i < n; ++i) r0[i] = atan2(y[i], x[i]); }),
+      time_ns([&] { for (size_t i = 0; i < n; ++i) r0[i] = approx_atan2(y[i], x[i]); }),
+      time_ns([&] { approx_atan2_n(y.data(), x.data(), r0.data(), n); }));
+  row("log",
+      time_ns([&] { for (size_t i = 0; i < n; ++i) r0[i] = log(x[i]); }),
+      time_ns([&] { for (size_t i = 0; i < n; ++i) r0[i] = approx_log(x[i]); }),
+      time_ns([&] { approx_log_n(x.data(), r0.data(), n); }));
+  row("pow5",
+      time_ns([&] { for (size_t i = 0; i < n; ++i) r0[i] = std::pow(x[i], 5); }),
+      time_ns([&] { for (size_t i = 0; i < n; ++i) r0[i] = pow5(x[i]); }),
+      time_ns([&] { pow5_n(x.data(), r0.data(), n); }));
+  out << std::defaultfloat << "  (checksum " << sink << ")" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  if (!check_error_bounds(std::cout)) {
+    return 1;
+  }
+  if (argc > 1 && std::strcmp(argv[1], "--benchmark") == 0) {
+    benchmark(std::cout);
+  }
+  return 0;
+}